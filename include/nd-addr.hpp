@@ -451,6 +451,91 @@ public:
     uint8_t comparison_flags;
 };
 
+// Compact address for per-flow storage: an IPv4, IPv6 or
+// Ethernet address, port and family in 20 bytes rather than a
+// full ndAddr.  Convert with GetAddr() when an ndAddr is needed
+// (classification, lookups, plugins).
+class ndFlowAddr
+{
+public:
+    enum Family {
+        afNONE,
+        afINET,
+        afINET6,
+        afETHER,
+    };
+
+    ndFlowAddr() : addr{ 0 }, port(0), family(afNONE), pad(0) { }
+
+    static bool Create(ndFlowAddr &a,
+      const struct in_addr *in_addr);
+
+    static bool Create(ndFlowAddr &a,
+      const struct in6_addr *in6_addr);
+
+    static bool
+    Create(ndFlowAddr &a, const uint8_t *hw_addr, size_t length);
+
+    inline const uint8_t *GetAddress(void) const {
+        return addr;
+    }
+    inline size_t GetAddressSize(void) const {
+        switch (family) {
+        case afINET: return sizeof(struct in_addr);
+        case afINET6: return sizeof(struct in6_addr);
+        case afETHER: return ETH_ALEN;
+        default: return 0;
+        }
+    }
+
+    inline uint16_t GetPort(bool byte_swap = true) const {
+        if (! IsIP()) return 0;
+        return ((byte_swap) ? ntohs(port) : port);
+    }
+    inline bool SetPort(uint16_t port) {
+        if (! IsIP()) return false;
+        this->port = port;
+        return true;
+    }
+
+    inline bool IsValid(void) const { return (family != afNONE); }
+    inline bool IsEthernet(void) const {
+        return (family == afETHER);
+    }
+    inline bool IsIP(void) const {
+        return (family == afINET || family == afINET6);
+    }
+    inline bool IsIPv4(void) const { return (family == afINET); }
+    inline bool IsIPv6(void) const { return (family == afINET6); }
+
+    // IPv4 address in network byte order.
+    inline uint32_t GetIPv4(void) const {
+        uint32_t ip;
+        memcpy(&ip, addr, sizeof(ip));
+        return ip;
+    }
+
+    ndAddr GetAddr(void) const;
+
+    inline string GetString(uint8_t flags = ndAddr::mfNONE) const {
+        string result;
+        ndAddr::MakeString(GetAddr(), result, flags);
+        return result;
+    }
+
+    inline bool operator==(const ndFlowAddr &a) const {
+        return (memcmp(this, &a, sizeof(ndFlowAddr)) == 0);
+    }
+    inline bool operator!=(const ndFlowAddr &a) const {
+        return ! (a == *this);
+    }
+
+    uint8_t addr[16];
+    uint16_t port;
+    uint8_t family;
+    uint8_t pad;
+};
+
 template <size_t N>
 bool operator<(const bitset<N> &x, const bitset<N> &y) {
     for (int i = N - 1; i >= 0; i--) {
@@ -810,6 +895,9 @@ public:
 #endif
 #if defined(_ND_USE_NFQUEUE)
         case ndCT_NFQ: config_nfq = iface.config_nfq; break;
+#endif
+#if defined(_ND_USE_AF_XDP)
+        case ndCT_XDP: config_xdp = iface.config_xdp; break;
 #endif
         default: break;
         }
@@ -817,6 +905,10 @@ public:
 
     static size_t UpdateAddrs(ndInterfaces &interfaces);
 
+    // Stable, process-wide index for an interface name; used
+    // in place of the name in flow keys.
+    static uint32_t GetIndex(const string &ifname);
+
     size_t UpdateAddrs(const struct ifaddrs *if_addrs);
 
     template <class T>
@@ -848,6 +940,9 @@ public:
         case ndCT_NFQ:
             serialize(output, { "capture_type" }, "NFQ");
             break;
+        case ndCT_XDP:
+            serialize(output, { "capture_type" }, "XDP");
+            break;
         default:
             serialize(output, { "capture_type" }, "UNKNOWN");
             break;
@@ -934,6 +1029,11 @@ public:
         config_nfq = *nfq;
     }
 #endif
+#if defined(_ND_USE_AF_XDP)
+    inline void SetConfig(const nd_config_xdp *xdp) {
+        config_xdp = *xdp;
+    }
+#endif
 
     inline bool operator==(const ndInterface &i) const {
         if (ifname != i.ifname || ifname_peer != i.ifname_peer)
@@ -950,6 +1050,9 @@ public:
 #endif
 #if defined(_ND_USE_NFQUEUE)
         case ndCT_NFQ: return (config_nfq == i.config_nfq);
+#endif
+#if defined(_ND_USE_AF_XDP)
+        case ndCT_XDP: return (config_xdp == i.config_xdp);
 #endif
         }
         return true;
@@ -967,6 +1070,9 @@ public:
 #if defined(_ND_USE_NFQUEUE)
     nd_config_nfq config_nfq;
 #endif
+#if defined(_ND_USE_AF_XDP)
+    nd_config_xdp config_xdp;
+#endif
 
 protected:
     ndInterfaceAddr addrs;
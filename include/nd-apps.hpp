@@ -29,6 +29,7 @@
 #include <unordered_set>
 
 #include "nd-addr.hpp"
+#include "nd-flow-arena.hpp"
 
 using namespace std;
 
@@ -39,7 +40,6 @@ class ndFlow;
 class ndFlowParser;
 
 typedef uint32_t nd_app_id_t;
-typedef shared_ptr<ndFlow> nd_flow_ptr;
 
 class ndApplication
 {
@@ -39,6 +39,10 @@ public:
 
     inline struct mnl_socket *GetSocket(void) { return nl; }
 
+    inline ndPacketPool *GetPacketPool(void) {
+        return packet_pool;
+    }
+
     inline void PushPacket(ndPacket *pkt) {
         pkt_queue.push_back(pkt);
     }
@@ -22,6 +22,7 @@
 
 #include "nd-except.hpp"
 #include "nd-instance.hpp"
+#include "nd-packet-pool.hpp"
 #include "nd-thread.hpp"
 
 class ndCaptureThreadException : public runtime_error
@@ -38,7 +39,10 @@ public:
       nd_iface_ptr &iface, const nd_detection_threads &threads_dpi,
       ndDNSHintCache *dhc = NULL, uint8_t private_addr = 0);
 
-    virtual ~ndCaptureThread() { }
+    virtual ~ndCaptureThread() {
+        if (packet_pool != nullptr) packet_pool->Release();
+        if (flow_arena != nullptr) flow_arena->Release();
+    }
 
     virtual void *Entry(void) = 0;
 
@@ -47,6 +51,36 @@ public:
         this->stats.AddAndReset(stats);
     }
 
+    // Keys of flows needing an idle expiry timer (new flows, or
+    // ones whose TTL has changed) since the last call.
+    // XXX: Ensure thread is locked before calling!
+    void GetFlowTimers(vector<ndFlowKey> &keys) {
+        keys.swap(flow_timers);
+    }
+
+    // Keys of flows seen for the first time this update interval
+    // (see ndFlow::flags.active) since the last call.
+    // XXX: Ensure thread is locked before calling!
+    void GetActiveFlows(vector<ndFlowKey> &keys) {
+        keys.swap(flow_active);
+    }
+
+    // Run-to-completion: detect on this thread using a private
+    // (not started) detection thread instead of queuing.  Must be
+    // set before the capture thread is created.
+    void SetDetectionInline(int16_t id, ndDetectionThread *thread) {
+        dpi_inline_id = id;
+        dpi_inline = thread;
+    }
+    int16_t GetDetectionInlineId(void) const {
+        return (dpi_inline == nullptr) ? -1 : dpi_inline_id;
+    }
+
+    // Private flow map shard; zero selects the shared shard.
+    // Must be set before the capture thread is created.
+    void SetFlowMapShard(unsigned shard) { flow_shard = shard; }
+    unsigned GetFlowMapShard(void) const { return flow_shard; }
+
     enum nd_capture_states {
         STATE_INIT,
         STATE_ONLINE,
@@ -70,15 +104,37 @@ protected:
 
     ndPacketStats stats;
 
-    string flow_digest;
+    ndPacketPool *packet_pool;
+    ndFlowArena *flow_arena;
+
+    unsigned flow_shard;
+    uint32_t iface_index;
+
+    ndFlowMapCache flow_cache;
+    uint64_t flow_cache_misses;
+    uint64_t flow_lookup_ns;  // Sampled flow map lookup cost
+
+    vector<ndFlowKey> flow_timers;
+    vector<ndFlowKey> flow_active;
 
     ndDNSHintCache *dhc;
 
     const nd_detection_threads &threads_dpi;
-    int16_t dpi_thread_id;
+
+    ndDetectionThread *dpi_inline;
+    int16_t dpi_inline_id;
+
+    // Detection threads queued to since they were last notified.
+    vector<ndDetectionThread *> dpi_pending;
+    unsigned dpi_pending_packets;
 
     const ndPacket *ProcessPacket(const ndPacket *packet);
 
+    // Wake detection threads with newly queued packets.  Called
+    // at the end of each capture batch (and every
+    // ND_DETECTION_WAKE_BATCH packets), rather than per packet.
+    void NotifyDetectionThreads(void);
+
     bool ProcessDNSPacket(nd_flow_ptr &flow,
       const uint8_t *pkt, uint16_t pkt_len, uint16_t proto);
 };
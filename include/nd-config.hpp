@@ -44,6 +44,19 @@ enum nd_fhc_save {
     ndFHC_VOLATILE,
 };
 
+enum nd_flow_snapshot_save {
+    ndFSS_DISABLED,
+    ndFSS_PERSISTENT,
+    ndFSS_VOLATILE,
+};
+
+enum nd_flow_evict {
+    ndFE_DISABLED,
+    ndFE_OLDEST_IDLE,
+    ndFE_LRU,
+    ndFE_DETECTION_COMPLETE,
+};
+
 enum nd_capture_type {
     ndCT_NONE = 0,
     ndCT_CMDLINE = (1 << 0),
@@ -51,6 +64,7 @@ enum nd_capture_type {
     ndCT_PCAP_OFFLINE = (1 << 2),
     ndCT_TPV3 = (1 << 3),
     ndCT_NFQ = (1 << 4),
+    ndCT_XDP = (1 << 5),
 
     ndCT_USER = (1 << 31),
 };
@@ -79,6 +93,12 @@ enum nd_tpv3_fanout_flags {
     ndFOF_ROLLOVER = 0x2,
 };
 
+enum nd_xdp_mode {
+    ndXDP_AUTO,
+    ndXDP_SKB,
+    ndXDP_DRV,
+};
+
 enum nd_global_flags {
     ndGF_NONE = 0,
     ndGF_DEBUG = (1 << 0),
@@ -187,6 +207,8 @@ typedef struct nd_config_tpv3_t {
     unsigned rb_block_size{ ND_TPV3_RB_BLOCK_SIZE };
     unsigned rb_frame_size{ ND_TPV3_RB_FRAME_SIZE };
     unsigned rb_blocks{ ND_TPV3_RB_BLOCKS };
+    bool rb_zero_copy{ false };
+    bool run_to_completion{ false };
 
     inline bool operator==(const struct nd_config_tpv3_t &i) const {
         if (fanout_mode != i.fanout_mode) return false;
@@ -196,6 +218,9 @@ typedef struct nd_config_tpv3_t {
         if (rb_block_size != i.rb_block_size) return false;
         if (rb_frame_size != i.rb_frame_size) return false;
         if (rb_blocks != i.rb_blocks) return false;
+        if (rb_zero_copy != i.rb_zero_copy) return false;
+        if (run_to_completion != i.run_to_completion)
+            return false;
         return true;
     }
 } nd_config_tpv3;
@@ -209,6 +234,27 @@ typedef struct nd_config_nfq_t {
     }
 } nd_config_nfq;
 
+typedef struct nd_config_xdp_t {
+    unsigned queue_id{ 0 };
+    unsigned instances{ 0 };
+    unsigned mode{ ndXDP_AUTO };
+    unsigned frame_size{ ND_XDP_FRAME_SIZE };
+    unsigned frames{ ND_XDP_FRAMES };
+    unsigned ring_size{ ND_XDP_RING_SIZE };
+    bool zero_copy{ false };
+
+    inline bool operator==(const struct nd_config_xdp_t &i) const {
+        if (queue_id != i.queue_id) return false;
+        if (instances != i.instances) return false;
+        if (mode != i.mode) return false;
+        if (frame_size != i.frame_size) return false;
+        if (frames != i.frames) return false;
+        if (ring_size != i.ring_size) return false;
+        if (zero_copy != i.zero_copy) return false;
+        return true;
+    }
+} nd_config_xdp;
+
 class ndGlobalConfig
 {
 public:
@@ -233,15 +279,19 @@ public:
     string url_napi_bootstrap;
     enum nd_dhc_save dhc_save;
     enum nd_fhc_save fhc_save;
+    enum nd_flow_evict flow_evict;
+    enum nd_flow_snapshot_save flow_snapshot_save;
     enum nd_capture_type capture_type;
     unsigned capture_read_timeout;
     nd_config_tpv3 tpv3_defaults;
+    nd_config_xdp xdp_defaults;
     FILE *h_flow;
     int16_t ca_capture_base;
     int16_t ca_conntrack;
     int16_t ca_detection_base;
     int16_t ca_detection_cores;
     size_t max_packet_queue;
+    size_t max_flow_memory;
     uint16_t max_capture_length;
     uint32_t flags;
     uint8_t digest_app_config[SHA1_DIGEST_LENGTH];
@@ -249,11 +299,16 @@ public:
     uint8_t verbosity;
     uint8_t verbosity_flags;
     unsigned fhc_purge_divisor;
+    unsigned flow_admit_rate;
     unsigned fm_buckets;
+    unsigned fm_shards;
+    unsigned fm_cache_slots;
+    unsigned max_detection_cache;
     unsigned max_detection_pkts;
     unsigned max_fhc;
     unsigned max_flows;
     unsigned ttl_capture_delay;
+    unsigned ttl_detection_cache;
     unsigned ttl_dns_entry;
     unsigned ttl_idle_flow;
     unsigned ttl_idle_tcp_flow;
@@ -297,6 +352,9 @@ public:
     typedef map<string, string> Protocols;
     Protocols protocols;
 
+    typedef map<string, string> DetectionBudgets;
+    DetectionBudgets detection_budgets;
+
     typedef map<string, pair<unsigned, void *>> Interfaces;
     typedef map<nd_interface_role, Interfaces> InterfacesByRole;
     InterfacesByRole interfaces;
@@ -341,6 +399,9 @@ public:
 
     bool LoadInterfaces(const string &filename);
 
+    // Re-read the [protocols] section.
+    bool LoadProtocols(const string &filename);
+
     bool AddInterface(const string &iface,
       nd_interface_role role,
       unsigned type = ndCT_NONE,
@@ -0,0 +1,112 @@
+// Netify Agent
+// Copyright (C) 2015-2023 eGloo Incorporated
+// <http://www.egloo.ca>
+//
+// This program is free software: you can redistribute it
+// and/or modify it under the terms of the GNU General
+// Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your
+// option) any later version.
+//
+// This program is distributed in the hope that it will be
+// useful, but WITHOUT ANY WARRANTY; without even the
+// implied warranty of MERCHANTABILITY or FITNESS FOR A
+// PARTICULAR PURPOSE.  See the GNU General Public License
+// for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this program.  If not, see
+// <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <atomic>
+#include <vector>
+
+#include "nd-protos.hpp"
+
+using namespace std;
+
+#define _ND_DETECTION_BUDGET_BINS 64
+
+// Detection outcome of one protocol since last reported.
+struct ndDetectionBudgetStats {
+    nd_proto_id_t protocol;
+    unsigned budget;
+    uint64_t flows;
+    uint64_t detected;
+    uint64_t packets;
+};
+
+// Per-protocol detection packet budgets.
+//
+// A flow's budget is the number of packets nDPI may dissect
+// before detection gives up.  Flows with no protocol yet use
+// the "unknown" budget; flows with a protocol that are still
+// collecting metadata (extra packets) use that protocol's
+// budget.  Budgets never exceed max_detection_pkts.
+//
+// Budgets may be set by protocol name in the [detection-budget]
+// section.  The rest are learned from how many packets flows
+// needed: to be detected at all (unknown), or to complete (by
+// protocol).  Each learned budget covers the
+// ND_DETECTION_BUDGET_PERCENTILE of flows, plus a margin, once
+// enough flows have been seen.
+//
+// When a detection queue is congested, unknown flows give up
+// at a fraction of their budget.  Run-to-completion engines have
+// no queue, and so never give up early.
+//
+// Get() and the Add*() calls may be made from any detection
+// thread; Update() is called by the instance thread.
+class ndDetectionBudget
+{
+public:
+    enum Completion {
+        COMPLETE_DISSECTED,  // Completed by nDPI.
+        COMPLETE_EXHAUSTED,  // Ran out of budget.
+        COMPLETE_OTHER,  // Expired, cached, ...
+    };
+
+    ndDetectionBudget();
+    virtual ~ndDetectionBudget();
+
+    // Apply configured budgets (call once ndGC is loaded).
+    void Load(void);
+
+    unsigned Get(nd_proto_id_t protocol, bool congested) const;
+
+    // A flow was first detected after this many packets.
+    void AddDetected(unsigned packets);
+
+    // A flow completed detection.
+    void AddComplete(nd_proto_id_t protocol, bool detected,
+      unsigned packets, Completion completion);
+
+    // Re-learn budgets, and move the per-protocol outcomes seen
+    // since the last call.
+    void Update(vector<ndDetectionBudgetStats> &stats);
+
+protected:
+    struct Protocol {
+        atomic<unsigned> budget;
+        bool configured;
+
+        atomic<uint32_t> bins[_ND_DETECTION_BUDGET_BINS];
+
+        atomic<uint64_t> flows;
+        atomic<uint64_t> detected;
+        atomic<uint64_t> packets;
+    };
+
+    static inline size_t Index(nd_proto_id_t protocol) {
+        return (protocol < ND_PROTO_MAX) ?
+          (size_t)protocol :
+          (size_t)ND_PROTO_UNKNOWN;
+    }
+
+    void AddSample(Protocol &p, unsigned packets);
+    void Learn(Protocol &p);
+
+    Protocol *protocols;
+};
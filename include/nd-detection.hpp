@@ -20,10 +20,15 @@
 
 #pragma once
 
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
 #include "nd-except.hpp"
 #include "nd-flow-parser.hpp"
 
 class ndSocketThread;
+class ndDetectionScheduler;
 
 class ndDetectionThreadException : public runtime_error
 {
@@ -35,6 +40,8 @@ public:
 class ndDetectionQueueEntry
 {
 public:
+    ndDetectionQueueEntry()
+      : packet(nullptr), data(nullptr), length(0) { }
     ndDetectionQueueEntry(nd_flow_ptr &flow,
       const ndPacket *packet,
       const uint8_t *data,
@@ -51,6 +58,137 @@ public:
     uint16_t length;
 };
 
+// Bounded multi-producer, single-consumer ring of detection
+// queue entries, stored inline.  Producers (capture threads,
+// and the instance for expiring flows) claim a slot with a CAS
+// on the tail; the detection thread is the only consumer.  Each
+// slot carries a sequence number, so neither side takes a lock.
+//
+// Packets are also charged (packet plus payload) against a byte
+// budget, max_packet_queue_kb.  A push over budget, or in to a
+// full ring, fails and the caller keeps ownership of the packet.
+class ndDetectionQueue
+{
+public:
+    ndDetectionQueue(size_t max_bytes);
+    virtual ~ndDetectionQueue();
+
+    bool Push(nd_flow_ptr &flow, const ndPacket *packet,
+      const uint8_t *data, uint16_t length);
+
+    // Consumer only.  The entry is processed in place, and
+    // handed back (and its packet freed) by Pop().
+    ndDetectionQueueEntry *Front(void);
+    void Pop(void);
+
+    // Head first: read the other way round, the consumer could
+    // pass the tail read in between.
+    inline size_t GetDepth(void) const {
+        size_t h = head.load(memory_order_acquire);
+        size_t t = tail.load(memory_order_acquire);
+        return (t > h) ? t - h : 0;
+    }
+    inline size_t GetBytes(void) const {
+        return bytes.load(memory_order_relaxed);
+    }
+
+    // Over ND_DETECTION_QUEUE_CONGESTED percent of its slots or
+    // byte budget in use.
+    inline bool IsCongested(void) const {
+        return (GetDepth() * 100 >
+            (mask + 1) * ND_DETECTION_QUEUE_CONGESTED ||
+          GetBytes() * 100 > max_bytes * ND_DETECTION_QUEUE_CONGESTED);
+    }
+
+    // Deepest the queue has been since the last call.
+    size_t GetHighWater(void);
+
+    // Time entries spent queued (until processed), sampled one
+    // in ND_DETECTION_QUEUE_SAMPLE; totals since the last call.
+    void GetLatency(uint64_t &total_ns, uint64_t &samples,
+      uint64_t &max_ns);
+
+protected:
+    struct Slot {
+        atomic<size_t> seq;
+        size_t bytes;
+        uint64_t ts_queued;
+        ndDetectionQueueEntry entry;
+    };
+
+    Slot *slots;
+    size_t mask;
+    size_t max_bytes;
+
+    atomic<size_t> head;
+    atomic<size_t> tail;
+    atomic<size_t> bytes;
+    atomic<size_t> high_water;
+
+    atomic<uint64_t> latency_ns;
+    atomic<uint64_t> latency_samples;
+    atomic<uint64_t> latency_max_ns;
+};
+
+// Detection results of completed flows, keyed on the server
+// endpoint: address, port, IP protocol and the host name (TLS or
+// QUIC SNI, HTTP host, ...) nDPI saw on first detection.  Later
+// flows to the same endpoint take the cached result and skip any
+// remaining detection packets.
+//
+// Bounded (least recently used entries are dropped first), and
+// entries expire ttl seconds after they were stored.  One cache
+// is shared by all detection threads (see ndInstance), as any of
+// them may be handed the next flow to a given endpoint.
+class ndDetectionCache
+{
+public:
+    struct Entry {
+        uint64_t key;
+        uint64_t ts_expires;
+        nd_proto_id_t protocol;
+        nd_app_id_t application;
+        nd_cat_id_t category_application;
+        nd_cat_id_t category_protocol;
+        nd_cat_id_t category_domain;
+    };
+
+    ndDetectionCache(size_t cache_size, unsigned ttl)
+      : cache_size(cache_size), ttl(ttl), hits(0), misses(0),
+        entries(0) { }
+
+    // Key of a flow's server endpoint and host name, or zero if
+    // the flow's server side is unknown (or not an IP address).
+    static uint64_t MakeKey(const ndFlow &flow, const char *host);
+
+    // Timestamps are flow (packet) times, in milliseconds.  On
+    // a hit, the entry is copied to entry.
+    bool Lookup(uint64_t key, uint64_t ts_now, Entry &entry);
+    void Insert(Entry &entry, uint64_t ts_now);
+    void Clear(void);
+
+    // Hits and misses since the last call.
+    inline uint64_t GetHits(void) { return hits.exchange(0); }
+    inline uint64_t GetMisses(void) { return misses.exchange(0); }
+    inline size_t GetSize(void) const { return entries.load(); }
+
+protected:
+    typedef list<Entry> nd_dc_list;
+    typedef unordered_map<uint64_t, nd_dc_list::iterator> nd_dc_map;
+
+    mutex lock;
+
+    size_t cache_size;
+    unsigned ttl;
+
+    nd_dc_list index;
+    nd_dc_map lookup;
+
+    atomic<uint64_t> hits;
+    atomic<uint64_t> misses;
+    atomic<size_t> entries;
+};
+
 class ndDetectionThread : public ndThread, public ndInstanceClient
 {
 public:
@@ -62,20 +200,58 @@ public:
       ndConntrackThread *thread_conntrack,
 #endif
       ndDNSHintCache *dhc = NULL,
-      ndFlowHashCache *fhc = NULL, uint8_t private_addr = 0);
+      ndFlowHashCache *fhc = NULL, ndDetectionCache *dc = NULL,
+      uint8_t private_addr = 0);
 
     virtual ~ndDetectionThread();
 
-    // XXX: Not thread-safe!  Lock before calling...
-    virtual void Reload(void);
+    // Hand the detection thread a new nDPI detection module (and
+    // the caller's reference to it), which it switches over to
+    // between packets.  New flows start detection on the new
+    // module; flows already in progress finish on the one they
+    // started on.
+    virtual void Reload(ndNDPIModule *module);
 
-    void QueuePacket(nd_flow_ptr &flow,
+    // Returns false if the queue is full; ownership of the
+    // packet then stays with the caller.  Does not wake the
+    // detection thread; follow a batch of calls with Notify().
+    bool QueuePacket(nd_flow_ptr &flow,
       const ndPacket *packet = nullptr,
       const uint8_t *data = nullptr,
       uint16_t length = 0);
 
+    // Wake the detection thread, if it is parked.  Any thread.
+    void Notify(void);
+
+    // Run-to-completion: process a packet (or an expiring flow)
+    // synchronously on the caller's thread.  The packet is not
+    // queued and remains owned by the caller.
+    void ProcessInline(nd_flow_ptr &flow,
+      const ndPacket *packet = nullptr,
+      const uint8_t *data = nullptr,
+      uint16_t length = 0);
+
+    // Detection thread only.
     struct ndpi_detection_module_struct *GetDetectionModule(void) {
-        return ndpi;
+        return ndpi_module->Get();
+    }
+
+    inline ndDetectionQueue &GetQueue(void) { return pkt_queue; }
+
+    // Wake-ups (cond signals) since the last call.
+    inline uint64_t GetWakeups(void) { return wakeups.exchange(0); }
+
+    // Scheduling load: queue depth, plus recent CPU time (see
+    // ND_DETECTION_LOAD_CPU_WEIGHT).
+    inline size_t GetLoad(void) const {
+        return pkt_queue.GetDepth() +
+          cpu_load.load(memory_order_relaxed) *
+          ND_DETECTION_LOAD_CPU_WEIGHT / 1000;
+    }
+
+    // Must be set before the thread is created.
+    void SetScheduler(ndDetectionScheduler *scheduler) {
+        this->scheduler = scheduler;
     }
 
     virtual void *Entry(void);
@@ -87,30 +263,58 @@ protected:
 #ifdef _ND_USE_CONNTRACK
     ndConntrackThread *thread_conntrack;
 #endif
-    struct ndpi_detection_module_struct *ndpi;
+    ndNDPIModule *ndpi_module;
+    // Published by Reload(), picked up by SwapModule().
+    atomic<ndNDPIModule *> ndpi_pending;
+    ndNDPIFlowPool *ndpi_flow_pool;
 
     ndAddr::PrivatePair private_addrs;
 
     ndDNSHintCache *dhc;
     ndFlowHashCache *fhc;
+    ndDetectionCache *dc;
 
     string flow_digest, flow_digest_mdata;
 
-    queue<ndDetectionQueueEntry *> pkt_queue;
+    ndDetectionQueue pkt_queue;
     pthread_cond_t pkt_queue_cond;
     pthread_mutex_t pkt_queue_cond_mutex;
 
+    // Set while waiting on pkt_queue_cond; producers only signal
+    // a parked thread.
+    atomic<bool> parked;
+    unsigned spin_limit;
+    atomic<uint64_t> wakeups;
+
+    ndDetectionScheduler *scheduler;
+
+    friend class ndDetectionScheduler;
+
+    // ID of an idle thread asking for work, or -1.
+    atomic<int16_t> steal_request;
+
+    // Busy time, per mille, over the last load interval.
+    atomic<unsigned> cpu_load;
+    struct timespec ts_load_wall;
+    struct timespec ts_load_cpu;
+
     size_t flows;
 
     ndFlowParser parser;
 
+    void SwapModule(void);
     void ProcessPacketQueue(void);
+    bool SpinPacketQueue(void);
+    void Park(void);
+    void UpdateLoad(void);
+    void ProcessEntry(ndDetectionQueueEntry *entry);
     void ProcessPacket(ndDetectionQueueEntry *entry);
     bool ProcessALPN(ndDetectionQueueEntry *entry,
       bool client = true);
     void ProcessFlow(ndDetectionQueueEntry *entry);
     void ProcessRisks(ndDetectionQueueEntry *entry);
 
+    bool SetCachedDetection(ndDetectionQueueEntry *entry);
     void SetDetectedApplication(ndDetectionQueueEntry *entry,
       nd_app_id_t app_id);
     void SetGuessedProtocol(ndDetectionQueueEntry *entry);
@@ -118,3 +322,59 @@ protected:
 
     void FlowUpdate(ndDetectionQueueEntry *entry);
 };
+
+// Places flows on detection threads, and moves flows that have
+// not yet started detection from busy threads to idle ones.
+//
+// A new flow goes to the thread with the least load (queue depth
+// and recent CPU time).  A thread with nothing left to do posts a
+// steal request to the most backlogged thread, which hands over
+// the next flow it dequeues that is yet to see detection and has
+// no other entries queued.  Entries are only queued, and flows
+// only moved, under the flow's dpi_lock, so a flow's packets are
+// always processed in order, on one thread at a time.
+class ndDetectionScheduler
+{
+public:
+    ndDetectionScheduler(const nd_detection_threads &threads);
+
+    // Queue a packet (or expiry request) on the flow's thread,
+    // placing the flow first if need be.  The thread is returned,
+    // or nullptr if the flow's thread no longer exists.
+    bool QueuePacket(nd_flow_ptr &flow, ndDetectionThread *&thread,
+      const ndPacket *packet = nullptr,
+      const uint8_t *data = nullptr,
+      uint16_t length = 0);
+
+    // Detection thread calls; see above.
+    void RequestSteal(ndDetectionThread *thief);
+    bool Donate(ndDetectionThread *donor,
+      ndDetectionQueueEntry *entry);
+
+    // Stop moving flows between threads, and wait for any move in
+    // progress; call before destroying detection threads.
+    void Disable(void);
+
+    // Flows moved since the last call.
+    inline uint64_t GetSteals(void) { return steals.exchange(0); }
+
+protected:
+    int16_t Place(void);
+    ndDetectionThread *Find(int16_t id) const;
+    int16_t FindId(const ndDetectionThread *thread) const;
+
+    static inline void LockFlow(nd_flow_ptr &flow) {
+        while (flow->dpi_lock.exchange(true, memory_order_acquire))
+            ;
+    }
+    static inline void UnlockFlow(nd_flow_ptr &flow) {
+        flow->dpi_lock.store(false, memory_order_release);
+    }
+
+    vector<pair<int16_t, ndDetectionThread *>> threads;
+
+    atomic<size_t> cursor;
+    atomic<bool> enabled;
+    atomic<unsigned> donating;
+    atomic<uint64_t> steals;
+};
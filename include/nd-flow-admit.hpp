@@ -0,0 +1,86 @@
+// Netify Agent
+// Copyright (C) 2015-2023 eGloo Incorporated
+// <http://www.egloo.ca>
+//
+// This program is free software: you can redistribute it
+// and/or modify it under the terms of the GNU General
+// Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your
+// option) any later version.
+//
+// This program is distributed in the hope that it will be
+// useful, but WITHOUT ANY WARRANTY; without even the
+// implied warranty of MERCHANTABILITY or FITNESS FOR A
+// PARTICULAR PURPOSE.  See the GNU General Public License
+// for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this program.  If not, see
+// <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+#include <mutex>
+#include <vector>
+
+#include "nd-addr.hpp"
+
+using namespace std;
+
+#define _ND_FLOW_ADMIT_DEPTH 4
+#define _ND_FLOW_ADMIT_WIDTH 2048  // Power of 2
+#define _ND_FLOW_ADMIT_MASK  (_ND_FLOW_ADMIT_WIDTH - 1)
+
+// A source which has exceeded the new flow rate, and for how
+// many (one second) windows since last reported.
+struct ndFlowAdmissionOffender {
+    ndFlowAddr addr;
+    uint32_t windows;
+};
+
+// Per-source new flow rate limiter.
+//
+// New flows are counted by source address in a count-min
+// sketch (conservative update) over one second windows, so
+// memory use is fixed regardless of how many sources a scan
+// or flood is spread across.  Each counter is tagged with the
+// window it counts in, and reads as zero in any later window,
+// so the sketch is never cleared.  A source whose estimate exceeds
+// the rate is refused new flows until the next window.  As
+// the sketch can only over-estimate, the rate should be set
+// comfortably above legitimate peaks.
+//
+// Offending sources are tracked as heavy hitters (Space-Saving)
+// in a small table, updated only once per source per window
+// (sources sharing a slot of the seen table may be missed).
+//
+// Admit() may be called from any capture thread.
+class ndFlowAdmission
+{
+public:
+    ndFlowAdmission(unsigned rate);
+
+    // Count a new flow from addr (port is ignored), at time now
+    // (seconds); returns false if it should be refused.
+    bool Admit(const ndFlowAddr &addr, time_t now);
+
+    // Move the offenders seen since the last call, heaviest
+    // first.
+    void GetOffenders(vector<ndFlowAdmissionOffender> &offenders);
+
+protected:
+    void AddOffender(const ndFlowAddr &addr);
+
+    unsigned rate;
+    // Window (high 32 bits) and count (low 32 bits).
+    atomic<uint64_t> counters[_ND_FLOW_ADMIT_DEPTH]
+                             [_ND_FLOW_ADMIT_WIDTH];
+    // Window in which each slot last reported an offender.
+    atomic<uint32_t> seen[_ND_FLOW_ADMIT_WIDTH];
+
+    mutex offenders_lock;
+    vector<ndFlowAdmissionOffender> offenders;
+};
@@ -0,0 +1,175 @@
+// Netify Agent
+// Copyright (C) 2015-2023 eGloo Incorporated
+// <http://www.egloo.ca>
+//
+// This program is free software: you can redistribute it
+// and/or modify it under the terms of the GNU General
+// Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your
+// option) any later version.
+//
+// This program is distributed in the hope that it will be
+// useful, but WITHOUT ANY WARRANTY; without even the
+// implied warranty of MERCHANTABILITY or FITNESS FOR A
+// PARTICULAR PURPOSE.  See the GNU General Public License
+// for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this program.  If not, see
+// <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+#define ND_FLOW_ARENA_SLAB_FLOWS \
+    256  // Flows allocated per arena slab.
+
+class ndFlow;
+class ndFlowArena;
+
+// Every arena flow is prefixed by this header, which holds
+// the flow's reference count and lets any thread return it to
+// the arena that owns it.
+struct ndFlowArenaObject {
+    atomic<long> refs;
+    ndFlowArena *arena;
+    ndFlowArenaObject *next;
+} __attribute__((aligned(16)));
+
+#define _ND_FLOW_ARENA_HDR_SIZE \
+    ((sizeof(ndFlowArenaObject) + 15) & ~((size_t)15))
+
+// Intrusively reference counted flow handle.  Behaves like
+// the shared_ptr<ndFlow> it replaces (copy, move, reset, bool,
+// use_count), without a separate control block.  Handles can
+// only be created by ndFlowArena.
+class ndFlowPtr
+{
+public:
+    ndFlowPtr() : flow(nullptr) { }
+    ndFlowPtr(nullptr_t) : flow(nullptr) { }
+    ndFlowPtr(const ndFlowPtr &p) : flow(p.flow) { Acquire(); }
+    ndFlowPtr(ndFlowPtr &&p) : flow(p.flow) { p.flow = nullptr; }
+
+    ~ndFlowPtr() { Release(); }
+
+    inline ndFlowPtr &operator=(const ndFlowPtr &p) {
+        ndFlowPtr(p).swap(*this);
+        return *this;
+    }
+    inline ndFlowPtr &operator=(ndFlowPtr &&p) {
+        ndFlowPtr(move(p)).swap(*this);
+        return *this;
+    }
+
+    inline ndFlow *get(void) const { return flow; }
+    inline ndFlow *operator->() const { return flow; }
+    inline ndFlow &operator*() const { return *flow; }
+
+    inline explicit operator bool() const {
+        return (flow != nullptr);
+    }
+
+    inline long use_count(void) const {
+        return (flow == nullptr) ? 0 : Object()->refs.load();
+    }
+
+    inline void reset(void) { ndFlowPtr().swap(*this); }
+
+    inline void swap(ndFlowPtr &p) {
+        ndFlow *f = flow;
+        flow = p.flow;
+        p.flow = f;
+    }
+
+    inline bool operator==(const ndFlowPtr &p) const {
+        return (flow == p.flow);
+    }
+    inline bool operator!=(const ndFlowPtr &p) const {
+        return (flow != p.flow);
+    }
+
+protected:
+    friend class ndFlowArena;
+
+    // Adopt a newly created flow (reference count of one).
+    explicit ndFlowPtr(ndFlow *flow) : flow(flow) { }
+
+    inline ndFlowArenaObject *Object(void) const {
+        return reinterpret_cast<ndFlowArenaObject *>(
+          reinterpret_cast<uint8_t *>(flow) - _ND_FLOW_ARENA_HDR_SIZE);
+    }
+
+    inline void Acquire(void) {
+        if (flow != nullptr)
+            Object()->refs.fetch_add(1, memory_order_relaxed);
+    }
+
+    void Release(void);
+
+    ndFlow *flow;
+};
+
+typedef ndFlowPtr nd_flow_ptr;
+
+// Per-capture-thread slab allocator for flows.
+//
+// Flows are carved out of slabs which are never returned to
+// the system while the arena exists, so in steady state flow
+// creation and teardown do not touch the heap.  Capture
+// threads are usually pinned, so the slabs are first-touched
+// (and placed) on the capture thread's NUMA node.
+//
+// As with ndPacketPool, only the owning thread allocates.
+// The last reference to a flow may be dropped by any thread;
+// the flow is destroyed there and its slot pushed on to a
+// lock-free return stack, reclaimed by the owner in bulk.
+// The arena is reference counted (owner plus one per live
+// flow) so that flows may outlive their capture thread.
+class ndFlowArena
+{
+public:
+    ndFlowArena(const string &tag);
+
+    // Copy construct a new flow.  Owner thread only.
+    nd_flow_ptr Create(const ndFlow &flow);
+
+    // Destroy a flow and return it to its arena.  Any thread.
+    static void Free(ndFlow *flow);
+
+    // Drop the owner's reference.
+    void Release(void);
+
+protected:
+    virtual ~ndFlowArena();
+
+    void Reclaim(void);
+    void Grow(void);
+
+    string tag;
+    atomic<size_t> refs;
+    atomic<ndFlowArenaObject *> returned;
+
+    ndFlowArenaObject *free_list;
+    vector<void *> slabs;
+    size_t object_size;
+
+    uint64_t allocs;
+    uint64_t hits;
+};
+
+inline void ndFlowPtr::Release(void) {
+    if (flow == nullptr) return;
+    if (Object()->refs.fetch_sub(1, memory_order_acq_rel) == 1)
+        ndFlowArena::Free(flow);
+    flow = nullptr;
+}
@@ -20,10 +20,11 @@
 
 #pragma once
 
+#include <atomic>
+#include <cstdint>
 #include <map>
 #include <memory>
 #include <mutex>
-#include <unordered_map>
 #include <utility>
 #include <vector>
 
@@ -31,56 +32,307 @@
 
 using namespace std;
 
-typedef shared_ptr<ndFlow> nd_flow_ptr;
-typedef unordered_map<string, nd_flow_ptr> nd_flow_map;
+typedef pair<ndFlowKey, nd_flow_ptr> nd_flow_pair;
+
+// Epoch-based reclamation for the lock-free flow map.
+//
+// Threads reading the map announce the current global epoch
+// (Enter) for the duration of an operation.  Unlinked entries
+// and tables are retired and only freed once every announced
+// reader has moved on.  Nesting is permitted.
+class ndFlowMapEpoch
+{
+public:
+    static void Enter(void);
+    static void Exit(void);
+
+    static uint64_t Current(void);
+    static bool TryAdvance(void);
+};
+
+class ndFlowMapEpochGuard
+{
+public:
+    ndFlowMapEpochGuard() { ndFlowMapEpoch::Enter(); }
+    ~ndFlowMapEpochGuard() { ndFlowMapEpoch::Exit(); }
+};
+
+// An open-addressing slot.  The tag (upper 32 bits of the key
+// hash) is written after the entry is published; zero means
+// "not yet known", and the entry's key must be compared.
+struct ndFlowMapSlot {
+    atomic<uint32_t> tag;
+    atomic<nd_flow_pair *> entry;
+};
+
+#define _ND_FLOW_MAP_TOMBSTONE \
+    (reinterpret_cast<nd_flow_pair *>(uintptr_t(1)))
+
+// A fixed-capacity, linear-probe table.  Slots are allocated
+// cache line aligned so that probes mostly stay within a line.
+// Deleted slots become tombstones and are never reused; they
+// are dropped when the table is next grown (or compacted).
+struct ndFlowMapTable {
+    size_t capacity;
+    size_t threshold;
+    atomic<size_t> used;
+    ndFlowMapSlot *slots;
+
+    static ndFlowMapTable *Create(size_t capacity);
+    static void Destroy(void *table);
+
+    inline size_t Index(const ndFlowKey &key) const {
+        return (size_t)(key.hash >> 20) & (capacity - 1);
+    }
+    static inline uint32_t Tag(const ndFlowKey &key) {
+        return (uint32_t)(key.hash >> 32) | 1;
+    }
+};
+
+class ndFlowMap;
+
+// One flow map bucket.  Lookups and inserts are lock-free;
+// erase, iteration and table growth are serialized by the
+// bucket lock (ndFlowMap::Acquire/Release).
+class ndFlowMapBucket
+{
+public:
+    class iterator
+    {
+    public:
+        iterator(const ndFlowMapTable *table, size_t index)
+          : table(table), index(index) {
+            Skip();
+        }
+
+        inline nd_flow_pair &operator*() const {
+            return *table->slots[index].entry.load(
+              memory_order_acquire);
+        }
+        inline nd_flow_pair *operator->() const {
+            return table->slots[index].entry.load(
+              memory_order_acquire);
+        }
+
+        inline iterator &operator++() {
+            index++;
+            Skip();
+            return *this;
+        }
+        inline iterator operator++(int) {
+            iterator i = *this;
+            ++(*this);
+            return i;
+        }
+
+        inline bool operator==(const iterator &i) const {
+            return (index == i.index);
+        }
+        inline bool operator!=(const iterator &i) const {
+            return (index != i.index);
+        }
+
+    protected:
+        friend class ndFlowMapBucket;
+
+        inline void Skip(void) {
+            for (; index < table->capacity; index++) {
+                nd_flow_pair *e = table->slots[index].entry.load(
+                  memory_order_acquire);
+                if (e != nullptr && e != _ND_FLOW_MAP_TOMBSTONE)
+                    break;
+            }
+        }
+
+        const ndFlowMapTable *table;
+        size_t index;
+    };
+
+    // XXX: Acquire the bucket before iterating or erasing!
+    iterator begin(void) const {
+        return iterator(table.load(memory_order_acquire), 0);
+    }
+    iterator end(void) const {
+        const ndFlowMapTable *t = table.load(memory_order_acquire);
+        return iterator(t, t->capacity);
+    }
+    // Iterate from an arbitrary slot (modulo capacity), such as
+    // when sampling entries.
+    iterator from(size_t slot) const {
+        const ndFlowMapTable *t = table.load(memory_order_acquire);
+        return iterator(t, slot & (t->capacity - 1));
+    }
+
+    iterator erase(iterator i);
+
+    inline size_t size(void) const { return count.load(); }
+
+    // Bumped whenever an entry is removed from this bucket.
+    inline uint64_t GetGeneration(void) const {
+        return generation.load(memory_order_acquire);
+    }
+
+protected:
+    friend class ndFlowMap;
+
+    ndFlowMapBucket(ndFlowMap *map, size_t capacity);
+    virtual ~ndFlowMapBucket();
+
+    ndFlowMap *map;
+
+    atomic<ndFlowMapTable *> table;
+    atomic<size_t> count;
+    atomic<uint64_t> generation;
+
+    // Inserts in progress, and table growth in progress.
+    atomic<unsigned> writers;
+    atomic<bool> frozen;
+
+    mutex lock;
+};
+
+typedef ndFlowMapBucket nd_flow_map;
 typedef vector<nd_flow_map *> nd_flow_bucket;
-typedef vector<unique_ptr<mutex>> nd_flow_bucket_lock;
-typedef map<string, nd_flow_map *> nd_flows;
-typedef pair<string, nd_flow_ptr> nd_flow_pair;
-typedef pair<nd_flow_map::iterator, bool> nd_flow_insert;
 
+// Flow map, partitioned into one or more shards of buckets.
+//
+// Shard 0 is shared by all capture threads.  Additional,
+// private shards may be allocated to capture threads whose
+// backend guarantees flow affinity (both directions of a flow
+// are always delivered to the same thread).
+//
+// Each bucket is a lock-free open-addressing table: Lookup
+// and Insert never block (except briefly while a full bucket
+// grows), and deleted entries are reclaimed using epochs.
+// The locking forms of the API are retained for compatibility;
+// Lookup's acquire_lock and Release(key) are no-ops.
+//
+// Bucket iteration (GetBuckets, Acquire, Release) spans every
+// shard, so callers walking the map see all flows.
 class ndFlowMap
 {
 public:
-    ndFlowMap(size_t buckets = ND_FLOW_MAP_BUCKETS);
+    ndFlowMap(size_t buckets = ND_FLOW_MAP_BUCKETS,
+      size_t shards = 0);
     virtual ~ndFlowMap();
 
-    nd_flow_ptr
-    Lookup(const string &digest, bool acquire_lock = false);
-    bool Insert(const string &digest, nd_flow_ptr &flow,
-      bool unlocked = false);
-    inline bool
-    InsertUnlocked(const string &digest, nd_flow_ptr &flow) {
-        return Insert(digest, flow, true);
+    nd_flow_ptr Lookup(const ndFlowKey &key,
+      bool acquire_lock = false, unsigned shard = 0);
+    bool Insert(const ndFlowKey &key, nd_flow_ptr &flow,
+      bool unlocked = false, unsigned shard = 0);
+    inline bool InsertUnlocked(const ndFlowKey &key,
+      nd_flow_ptr &flow, unsigned shard = 0) {
+        return Insert(key, flow, true, shard);
     }
 
-    bool Delete(const string &digest);
+    // If flow is given, the entry is only deleted if it still
+    // holds that flow (and not a newer one with the same key).
+    bool Delete(const ndFlowKey &key, unsigned shard = 0,
+      const ndFlow *flow = nullptr);
 
     nd_flow_map &Acquire(size_t b);
     const nd_flow_map &AcquireConst(size_t b) const;
 
     void Release(size_t b) const;
-#if 0
-    inline void Release(const string &digest) const {
-        Release(HashToBucket(digest));
-    }
-#else
-    void Release(const string &digest) const;
-#endif
+    inline void Release(const ndFlowKey &key,
+      unsigned shard = 0) const { }
 #ifndef _ND_LEAN_AND_MEAN
     void DumpBucketStats(void);
 #endif
 
-    inline size_t GetBuckets(void) const { return buckets; }
+    inline size_t GetBuckets(void) const { return bucket.size(); }
+    inline size_t GetShards(void) const { return shards; }
+    inline unsigned GetBucketShard(size_t b) const {
+        return (unsigned)(b / buckets);
+    }
+    inline size_t GetBucket(const ndFlowKey &key,
+      unsigned shard = 0) const {
+        return HashToBucket(key, shard);
+    }
+
+    // Allocate a private shard; returns 0 (the shared shard) if
+    // none are free.  Not thread-safe.
+    unsigned AllocateShard(void);
+    void FreeShard(unsigned shard);
 
 protected:
-    unsigned HashToBucket(const string &digest) const {
-        const char *p = digest.c_str();
-        const uint64_t *b = (const uint64_t *)&p[0];
-        return (*b % buckets);
+    friend class ndFlowMapBucket;
+    friend class ndFlowMapCache;
+
+    // XXX: Must be called from within an epoch.
+    nd_flow_pair *Find(const ndFlowKey &key, unsigned shard) const;
+
+    inline unsigned HashToBucket(const ndFlowKey &key,
+      unsigned shard = 0) const {
+        return (shard * buckets) + (key.hash % buckets);
     }
 
+    void Grow(ndFlowMapBucket *b, ndFlowMapTable *t);
+
+    void Retire(void *ptr, void (*destroy)(void *));
+    void Reclaim(bool force = false) const;
+
+    static void DestroyEntry(void *entry);
+
     size_t buckets;
+    size_t shards;
+    vector<bool> shard_used;
     nd_flow_bucket bucket;
-    mutable nd_flow_bucket_lock bucket_lock;
+
+    struct retired {
+        uint64_t epoch;
+        void *ptr;
+        void (*destroy)(void *);
+    };
+
+    mutable mutex retired_lock;
+    mutable vector<retired> retired_list;
+};
+
+// Small direct-mapped cache of flow map entries, private to a
+// single thread (see ndCaptureThread).  Consecutive packets
+// usually belong to the same few flows, so a hit skips both the
+// key hash and the flow map probe.
+//
+// Cached entries are not reference counted (so they do not hold
+// flows in use).  Instead each records its bucket's generation
+// when filled, and is only trusted if no entry has since been
+// removed from that bucket.
+class ndFlowMapCache
+{
+public:
+    ndFlowMapCache(size_t slots = ND_FLOW_MAP_CACHE_SLOTS);
+
+    // Look up an unhashed key.  On a hit, the key's hash is set
+    // from the cached entry.
+    bool Lookup(const ndFlowMap *map, ndFlowKey &key,
+      nd_flow_ptr &flow);
+
+    // Look up a hashed key in the map, caching the entry.
+    nd_flow_ptr Fill(const ndFlowMap *map, const ndFlowKey &key,
+      unsigned shard = 0);
+
+    inline size_t GetSlots(void) const { return cache.size(); }
+
+protected:
+    inline size_t Index(const ndFlowKey &key) const {
+        const uint8_t *p = reinterpret_cast<const uint8_t *>(&key);
+        uint64_t h = 0;
+
+        for (size_t i = 0; i < offsetof(ndFlowKey, hash); i += 8) {
+            h ^= nd_hash_read64(p + i);
+            h = (h << 5) | (h >> 59);
+        }
+
+        return (size_t)((h * _ND_HASH_S0) >> 32) & mask;
+    }
+
+    struct entry {
+        nd_flow_pair *pair;
+        const ndFlowMapBucket *bucket;
+        uint64_t generation;
+    };
+
+    vector<entry> cache;
+    size_t mask;
 };
@@ -40,13 +40,13 @@
 #define _NDFP_flow \
     ((ndFlowParser *)yyget_extra(scanner))->flow
 #define _NDFP_local_mac \
-    ((ndFlowParser *)yyget_extra(scanner))->local_mac
+    ((ndFlowParser *)yyget_extra(scanner))->local_mac.c_str()
 #define _NDFP_other_mac \
-    ((ndFlowParser *)yyget_extra(scanner))->other_mac
+    ((ndFlowParser *)yyget_extra(scanner))->other_mac.c_str()
 #define _NDFP_local_ip \
-    ((ndFlowParser *)yyget_extra(scanner))->local_ip
+    (&((ndFlowParser *)yyget_extra(scanner))->local_ip)
 #define _NDFP_other_ip \
-    ((ndFlowParser *)yyget_extra(scanner))->other_ip
+    (&((ndFlowParser *)yyget_extra(scanner))->other_ip)
 #define _NDFP_local_port \
     ((ndFlowParser *)yyget_extra(scanner))->local_port
 #define _NDFP_other_port \
@@ -86,10 +86,10 @@ public:
     bool Parse(nd_flow_ptr const &flow, const string &expr);
 
     nd_flow_ptr flow;
-    const char *local_mac;
-    const char *other_mac;
-    const ndAddr *local_ip;
-    const ndAddr *other_ip;
+    string local_mac;
+    string other_mac;
+    ndAddr local_ip;
+    ndAddr other_ip;
     uint16_t local_port;
     uint16_t other_port;
     uint16_t origin;
@@ -0,0 +1,128 @@
+// Netify Agent
+// Copyright (C) 2015-2023 eGloo Incorporated
+// <http://www.egloo.ca>
+//
+// This program is free software: you can redistribute it
+// and/or modify it under the terms of the GNU General
+// Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your
+// option) any later version.
+//
+// This program is distributed in the hope that it will be
+// useful, but WITHOUT ANY WARRANTY; without even the
+// implied warranty of MERCHANTABILITY or FITNESS FOR A
+// PARTICULAR PURPOSE.  See the GNU General Public License
+// for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this program.  If not, see
+// <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <net/if.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "nd-apps.hpp"
+#include "nd-flow-map.hpp"
+#include "nd-flow.hpp"
+#include "nd-sha1.h"
+
+using namespace std;
+
+// Flow snapshot filename
+#define ND_FLOW_SNAPSHOT_FILE_NAME "/flow-snapshot.dat"
+
+#define _ND_FLOW_SNAPSHOT_MAGIC   0x53464e44  // "NDFS"
+#define _ND_FLOW_SNAPSHOT_VERSION 1
+
+struct ndFlowSnapshotHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t entry_size;
+    uint64_t entries;
+    uint64_t timestamp;
+} __attribute__((packed));
+
+// One classified flow: its tuple (interface by name, as
+// interface indexes and key hashes are per-process), detection
+// results and counters.  Names are not stored; they are looked
+// up again from the protocol and application IDs.
+struct ndFlowSnapshotEntry {
+    char ifname[IFNAMSIZ];
+    uint8_t lower_mac[sizeof(ndFlowAddr)];
+    uint8_t upper_mac[sizeof(ndFlowAddr)];
+    uint8_t lower_addr[sizeof(ndFlowAddr)];
+    uint8_t upper_addr[sizeof(ndFlowAddr)];
+    uint64_t ts_first_seen;
+    uint64_t ts_last_seen;
+    uint64_t lower_bytes;
+    uint64_t upper_bytes;
+    uint64_t total_bytes;
+    uint32_t lower_packets;
+    uint32_t upper_packets;
+    uint32_t total_packets;
+    uint32_t detected_application;
+    uint32_t category[4];
+    uint16_t detected_protocol;
+    uint16_t vlan_id;
+    int8_t direction;
+    uint8_t ip_version;
+    uint8_t ip_protocol;
+    uint8_t origin;
+    uint8_t lower_map;
+    uint8_t other_type;
+    uint8_t privacy_mask;
+    uint8_t lower_type;
+    uint8_t upper_type;
+    uint8_t tcp_fin_ack;
+    uint8_t flags;
+    uint8_t digest_lower[SHA1_DIGEST_LENGTH];
+    uint8_t digest_mdata[SHA1_DIGEST_LENGTH];
+    char host_server_name[ND_FLOW_HOSTNAME];
+    char dns_host_name[ND_FLOW_HOSTNAME];
+} __attribute__((packed));
+
+// Binary snapshot of the flow map, for warm restarts.
+//
+// Save() writes every live, fully classified flow.  A snapshot
+// is read back through a read-only mapping, and restored flows
+// are marked detection_complete, so that long-lived flows keep
+// their classification across a restart without passing
+// through DPI again.
+class ndFlowSnapshot
+{
+public:
+    ndFlowSnapshot(const string &filename);
+    virtual ~ndFlowSnapshot();
+
+    static bool Save(const string &filename, ndFlowMap *map,
+      size_t &count);
+
+    // Map and validate the snapshot.
+    bool Open(void);
+
+    inline size_t GetEntries(void) const { return entries; }
+    inline const ndFlowSnapshotEntry &GetEntry(size_t i) const {
+        return base[i];
+    }
+
+    // Create a flow from an entry, in the given arena.  The
+    // interface must match the entry's ifname.
+    static nd_flow_ptr Restore(const ndFlowSnapshotEntry &entry,
+      nd_iface_ptr &iface, ndFlowArena *arena,
+      ndApplications &apps);
+
+protected:
+    static void Store(const ndFlow &flow,
+      ndFlowSnapshotEntry &entry);
+
+    string filename;
+    void *mapping;
+    size_t length;
+    const ndFlowSnapshotEntry *base;
+    size_t entries;
+};
@@ -0,0 +1,82 @@
+// Netify Agent
+// Copyright (C) 2015-2023 eGloo Incorporated
+// <http://www.egloo.ca>
+//
+// This program is free software: you can redistribute it
+// and/or modify it under the terms of the GNU General
+// Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your
+// option) any later version.
+//
+// This program is distributed in the hope that it will be
+// useful, but WITHOUT ANY WARRANTY; without even the
+// implied warranty of MERCHANTABILITY or FITNESS FOR A
+// PARTICULAR PURPOSE.  See the GNU General Public License
+// for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this program.  If not, see
+// <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "nd-flow.hpp"
+
+using namespace std;
+
+#define _ND_FLOW_TIMER_BITS   8
+#define _ND_FLOW_TIMER_SLOTS  (1 << _ND_FLOW_TIMER_BITS)
+#define _ND_FLOW_TIMER_MASK   (_ND_FLOW_TIMER_SLOTS - 1)
+#define _ND_FLOW_TIMER_LEVELS 4
+
+// A scheduled flow expiry check.  Timers refer to flows by key
+// (and flow map shard) rather than holding a reference, so they
+// never keep a flow in use; a timer whose flow has since been
+// purged simply finds nothing.
+struct ndFlowTimer {
+    ndFlowKey key;
+    uint64_t due;
+    unsigned shard;
+};
+
+// Hierarchical timer wheel of flow expiry checks, with a
+// resolution of one second.  Each level has 256 slots; level
+// zero covers the next 256 seconds, and each higher level 256
+// times the span of the one below.  Timers are cascaded down a
+// level as the wheel turns, so advancing only touches timers
+// that are (nearly) due, never the whole flow table.
+//
+// Timers are not moved when a flow sees traffic.  Instead, a
+// timer that fires early (the flow was active) is lazily
+// rescheduled by the caller from the flow's ts_last_seen.
+//
+// Not thread-safe; owned by the instance thread.
+class ndFlowTimerWheel
+{
+public:
+    ndFlowTimerWheel(uint64_t now = 0);
+
+    void Schedule(const ndFlowKey &key, unsigned shard,
+      uint64_t due);
+
+    // Turn the wheel up to (and including) now, appending every
+    // timer that has fallen due.
+    void Advance(uint64_t now, vector<ndFlowTimer> &timers);
+
+    inline size_t GetSize(void) const { return size; }
+    inline uint64_t GetTime(void) const { return current; }
+
+protected:
+    void Insert(ndFlowTimer &&timer);
+    void Cascade(unsigned level);
+
+    uint64_t current;
+    size_t size;
+
+    vector<ndFlowTimer> slots[_ND_FLOW_TIMER_LEVELS]
+                             [_ND_FLOW_TIMER_SLOTS];
+};
@@ -27,6 +27,8 @@
 #include "nd-addr.hpp"
 #include "nd-apps.hpp"
 #include "nd-category.hpp"
+#include "nd-flow-arena.hpp"
+#include "nd-hash.hpp"
 #include "nd-protos.hpp"
 #include "nd-serializer.hpp"
 
@@ -169,6 +171,118 @@ public:
 #endif
 };
 
+// Flow map key: the flow tuple in a fixed-size, zero-padded
+// POD structure so that it can be compared with memcmp.  The
+// hash is computed once (see Update) and cached in the key.
+struct ndFlowKey {
+    uint32_t iface;  // ndInterface::GetIndex()
+    uint16_t vlan_id;
+    uint8_t ip_version;
+    uint8_t ip_protocol;
+    uint8_t lower_addr[16];
+    uint8_t upper_addr[16];
+    uint16_t lower_port;
+    uint16_t upper_port;
+    uint8_t lower_mac[6];  // DHCPv4 broadcasts only
+    uint8_t pad[6];  // Explicit; keys are compared with memcmp
+    uint64_t hash;
+
+    inline void Clear(void) { memset(this, 0, sizeof(ndFlowKey)); }
+
+    inline void Update(void) {
+        hash = nd_hash64(this, offsetof(ndFlowKey, hash),
+          nd_hash_key());
+    }
+
+    inline bool operator==(const ndFlowKey &k) const {
+        return (memcmp(this, &k, sizeof(ndFlowKey)) == 0);
+    }
+
+    // Compare tuples only; the hash may not have been computed.
+    inline bool Match(const ndFlowKey &k) const {
+        return (memcmp(this, &k, offsetof(ndFlowKey, hash)) == 0);
+    }
+
+    struct Hasher {
+        inline size_t operator()(const ndFlowKey &k) const {
+            return (size_t)k.hash;
+        }
+    };
+};
+
+// Protocol specific flow metadata.  Most flows never fill any
+// of this in, so rather than embedding it in every flow it is
+// allocated on demand; see ndFlow::Metadata().
+struct ndFlowMetadata {
+    ndFlowMetadata() : http{ { 0 } } { }
+
+    union {
+        struct {
+            char user_agent[ND_FLOW_UA_LEN];
+            char url[ND_FLOW_URL_LEN];
+        } http;
+
+        struct {
+            char fingerprint[ND_FLOW_DHCPFP_LEN];
+            char class_ident[ND_FLOW_DHCPCI_LEN];
+        } dhcp;
+
+        struct {
+            char client_agent[ND_FLOW_SSH_UALEN];
+            char server_agent[ND_FLOW_SSH_UALEN];
+        } ssh;
+
+        struct {
+            uint16_t version;
+            uint16_t cipher_suite;
+            char *subject_dn, *issuer_dn;
+            char server_cn[ND_FLOW_TLS_CNLEN];
+            char client_ja3[ND_FLOW_TLS_JA3LEN];
+            char server_ja3[ND_FLOW_TLS_JA3LEN];
+            bool cert_fingerprint_found;
+            char cert_fingerprint[ND_FLOW_TLS_HASH_LEN];
+        } ssl;
+
+        struct {
+            bool tls;
+        } smtp;
+
+        struct {
+            uint8_t info_hash_valid:1;
+            char info_hash[ND_FLOW_BTIHASH_LEN];
+        } bt;
+#if 0
+        struct {
+            char variant[ND_FLOW_EXTRA_INFO];
+        } mining;
+#endif
+        struct {
+            char domain_name[ND_FLOW_HOSTNAME];
+        } mdns;
+    };
+
+    vector<string> tls_alpn, tls_alpn_server;
+};
+
+// GTP tunnel metadata, allocated only for tunneled flows.
+struct ndFlowGTP {
+    ndFlowGTP()
+      : version(0xFF), ip_version(0), lower_teid(0), upper_teid(0),
+        lower_type(ndAddr::atNONE), upper_type(ndAddr::atNONE),
+        lower_map(0), other_type(0) { }
+
+    uint8_t version;
+    uint8_t ip_version;
+    uint32_t lower_teid;
+    uint32_t upper_teid;
+    ndAddr::Type lower_type;
+    ndAddr::Type upper_type;
+    ndFlowAddr lower_addr;
+    ndFlowAddr upper_addr;
+    uint8_t lower_map;
+    uint8_t other_type;
+};
+
 class ndFlow : public ndSerializer
 {
 public:
@@ -179,12 +293,39 @@ public:
     void Hash(const string &device, bool hash_mdata = false,
       const uint8_t *key = NULL, size_t key_length = 0);
 
+    // Build the flow map key from the flow tuple.  The hash can
+    // be deferred (see ndFlowMapCache) and computed later using
+    // ndFlowKey::Update().
+    void UpdateKey(uint32_t iface_index, bool hash = true);
+
     void Reset(bool full_reset = false);
 
     void Release(void);
 
+    // Approximate heap footprint of the flow, including any
+    // nDPI flow state and metadata currently allocated.
+    size_t GetMemoryUsage(void) const;
+    // Footprint of a new flow once detection has begun.
+    static inline size_t GetMinimumSize(void) {
+        return sizeof(ndFlow) + sizeof(struct ndpi_flow_struct);
+    }
+
+    // Protocol metadata, allocated on first use.  Writers call
+    // Metadata(); readers use GetMetadata(), which returns
+    // nullptr if nothing has been filled in.
+    inline ndFlowMetadata &Metadata(void) {
+        ndFlowMetadata *md = metadata.load(memory_order_acquire);
+        return (md != nullptr) ? *md : CreateMetadata();
+    }
+    inline const ndFlowMetadata *GetMetadata(void) const {
+        return metadata.load(memory_order_acquire);
+    }
+
     nd_proto_id_t GetMasterProtocol(void) const;
 
+    uint16_t GetTLSVersion(void) const;
+    uint16_t GetTLSCipherSuite(void) const;
+
     bool HasDhcpFingerprint(void) const;
     bool HasDhcpClassIdent(void) const;
     bool HasHttpUserAgent(void) const;
@@ -252,6 +393,8 @@ public:
         string _lower_rate = "local_rate";
         string _upper_rate = "other_rate";
 #endif
+        const ndFlowMetadata *md = GetMetadata();
+
         string digest;
         if (! digest_mdata.empty()) {
             nd_sha1_to_string(digest_mdata, digest);
@@ -401,6 +544,8 @@ public:
                 "Unknown" :
                 detected_application_name);
 
+            serialize(output, { "detection_cached" },
+              flags.detection_cached.load());
             serialize(output, { "detection_guessed" },
               flags.detection_guessed.load());
             serialize(output, { "detection_updated" },
@@ -425,30 +570,30 @@ public:
             if (HasHttpUserAgent() || HasHttpURL()) {
                 if (HasHttpUserAgent())
                     serialize(output,
-                      { "http", "user_agent" }, http.user_agent);
+                      { "http", "user_agent" }, md->http.user_agent);
                 if (HasHttpURL())
                     serialize(output, { "http", "url" },
-                      http.url);
+                      md->http.url);
             }
 
             if (HasDhcpFingerprint() || HasDhcpClassIdent()) {
                 if (HasDhcpFingerprint())
                     serialize(output,
-                      { "dhcp", "fingerprint" }, dhcp.fingerprint);
+                      { "dhcp", "fingerprint" }, md->dhcp.fingerprint);
 
                 if (HasDhcpClassIdent())
                     serialize(output,
-                      { "dhcp", "class_ident" }, dhcp.class_ident);
+                      { "dhcp", "class_ident" }, md->dhcp.class_ident);
             }
 
             if (HasSSHClientAgent() || HasSSHServerAgent()) {
                 if (HasSSHClientAgent())
                     serialize(output, { "ssh", "client" },
-                      ssh.client_agent);
+                      md->ssh.client_agent);
 
                 if (HasSSHServerAgent())
                     serialize(output, { "ssh", "server" },
-                      ssh.server_agent);
+                      md->ssh.server_agent);
             }
 
             if (GetMasterProtocol() == ND_PROTO_TLS ||
@@ -456,10 +601,10 @@ public:
             {
                 char tohex[7];
 
-                sprintf(tohex, "0x%04hx", ssl.version);
+                sprintf(tohex, "0x%04hx", GetTLSVersion());
                 serialize(output, { "ssl", "version" }, tohex);
 
-                sprintf(tohex, "0x%04hx", ssl.cipher_suite);
+                sprintf(tohex, "0x%04hx", GetTLSCipherSuite());
                 serialize(output, { "ssl", "cipher_suite" }, tohex);
 
                 if (HasTLSClientSNI())
@@ -468,48 +613,48 @@ public:
 
                 if (HasTLSServerCN())
                     serialize(output,
-                      { "ssl", "server_cn" }, ssl.server_cn);
+                      { "ssl", "server_cn" }, md->ssl.server_cn);
 
                 if (HasTLSIssuerDN())
                     serialize(output,
-                      { "ssl", "issuer_dn" }, ssl.issuer_dn);
+                      { "ssl", "issuer_dn" }, md->ssl.issuer_dn);
 
                 if (HasTLSSubjectDN())
                     serialize(output,
-                      { "ssl", "subject_dn" }, ssl.subject_dn);
+                      { "ssl", "subject_dn" }, md->ssl.subject_dn);
 
                 if (HasTLSClientJA3())
                     serialize(output,
-                      { "ssl", "client_ja3" }, ssl.client_ja3);
+                      { "ssl", "client_ja3" }, md->ssl.client_ja3);
 
                 if (HasTLSServerJA3())
                     serialize(output,
-                      { "ssl", "server_ja3" }, ssl.server_ja3);
+                      { "ssl", "server_ja3" }, md->ssl.server_ja3);
 
-                if (ssl.cert_fingerprint_found) {
+                if (md != nullptr && md->ssl.cert_fingerprint_found) {
                     nd_sha1_to_string(
-                      (const uint8_t *)ssl.cert_fingerprint, digest);
+                      (const uint8_t *)md->ssl.cert_fingerprint, digest);
                     serialize(output,
                       { "ssl", "fingerprint" }, digest);
                 }
 
                 if (tls_alpn_set.load())
-                    serialize(output, { "ssl", "alpn" }, tls_alpn);
+                    serialize(output, { "ssl", "alpn" }, md->tls_alpn);
                 if (tls_alpn_server_set.load())
                     serialize(output,
-                      { "ssl", "alpn_server" }, tls_alpn_server);
+                      { "ssl", "alpn_server" }, md->tls_alpn_server);
             }
 
             if (HasBTInfoHash()) {
                 nd_sha1_to_string(
-                  (const uint8_t *)bt.info_hash, digest);
+                  (const uint8_t *)md->bt.info_hash, digest);
                 serialize(output, { "bt", "info_hash" }, digest);
             }
 
             if (HasSSDPUserAgent()) {
                 if (HasSSDPUserAgent()) {
                     serialize(output,
-                      { "ssdp", "user_agent" }, http.user_agent);
+                      { "ssdp", "user_agent" }, md->http.user_agent);
                 }
             }
 #if 0
@@ -518,7 +663,7 @@ public:
 #endif
             if (HasMDNSDomainName())
                 serialize(output, { "mdns", "answer" },
-                  mdns.domain_name);
+                  md->mdns.domain_name);
 
             serialize(output, { "first_seen_at" }, ts_first_seen);
 
@@ -539,7 +684,9 @@ public:
 
             switch (tunnel_type) {
             case TUNNEL_GTP:
-                switch (gtp.lower_map) {
+                if (gtp == nullptr) break;
+
+                switch (gtp->lower_map) {
                 case LOWER_LOCAL:
                     _lower_ip = "local_ip";
                     _lower_port = "local_port";
@@ -558,7 +705,7 @@ public:
                     break;
                 }
 
-                switch (gtp.other_type) {
+                switch (gtp->other_type) {
                 case OTHER_LOCAL:
                     _other_type = "local";
                     break;
@@ -572,21 +719,21 @@ public:
                 default: _other_type = "unsupported"; break;
                 }
 
-                serialize(output, { "gtp", "version" }, gtp.version);
+                serialize(output, { "gtp", "version" }, gtp->version);
                 serialize(output, { "gtp", "ip_version" },
-                  gtp.ip_version);
+                  gtp->ip_version);
                 serialize(output, { "gtp", _lower_ip },
-                  gtp.lower_addr.GetString());
+                  gtp->lower_addr.GetString());
                 serialize(output, { "gtp", _upper_ip },
-                  gtp.upper_addr.GetString());
+                  gtp->upper_addr.GetString());
                 serialize(output, { "gtp", _lower_port },
-                  (unsigned)gtp.lower_addr.GetPort());
+                  (unsigned)gtp->lower_addr.GetPort());
                 serialize(output, { "gtp", _upper_port },
-                  (unsigned)gtp.upper_addr.GetPort());
+                  (unsigned)gtp->upper_addr.GetPort());
                 serialize(output, { "gtp", _lower_teid },
-                  htonl(gtp.lower_teid));
+                  htonl(gtp->lower_teid));
                 serialize(output, { "gtp", _upper_teid },
-                  htonl(gtp.upper_teid));
+                  htonl(gtp->upper_teid));
                 serialize(output, { "gtp", "other_type" },
                   _other_type);
 
@@ -631,18 +778,69 @@ public:
 
     nd_iface_ptr iface;
 
-    int16_t dpi_thread_id;
+    // Packet path members, kept together at the front of the
+    // flow.  Stats are (also) hot, but must remain last; see
+    // the note on conditional members below.
+
+    // Detection thread the flow is queued to, and the number of
+    // entries it has queued there.  Changed under dpi_lock; see
+    // ndDetectionScheduler.
+    atomic<int16_t> dpi_thread_id;
+    atomic<bool> dpi_lock;
+    atomic<uint16_t> dpi_queued;
 
     uint8_t ip_version;
     uint8_t ip_protocol;
 
     uint16_t vlan_id;
 
+    enum { TUNNEL_NONE = 0x00, TUNNEL_GTP = 0x01 };
+
+    uint8_t tunnel_type;
+
+    // Indicate flow origin.  This indicates which side sent
+    // the first packet.
+    // XXX: If the service has missed a flow's initial
+    // packets, the origin's accuracy would be 50%.
+    enum {
+        ORIGIN_UNKNOWN = 0x00,
+        ORIGIN_LOWER = 0x01,
+        ORIGIN_UPPER = 0x02
+    };
+
+    uint8_t origin;
+
+    int direction;
+
     uint32_t tcp_last_seq;
 
     uint64_t ts_first_seen;
     atomic<uint64_t> ts_last_seen;
 
+    struct {
+        atomic<bool> detection_cached;
+        atomic<bool> detection_complete;
+        atomic<bool> detection_guessed;
+        atomic<bool> detection_init;
+        atomic<bool> detection_updated;
+        atomic<bool> dhc_hit;
+        atomic<bool> fhc_hit;
+        atomic<bool> expired;
+        atomic<bool> expiring;
+        // Picked by ndInstance::EvictFlow() to be expired.
+        atomic<bool> evicting;
+        atomic<bool> ip_nat;
+        atomic<bool> risks_checked;
+        atomic<bool> soft_dissector;
+        atomic<uint8_t> tcp_fin_ack;
+        // Seen this update interval; set by the capture thread,
+        // cleared when the interval counters are reset.  Not
+        // cleared by Reset().
+        atomic<bool> active;
+    } flags;
+
+    ndFlowKey key;
+
     enum {
         LOWER_UNKNOWN = 0x00,
         LOWER_LOCAL = 0x01,
@@ -663,15 +861,18 @@ public:
 
     uint8_t other_type;
 
-    ndAddr lower_mac;
-    ndAddr upper_mac;
+    enum { PRIVATE_LOWER = 0x01, PRIVATE_UPPER = 0x02 };
 
-    ndAddr lower_addr;
-    ndAddr upper_addr;
+    uint8_t privacy_mask;
 
-    enum { TUNNEL_NONE = 0x00, TUNNEL_GTP = 0x01 };
+    ndAddr::Type lower_type;
+    ndAddr::Type upper_type;
 
-    uint8_t tunnel_type;
+    ndFlowAddr lower_mac;
+    ndFlowAddr upper_mac;
+
+    ndFlowAddr lower_addr;
+    ndFlowAddr upper_addr;
 
     nd_proto_id_t detected_protocol;
     nd_app_id_t detected_application;
@@ -688,58 +889,36 @@ public:
 
     struct ndpi_flow_struct *ndpi_flow;
 
+    // SHA1 digests; digest_lower is computed on demand by the
+    // detection thread (see ndFlow::Hash), not per packet.
     vector<uint8_t> digest_lower;
     vector<uint8_t> digest_mdata;
 
     string dns_host_name;
     string host_server_name;
 
-    union {
-        struct {
-            char user_agent[ND_FLOW_UA_LEN];
-            char url[ND_FLOW_URL_LEN];
-        } http;
-
-        struct {
-            char fingerprint[ND_FLOW_DHCPFP_LEN];
-            char class_ident[ND_FLOW_DHCPCI_LEN];
-        } dhcp;
+    // Protocol metadata, allocated on demand; see
+    // Metadata() and GetMetadata().
+    atomic<ndFlowMetadata *> metadata;
 
-        struct {
-            char client_agent[ND_FLOW_SSH_UALEN];
-            char server_agent[ND_FLOW_SSH_UALEN];
-        } ssh;
+    // Tunnel metadata, or nullptr (tunnel_type is TUNNEL_NONE).
+    ndFlowGTP *gtp;
 
-        struct {
-            uint16_t version;
-            uint16_t cipher_suite;
-            char *subject_dn, *issuer_dn;
-            char server_cn[ND_FLOW_TLS_CNLEN];
-            char client_ja3[ND_FLOW_TLS_JA3LEN];
-            char server_ja3[ND_FLOW_TLS_JA3LEN];
-            bool cert_fingerprint_found;
-            char cert_fingerprint[ND_FLOW_TLS_HASH_LEN];
-        } ssl;
+    // Due time (seconds) of the flow's idle expiry timer, or
+    // zero if none is scheduled; see ndFlowTimerWheel.  Only
+    // accessed by the instance thread.
+    uint64_t timer_due;
 
-        struct {
-            bool tls;
-        } smtp;
+    // Detection cache key of the flow's server endpoint, or zero;
+    // see ndDetectionCache.  Only accessed by the detection
+    // thread.
+    uint64_t detection_cache_key;
 
-        struct {
-            uint8_t info_hash_valid:1;
-            char info_hash[ND_FLOW_BTIHASH_LEN];
-        } bt;
-#if 0
-        struct {
-            char variant[ND_FLOW_EXTRA_INFO];
-        } mining;
-#endif
-        struct {
-            char domain_name[ND_FLOW_HOSTNAME];
-        } mdns;
-    };
+    // Bytes charged to ndInstanceStatus::flows_bytes for this
+    // flow; reconciled with GetMemoryUsage() each update
+    // interval.  Only updated while holding the flow's bucket.
+    size_t mem_charged;
 
-    vector<string> tls_alpn, tls_alpn_server;
     atomic<bool> tls_alpn_set, tls_alpn_server_set;
 
     enum {
@@ -749,23 +928,10 @@ public:
         TYPE_MAX
     };
 
-    enum { PRIVATE_LOWER = 0x01, PRIVATE_UPPER = 0x02 };
-
-    uint8_t privacy_mask;
-
-    // Indicate flow origin.  This indicates which side sent
-    // the first packet.
-    // XXX: If the service has missed a flow's initial
-    // packets, the origin's accuracy would be 50%.
-    enum {
-        ORIGIN_UNKNOWN = 0x00,
-        ORIGIN_LOWER = 0x01,
-        ORIGIN_UPPER = 0x02
-    };
-
-    uint8_t origin;
-
-    int direction;
+    set<nd_risk_id_t> risks;
+    uint16_t ndpi_risk_score;
+    uint16_t ndpi_risk_score_client;
+    uint16_t ndpi_risk_score_server;
 
     // Start of conditional members.  These must be at the end
     // or else access from plugins compiled without various
@@ -774,47 +940,9 @@ public:
     uint32_t ct_id;
     uint32_t ct_mark;
 #endif
-    ndAddr::Type lower_type;
-    ndAddr::Type upper_type;
-
-    struct {
-        atomic<bool> detection_complete;
-        atomic<bool> detection_guessed;
-        atomic<bool> detection_init;
-        atomic<bool> detection_updated;
-        atomic<bool> dhc_hit;
-        atomic<bool> fhc_hit;
-        atomic<bool> expired;
-        atomic<bool> expiring;
-        atomic<bool> ip_nat;
-        atomic<bool> risks_checked;
-        atomic<bool> soft_dissector;
-        atomic<uint8_t> tcp_fin_ack;
-    } flags;
-
-    struct {
-        uint8_t version;
-        uint8_t ip_version;
-        uint32_t lower_teid;
-        uint32_t upper_teid;
-        ndAddr::Type lower_type;
-        ndAddr::Type upper_type;
-        ndAddr lower_addr;
-        ndAddr upper_addr;
-        uint8_t lower_map;
-        uint8_t other_type;
-    } gtp;
-
-    set<nd_risk_id_t> risks;
-    uint16_t ndpi_risk_score;
-    uint16_t ndpi_risk_score_client;
-    uint16_t ndpi_risk_score_server;
 
     ndFlowStats stats;
-};
 
-typedef shared_ptr<ndFlow> nd_flow_ptr;
-typedef unordered_map<string, nd_flow_ptr> nd_flow_map;
-typedef map<string, nd_flow_map *> nd_flows;
-typedef pair<string, nd_flow_ptr> nd_flow_pair;
-typedef pair<nd_flow_map::iterator, bool> nd_flow_insert;
+protected:
+    ndFlowMetadata &CreateMetadata(void);
+};
@@ -0,0 +1,105 @@
+// Netify Agent
+// Copyright (C) 2015-2023 eGloo Incorporated
+// <http://www.egloo.ca>
+//
+// This program is free software: you can redistribute it
+// and/or modify it under the terms of the GNU General
+// Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your
+// option) any later version.
+//
+// This program is distributed in the hope that it will be
+// useful, but WITHOUT ANY WARRANTY; without even the
+// implied warranty of MERCHANTABILITY or FITNESS FOR A
+// PARTICULAR PURPOSE.  See the GNU General Public License
+// for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this program.  If not, see
+// <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <random>
+
+using namespace std;
+
+// Fast, keyed, non-cryptographic 128-bit hash (wyhash-style
+// multiply/fold).  Suitable for in-memory hash table keys
+// only; use SHA1 for anything persisted or exported.
+
+#define ND_HASH128_LENGTH 16
+
+#define _ND_HASH_S0 0xa0761d6478bd642full
+#define _ND_HASH_S1 0xe7037ed1a0b428dbull
+#define _ND_HASH_S2 0x8ebc6af09c88c6e3ull
+#define _ND_HASH_S3 0x589965cc75374cc3ull
+
+static inline uint64_t nd_hash_mum(uint64_t a, uint64_t b) {
+#ifdef __SIZEOF_INT128__
+    __uint128_t r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+#else
+    uint64_t ha = a >> 32, hb = b >> 32;
+    uint64_t la = (uint32_t)a, lb = (uint32_t)b;
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la,
+             rl = la * lb;
+    uint64_t t = rl + (rm0 << 32), c = (t < rl);
+    uint64_t lo = t + (rm1 << 32);
+    c += (lo < t);
+    uint64_t hi = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+    return lo ^ hi;
+#endif
+}
+
+static inline uint64_t nd_hash_read64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline void nd_hash128(const void *data, size_t length,
+  uint64_t seed, uint64_t digest[2]) {
+    const uint8_t *p = static_cast<const uint8_t *>(data);
+    uint64_t h0 = seed ^ _ND_HASH_S0;
+    uint64_t h1 = seed ^ _ND_HASH_S1 ^ (uint64_t)length;
+    size_t remain = length;
+
+    for (; remain >= 16; remain -= 16, p += 16) {
+        uint64_t a = nd_hash_read64(p), b = nd_hash_read64(p + 8);
+        h0 = nd_hash_mum(a ^ _ND_HASH_S1 ^ h0, b ^ _ND_HASH_S2);
+        h1 = nd_hash_mum(b ^ _ND_HASH_S3 ^ h1, a ^ _ND_HASH_S0);
+    }
+
+    if (remain > 0) {
+        uint8_t tail[16] = { 0 };
+        memcpy(tail, p, remain);
+        uint64_t a = nd_hash_read64(tail),
+                 b = nd_hash_read64(tail + 8);
+        h0 = nd_hash_mum(a ^ _ND_HASH_S1 ^ h0, b ^ _ND_HASH_S2);
+        h1 = nd_hash_mum(b ^ _ND_HASH_S3 ^ h1, a ^ _ND_HASH_S0);
+    }
+
+    digest[0] = nd_hash_mum(h0 ^ _ND_HASH_S2, h1 ^ _ND_HASH_S1);
+    digest[1] = nd_hash_mum(h1 ^ _ND_HASH_S3, digest[0] ^ h0);
+}
+
+static inline uint64_t nd_hash64(const void *data, size_t length,
+  uint64_t seed) {
+    uint64_t digest[2];
+    nd_hash128(data, length, seed, digest);
+    return digest[0];
+}
+
+// Per-process random key, so that remote peers can not
+// predict (and deliberately collide) in-memory flow hashes.
+static inline uint64_t nd_hash_key(void) {
+    static const uint64_t key = []() {
+        random_device rd;
+        return ((uint64_t)rd() << 32) ^ (uint64_t)rd();
+    }();
+    return key;
+}
@@ -20,17 +20,23 @@
 
 #pragma once
 
+#include <algorithm>
 #include <atomic>
 #include <csignal>
+#include <mutex>
 
 #include "nd-apps.hpp"
 #include "nd-category.hpp"
 #include "nd-config.hpp"
+#include "nd-detection-budget.hpp"
 #include "nd-dhc.hpp"
 #include "nd-except.hpp"
 #include "nd-fhc.hpp"
+#include "nd-flow-admit.hpp"
 #include "nd-flow-map.hpp"
+#include "nd-flow-timer.hpp"
 #include "nd-napi.hpp"
+#include "nd-ndpi.hpp"
 #include "nd-packet.hpp"
 #include "nd-plugin.hpp"
 #include "nd-protos.hpp"
@@ -58,11 +64,14 @@ public:
     struct timespec ts_epoch;
     struct timespec ts_now;
     atomic<size_t> flows;
+    atomic<size_t> flows_bytes;
     size_t flows_prev;
     size_t flows_purged;
     size_t flows_expiring;
+    // Sampled over the update interval; see ndFlowMapTotals.
     size_t flows_expired;
     size_t flows_active;
+    // Sampled over the update interval; see ndFlowMapTotals.
     size_t flows_in_use;
     double cpu_user;
     double cpu_user_prev;
@@ -77,6 +86,18 @@ public:
 #endif
     bool dhc_status;
     size_t dhc_size;
+    vector<ndFlowAdmissionOffender> flow_offenders;
+    size_t dpi_queue_depth;
+    size_t dpi_queue_bytes;
+    size_t dpi_queue_high_water;
+    uint64_t dpi_queue_latency_us;
+    uint64_t dpi_queue_latency_max_us;
+    uint64_t dpi_wakeups;
+    uint64_t dpi_steals;
+    uint64_t dpi_cache_hits;
+    uint64_t dpi_cache_misses;
+    size_t dpi_cache_entries;
+    vector<ndDetectionBudgetStats> dpi_budgets;
 
     template <class T>
     void Encode(T &output) const {
@@ -92,6 +113,8 @@ public:
         serialize(output, { "cpu_system_prev" }, cpu_system_prev);
         serialize(output, { "flow_count" }, flows.load());
         serialize(output, { "flow_count_prev" }, flows_prev);
+        serialize(output, { "flow_memory_kb" },
+          flows_bytes.load() / 1024);
         serialize(output, { "flows_purged" }, flows_purged);
         serialize(output, { "flows_expiring" }, flows_expiring);
         serialize(output, { "flows_expired" }, flows_expired);
@@ -108,11 +131,53 @@ public:
         serialize(output, { "dhc_status" }, dhc_status);
         if (dhc_status)
             serialize(output, { "dhc_size" }, dhc_size);
+        serialize(output, { "dpi_queue_depth" }, dpi_queue_depth);
+        serialize(output, { "dpi_queue_kb" }, dpi_queue_bytes / 1024);
+        serialize(output, { "dpi_queue_high_water" },
+          dpi_queue_high_water);
+        serialize(output, { "dpi_queue_latency_us" },
+          dpi_queue_latency_us);
+        serialize(output, { "dpi_queue_latency_max_us" },
+          dpi_queue_latency_max_us);
+        serialize(output, { "dpi_wakeups" }, dpi_wakeups);
+        serialize(output, { "dpi_steals" }, dpi_steals);
+        serialize(output, { "dpi_cache_hits" }, dpi_cache_hits);
+        serialize(output, { "dpi_cache_misses" }, dpi_cache_misses);
+        serialize(output, { "dpi_cache_entries" }, dpi_cache_entries);
+        for (auto &budget : dpi_budgets) {
+            const char *name = nd_proto_get_name(budget.protocol);
+
+            serialize(output, { "dpi_budgets", name, "budget" },
+              budget.budget);
+            serialize(output, { "dpi_budgets", name, "flows" },
+              budget.flows);
+            serialize(output, { "dpi_budgets", name, "detected" },
+              budget.detected);
+            serialize(output, { "dpi_budgets", name, "packets" },
+              budget.packets);
+            serialize(output,
+              { "dpi_budgets", name, "detection_rate" },
+              (double)budget.detected / (double)budget.flows);
+            serialize(output,
+              { "dpi_budgets", name, "packets_per_flow" },
+              (double)budget.packets / (double)budget.flows);
+        }
+        serialize(output, { "dpi_wakeup_rate" },
+          (ndGC.update_interval > 0) ?
+            dpi_wakeups / ndGC.update_interval :
+            dpi_wakeups);
+        for (auto &offender : flow_offenders) {
+            serialize(output,
+              { "flow_offenders", offender.addr.GetString() },
+              offender.windows);
+        }
     }
 };
 
 class ndCaptureThread;
 class ndDetectionThread;
+class ndDetectionCache;
+class ndDetectionScheduler;
 class ndNetifyApiManager;
 #ifdef _ND_USE_CONNTRACK
 class ndConntrackThread;
@@ -122,6 +187,52 @@ typedef map<int16_t, ndDetectionThread *> nd_detection_threads;
 typedef map<string, vector<ndCaptureThread *>> nd_capture_threads;
 typedef map<string, pair<uint8_t, ndPacketStats>> nd_interface_stats;
 
+// Flow map maintenance totals for one update interval,
+// accumulated a slice of flow buckets at a time (see
+// ndInstance::ProcessFlowTick).  purged, expiring and active
+// are counted as events, and are exact.  Every bucket is visited
+// once per interval, but at different times, so expired, pre_init
+// and in_use are sampled across the interval, not at its end.
+struct ndFlowMapTotals {
+    ndFlowMapTotals() { Clear(); }
+
+    void Clear(void) {
+        pre_init = 0;
+        purged = 0;
+        expiring = 0;
+        expired = 0;
+        active = 0;
+        in_use = 0;
+#ifdef _ND_PROCESS_FLOW_DEBUG
+        tcp = 0;
+        tcp_fin = 0;
+        tcp_fin_ack_1 = 0;
+        tcp_fin_ack_gt2 = 0;
+#endif
+    }
+
+    size_t pre_init;
+    size_t purged;
+    size_t expiring;
+    size_t expired;
+    size_t active;
+    size_t in_use;
+#ifdef _ND_PROCESS_FLOW_DEBUG
+    size_t tcp;
+    size_t tcp_fin;
+    size_t tcp_fin_ack_1;
+    size_t tcp_fin_ack_gt2;
+#endif
+};
+
+// A flow picked by ndInstance::EvictFlow().
+struct ndFlowEvicted {
+    nd_flow_ptr flow;
+    unsigned shard;
+    // Memory charged for an unclassified victim when picked.
+    size_t bytes;
+};
+
 class ndInstance : public ndThread, public ndSerializer
 {
 public:
@@ -313,6 +424,36 @@ public:
         return false;
     }
 
+    // True if another flow would exceed max_flows, or the flow
+    // memory budget (max_flow_memory).  Flows evicted, but still
+    // to be expired, are not counted.
+    inline bool IsFlowTableFull(void) const {
+        size_t flows = status.flows.load();
+        flows -= min(flows, flows_evicting.load());
+        if (ndGC.max_flows > 0 && flows + 1 > ndGC.max_flows)
+            return true;
+
+        size_t bytes = status.flows_bytes.load();
+        bytes -= min(bytes, flows_evicting_bytes.load());
+        if (ndGC.max_flow_memory > 0 &&
+          bytes + ndFlow::GetMinimumSize() > ndGC.max_flow_memory)
+            return true;
+
+        return false;
+    }
+
+    // Evict a flow to make room for a new one, according to
+    // ndGC.flow_evict.  Candidates are sampled from the new
+    // flow's own bucket, so no other bucket is locked.  A
+    // classified victim is removed at once; an unclassified one
+    // has detection finalized, and is expired by the instance
+    // thread, but no longer counts against the table until then.
+    // Evicted flows are announced (EVENT_FLOW_EXPIRE) by the
+    // instance thread, as if purged.  At most
+    // ND_FLOW_EVICT_PENDING evictions are pending at a time;
+    // returns false if there's no more room, or no victim.
+    bool EvictFlow(const ndFlowKey &key, unsigned shard);
+
     int exit_code;
 
     ndInstanceStatus status;
@@ -323,7 +464,9 @@ public:
     ndAddrType addr_types;
     ndDNSHintCache *dns_hint_cache;
     ndFlowHashCache *flow_hash_cache;
+    ndDetectionCache *detection_cache;
     ndFlowMap *flow_buckets;
+    ndFlowAdmission *flow_admission;
 #ifdef _ND_USE_NETLINK
     ndNetlink *netlink;
 #endif
@@ -332,6 +475,11 @@ public:
     ndConntrackThread *thread_conntrack;
 #endif
     nd_detection_threads thread_detection;
+    ndDetectionScheduler *dpi_scheduler;
+    ndDetectionBudget dpi_budget;
+    // What new nDPI detection modules are built with.  Instance
+    // thread only, as are the detection thread constructors.
+    ndNDPIConfig ndpi_config;
     ndPluginManager plugins;
 
 protected:
@@ -352,6 +500,31 @@ protected:
     size_t ReapCaptureThreads(nd_capture_threads &threads);
     bool ReloadCaptureThreads(nd_capture_threads &threads);
 
+    // Rebuild the detection threads' nDPI modules, in the
+    // background, if the enabled protocols have changed.
+    // Detection carries on throughout; see
+    // ndDetectionThread::Reload().
+    void ReloadDetectionModules(void);
+    void LoadDetectionModules(void);
+    // Hand out the loaded modules once they're all built.
+    void ProcessDetectionModules(void);
+
+    // Builds new nDPI modules, for the detection threads in
+    // ndpi_reload, while non-null.  Reloads requested meanwhile
+    // set ndpi_reload_pending.
+    ndNDPIModuleLoader *ndpi_loader;
+    vector<ndDetectionThread *> ndpi_reload;
+    bool ndpi_reload_pending;
+
+    // Run-to-completion detection engines, one per capture
+    // thread, keyed by the flow's dpi_thread_id.
+    nd_detection_threads thread_detection_inline;
+
+    ndDetectionThread *CreateDetectionInline(ndCaptureThread *thread,
+      int16_t cpu, uint8_t private_addr);
+    void DestroyDetectionInline(void);
+    void DestroyDetectionInline(int16_t id);
+
     int WaitForIPC(int timeout = -1);
 
     void UpdateStatus(void);
@@ -359,13 +532,69 @@ protected:
     void DisplayDebugScoreboard(void);
 
     bool ExpireFlow(nd_flow_ptr &flow);
+    // Remove an expired flow from the flow map, unless it is
+    // still referenced elsewhere.
+    bool PurgeFlow(nd_flow_ptr &flow, unsigned shard);
+
+    // Idle expiry timers (see ndFlowTimerWheel).  A zero due
+    // time selects the flow's idle expiry time.
+    void ScheduleFlow(nd_flow_ptr &flow, unsigned shard,
+      uint64_t due = 0);
+    void ScheduleFlows(const vector<ndFlowKey> &keys,
+      unsigned shard);
+    void ExpireFlows(time_t now);
+
+    // Announce flows evicted by capture threads, and expire
+    // those handed over unclassified.
+    void ProcessEvictedFlows(void);
+
+    // Run once a second (or so) by the instance thread: fire due
+    // expiry timers, and walk the next slice of flow buckets.
+    void ProcessFlowTick(void);
 
     void ProcessUpdate(nd_capture_threads &threads);
 
+    // Warm restart (see ndFlowSnapshot).
+    void SaveFlowSnapshot(void);
+    void LoadFlowSnapshot(nd_capture_threads &threads);
+
     void ProcessFlows(void);
+    // Reset the interval counters of flows seen this interval.
+    void ResetFlows(void);
+    // Walk flow buckets from flow_bucket_next, up to (but not
+    // including) bucket end.
+    void ProcessFlowBuckets(size_t end);
+    void ProcessFlowBucket(size_t b);
 
     ndTimer timer_update, timer_update_napi;
 
+    ndFlowTimerWheel flow_timers;
+    time_t flow_tick;
+
+    // Flows seen this interval, and the shard of each.
+    vector<pair<ndFlowKey, unsigned>> flow_active;
+
+    // Totals accumulated since the last update interval.
+    ndFlowMapTotals flow_totals;
+
+    // Flows evicted (or to be expired) by EvictFlow(), and the
+    // batch being processed by ProcessEvictedFlows().  Both are
+    // reserved to ND_FLOW_EVICT_PENDING entries up front.
+    mutex flow_evicted_lock;
+    vector<ndFlowEvicted> flow_evicted, flow_evicted_batch;
+    atomic<size_t> flow_evict_pending;
+
+    // Unclassified victims (and their memory) not yet expired.
+    atomic<size_t> flows_evicting;
+    atomic<size_t> flows_evicting_bytes;
+
+    // Next flow bucket to walk this update interval.
+    size_t flow_bucket_next;
+
+    // Next run-to-completion engine ID.  IDs are not reused, as
+    // flows may outlive the engine they were detected on.
+    int16_t dpi_inline_next;
+
     string tag;
     string self;
     pid_t self_pid;
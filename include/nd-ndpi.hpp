@@ -20,7 +20,11 @@
 
 #pragma once
 
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
 #include <string>
+#include <vector>
 
 using namespace std;
 
@@ -28,8 +32,139 @@ using namespace std;
 #include <ndpi_main.h>
 #include <ndpi_typedefs.h>
 
+#include "nd-thread.hpp"
+
+#define ND_NDPI_FLOW_POOL_CACHE \
+    1024  // Maximum cached (free) nDPI flows per pool.
+
+// What an nDPI detection module is built with.
+struct ndNDPIConfig {
+    ndpi_init_prefs prefs;
+    NDPI_PROTOCOL_BITMASK protos;
+};
+
+// Check the nDPI library version and install its allocators.
+// Once, at start-up, before any detection module is built.
 void ndpi_global_init(void);
 
-struct ndpi_detection_module_struct *nd_ndpi_init(void);
+// Fill config from the loaded protocols configuration.
+void nd_ndpi_config(ndNDPIConfig &config);
+
+struct ndpi_detection_module_struct *nd_ndpi_init(
+  const ndNDPIConfig &config);
 
 void nd_ndpi_free(struct ndpi_detection_module_struct *ndpi);
+
+// A reference counted nDPI detection module.  Held by its
+// detection thread, and by every nDPI flow that started
+// detection on it, so a module replaced on reload lives on
+// until the last of those flows is done with it.
+class ndNDPIModule
+{
+public:
+    ndNDPIModule(const ndNDPIConfig &config);
+
+    inline struct ndpi_detection_module_struct *Get(void) const {
+        return ndpi;
+    }
+
+    inline void Acquire(void) {
+        refs.fetch_add(1, memory_order_relaxed);
+    }
+
+    // Drop a reference.  Any thread.
+    void Release(void);
+
+protected:
+    virtual ~ndNDPIModule();
+
+    struct ndpi_detection_module_struct *ndpi;
+    atomic<size_t> refs;
+};
+
+// Builds count nDPI detection modules on its own thread, so a
+// protocols reload doesn't stall the instance thread for an
+// automata build per detection thread.  Modules can't be shared
+// between detection threads: nDPI keeps per-packet state in them.
+class ndNDPIModuleLoader : public ndThread
+{
+public:
+    ndNDPIModuleLoader(const string &tag,
+      const ndNDPIConfig &config, size_t count);
+    virtual ~ndNDPIModuleLoader();
+
+    virtual void *Entry(void);
+
+    // Take a built module (and its reference), or nullptr once
+    // there are none left.  Only once HasTerminated().
+    ndNDPIModule *Pop(void);
+
+protected:
+    ndNDPIConfig config;
+    size_t count;
+    vector<ndNDPIModule *> modules;
+};
+
+class ndNDPIFlowPool;
+
+// Every pooled nDPI flow is prefixed by this header, so it can
+// be handed back to the pool that owns it from any thread.
+struct ndNDPIFlowChunk {
+    ndNDPIFlowPool *pool;
+    ndNDPIFlowChunk *next;
+    ndNDPIModule *module;
+} __attribute__((aligned(16)));
+
+// Per-detection-thread free list of nDPI flow state
+// (ndpi_flow_struct).
+//
+// Flows are allocated by the owning detection thread, and are
+// normally handed back by it (Put) as soon as detection is
+// complete, straight on to the private free list.  Flows
+// released elsewhere (Free, from ndFlow::Release) are pushed
+// on to a lock-free return stack, reclaimed in bulk by the
+// owner.  Like ndPacketPool, the pool is reference counted by
+// its owner and every outstanding flow.
+class ndNDPIFlowPool
+{
+public:
+    ndNDPIFlowPool(const string &tag,
+      size_t max_cache = ND_NDPI_FLOW_POOL_CACHE);
+
+    // Allocate a zeroed flow, to be detected by module (which
+    // the flow references until it is returned).  Owner thread
+    // only.
+    struct ndpi_flow_struct *Create(ndNDPIModule *module);
+
+    // Return a flow from the owner thread.
+    void Put(struct ndpi_flow_struct *flow);
+
+    // Return a flow to its pool.  Any thread.
+    static void Free(struct ndpi_flow_struct *flow);
+
+    // The module a flow was created for.
+    static ndNDPIModule *GetModule(struct ndpi_flow_struct *flow);
+
+    // Drop the owner's reference.
+    void Release(void);
+
+protected:
+    virtual ~ndNDPIFlowPool();
+
+    static ndNDPIFlowChunk *GetChunk(struct ndpi_flow_struct *flow);
+
+    void Reclaim(void);
+    void Recycle(ndNDPIFlowChunk *chunk);
+
+    string tag;
+    atomic<size_t> refs;
+    atomic<ndNDPIFlowChunk *> returned;
+
+    ndNDPIFlowChunk *free_list;
+
+    size_t max_cache;
+    size_t cached;
+
+    uint64_t allocs;
+    uint64_t hits;
+};
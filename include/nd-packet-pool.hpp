@@ -0,0 +1,122 @@
+// Netify Agent
+// Copyright (C) 2015-2023 eGloo Incorporated
+// <http://www.egloo.ca>
+//
+// This program is free software: you can redistribute it
+// and/or modify it under the terms of the GNU General
+// Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your
+// option) any later version.
+//
+// This program is distributed in the hope that it will be
+// useful, but WITHOUT ANY WARRANTY; without even the
+// implied warranty of MERCHANTABILITY or FITNESS FOR A
+// PARTICULAR PURPOSE.  See the GNU General Public License
+// for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this program.  If not, see
+// <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "nd-packet.hpp"
+
+using namespace std;
+
+#define ND_PACKET_POOL_MIN_SIZE \
+    256  // Smallest size class (packet + payload), bytes.
+#define ND_PACKET_POOL_CLASSES \
+    10  // Size classes: MIN_SIZE << 0 .. MIN_SIZE << 9
+#define ND_PACKET_POOL_CACHE_KB \
+    8192  // Maximum cached (free) bytes per pool in kB
+
+class ndPacketPool;
+
+// Every pool allocation is prefixed by this header.  It
+// lets any thread hand a chunk back to the pool that owns it.
+struct ndPacketPoolChunk {
+    ndPacketPool *pool;
+    ndPacketPoolChunk *next;
+    unsigned size_class;
+} __attribute__((aligned(16)));
+
+// A packet whose object and payload share one pool chunk.
+class ndPacketPooled : public ndPacket
+{
+public:
+    ndPacketPooled(const status_flags &status,
+      const uint16_t &length, const uint16_t &caplen,
+      uint8_t *data, const struct timeval &tv)
+      : ndPacket(status, length, caplen, data, tv) { }
+
+    virtual ~ndPacketPooled() { data = nullptr; }
+
+    static void *operator new(size_t size, void *chunk) {
+        return chunk;
+    }
+    static void operator delete(void *ptr);
+    static void operator delete(void *ptr, void *chunk) {
+        operator delete(ptr);
+    }
+};
+
+// Per-capture-thread, size-classed packet allocator.
+//
+// Allocation is done only by the owning (capture) thread
+// from private free lists.  Chunks may be freed by any
+// thread (typically a detection thread); they are pushed on
+// to a lock-free return stack which the owner reclaims in
+// bulk once a private free list runs dry.
+//
+// The pool is reference counted: the owner holds one
+// reference and every outstanding chunk holds another, so it
+// is safe for the capture thread to exit while packets are
+// still waiting in detection queues.
+class ndPacketPool
+{
+public:
+    ndPacketPool(const string &tag,
+      size_t max_cache = ND_PACKET_POOL_CACHE_KB * 1024);
+
+    // Allocate a packet with room for caplen bytes of payload.
+    // The payload pointer is returned in data; the caller is
+    // expected to fill it.  Owner thread only.
+    ndPacket *Create(const ndPacket::status_flags &status,
+      uint16_t length, uint16_t caplen,
+      const struct timeval &tv, uint8_t *&data);
+
+    // Allocate size bytes of raw storage, for packet classes
+    // that carry no payload of their own (zero-copy packets).
+    // Release with Free().  Owner thread only.
+    void *Alloc(size_t size);
+
+    // Return a chunk to its pool.  Any thread.
+    static void Free(void *ptr);
+
+    // Drop the owner's reference.
+    void Release(void);
+
+protected:
+    virtual ~ndPacketPool();
+
+    void Reclaim(void);
+    void Recycle(ndPacketPoolChunk *chunk);
+
+    string tag;
+    atomic<size_t> refs;
+    atomic<ndPacketPoolChunk *> returned;
+
+    ndPacketPoolChunk *free_list[ND_PACKET_POOL_CLASSES];
+
+    size_t max_cache;
+    size_t cached;
+
+    uint64_t allocs;
+    uint64_t hits;
+};
@@ -114,6 +114,11 @@ public:
 
     struct flow_t {
         uint64_t dropped;
+        uint64_t evicted;
+        uint64_t refused;
+        uint64_t cache_hits;
+        uint64_t cache_misses;
+        uint64_t cache_saved_ns;  // Estimated lookup time saved
     } flow;
 
     ndPacketStats() { Reset(); }
@@ -145,6 +150,12 @@ public:
         pkt.queue_dropped += rhs.pkt.queue_dropped;
         pkt.capture_dropped += rhs.pkt.capture_dropped;
         pkt.capture_filtered += rhs.pkt.capture_filtered;
+        flow.dropped += rhs.flow.dropped;
+        flow.evicted += rhs.flow.evicted;
+        flow.refused += rhs.flow.refused;
+        flow.cache_hits += rhs.flow.cache_hits;
+        flow.cache_misses += rhs.flow.cache_misses;
+        flow.cache_saved_ns += rhs.flow.cache_saved_ns;
 
         return *this;
     }
@@ -180,6 +191,12 @@ public:
         serialize(output, { "ip_bytes" }, pkt.ip_bytes);
         serialize(output, { "wire_bytes" }, pkt.wire_bytes);
         serialize(output, { "flow_dropped" }, flow.dropped);
+        serialize(output, { "flow_evicted" }, flow.evicted);
+        serialize(output, { "flow_refused" }, flow.refused);
+        serialize(output, { "flow_cache_hits" }, flow.cache_hits);
+        serialize(output, { "flow_cache_misses" }, flow.cache_misses);
+        serialize(output, { "flow_cache_saved_us" },
+          flow.cache_saved_ns / 1000);
         serialize(output, { "queue_dropped" }, pkt.queue_dropped);
         serialize(output, { "capture_dropped" }, pkt.capture_dropped);
         serialize(output, { "capture_filtered" },
@@ -26,6 +26,7 @@
 #include <unordered_map>
 #include <vector>
 
+#include "nd-flow-arena.hpp"
 #include "nd-ndpi.hpp"
 #include "ndpi_protocol_ids.h"
 
@@ -1175,8 +1176,6 @@ const nd_ndpi_portmap_t nd_ndpi_portmap = {
       } },
 };
 
-class ndFlow;
-typedef shared_ptr<ndFlow> nd_flow_ptr;
 const nd_proto_id_t
 nd_ndpi_proto_find(uint16_t id, nd_flow_ptr const &flow);
 const uint16_t nd_ndpi_proto_find(unsigned id);
@@ -83,16 +83,65 @@
 #define ND_FHC_PURGE_DIVISOR \
     10  // Divisor of FHC_ENTRIES to delete on purge.
 
+#define ND_MAX_DETECTION_CACHE_ENTRIES \
+    16384  // Detection cache entries (shared by all threads).
+#define ND_TTL_DETECTION_CACHE_ENTRY \
+    300  // Detection cache entry lifetime (5m).
+
 #define ND_FLOW_MAP_BUCKETS \
     128  // Default number of flow map buckets.
+#define ND_FLOW_MAP_SLOTS \
+    256  // Initial flow map bucket slots (power of 2).
+#define ND_FLOW_MAP_CACHE_SLOTS \
+    64  // Per capture thread flow map cache slots (power of 2).
+#define ND_FLOW_EVICT_SAMPLES \
+    16  // Flows sampled per eviction.
+#define ND_FLOW_EVICT_MAX \
+    8  // Maximum evictions to make room for one new flow.
+#define ND_FLOW_EVICT_PENDING \
+    1024  // Maximum evictions pending announcement per second.
+#define ND_FLOW_ADMIT_OFFENDERS \
+    32  // Flow admission offenders reported per update.
 
 #define ND_MAX_PKT_QUEUE_KB \
     8192  // Maximum packet queue size in kB
 #define ND_PKTQ_FLUSH_DIVISOR \
     10  // Divisor of PKT_QUEUE_KB packets to flush.
+#define ND_DETECTION_QUEUE_SLOT_SIZE \
+    512  // Packet queue bytes per detection ring slot.
+#define ND_DETECTION_QUEUE_MIN_SLOTS \
+    256  // Minimum detection ring slots.
+#define ND_DETECTION_QUEUE_SAMPLE \
+    64  // Detection queue latency sampling interval (entries).
+#define ND_DETECTION_SPIN_MIN \
+    64  // Minimum queue polls before a detection thread parks.
+#define ND_DETECTION_SPIN_MAX \
+    16384  // Maximum queue polls before a detection thread parks.
+#define ND_DETECTION_WAKE_BATCH \
+    64  // Packets a capture thread queues between wake-ups.
+#define ND_DETECTION_LOAD_CPU_WEIGHT \
+    64  // Queue depth equivalent of a fully busy detection thread.
+#define ND_DETECTION_LOAD_INTERVAL \
+    100  // Detection thread CPU load sampling interval in ms.
+#define ND_DETECTION_STEAL_DEPTH \
+    32  // Minimum queue depth of a thread to steal flows from.
 
 #define ND_MAX_DETECTION_PKTS \
     32  // Maximum number of packets to process.
+#define ND_DETECTION_BUDGET_MIN \
+    4  // Minimum detection budget of a congested unknown flow.
+#define ND_DETECTION_BUDGET_CONGESTED_DIVISOR \
+    4  // Divisor of unknown flow budgets when congested.
+#define ND_DETECTION_BUDGET_PERCENTILE \
+    95  // Percent of flows a learned detection budget covers.
+#define ND_DETECTION_BUDGET_MARGIN \
+    2  // Packets added to a learned detection budget.
+#define ND_DETECTION_BUDGET_SAMPLES \
+    100  // Flows seen before a detection budget is learned.
+#define ND_DETECTION_BUDGET_DECAY \
+    10000  // Flows seen before detection budget history is aged.
+#define ND_DETECTION_QUEUE_CONGESTED \
+    50  // Detection queue use (percent) considered congested.
 
 #ifndef ND_VOLATILE_STATEDIR
 #define ND_VOLATILE_STATEDIR "/var/run/netifyd"
@@ -144,6 +193,10 @@
 #define ND_TPV3_RB_FRAME_SIZE   (1 << 11)  // Bytes
 #define ND_TPV3_RB_BLOCKS       64
 
+#define ND_XDP_FRAME_SIZE       (1 << 11)  // Bytes
+#define ND_XDP_FRAMES           4096
+#define ND_XDP_RING_SIZE        2048
+
 #define ND_AGENT_STATUS_BASE    "status.json"
 #define ND_AGENT_STATUS_PATH \
     ND_VOLATILE_STATEDIR "/" ND_AGENT_STATUS_BASE
@@ -406,6 +406,68 @@ bool ndAddr::MakeString(const ndAddr &a, string &result,
     return false;
 }
 
+bool ndFlowAddr::Create(ndFlowAddr &a,
+  const struct in_addr *in_addr) {
+    memset(a.addr, 0, sizeof(a.addr));
+    memcpy(a.addr, in_addr, sizeof(struct in_addr));
+
+    a.port = 0;
+    a.family = afINET;
+
+    return true;
+}
+
+bool ndFlowAddr::Create(ndFlowAddr &a,
+  const struct in6_addr *in6_addr) {
+    memcpy(a.addr, in6_addr, sizeof(struct in6_addr));
+
+    a.port = 0;
+    a.family = afINET6;
+
+    return true;
+}
+
+bool ndFlowAddr::Create(ndFlowAddr &a,
+  const uint8_t *hw_addr, size_t length) {
+    if (length != ETH_ALEN) {
+        nd_dprintf("Invalid hardware address size: %lu\n", length);
+        return false;
+    }
+
+    memset(a.addr, 0, sizeof(a.addr));
+    memcpy(a.addr, hw_addr, ETH_ALEN);
+
+    a.port = 0;
+    a.family = afETHER;
+
+    return true;
+}
+
+ndAddr ndFlowAddr::GetAddr(void) const {
+    ndAddr a;
+    struct in_addr in_addr;
+    struct in6_addr in6_addr;
+
+    switch (family) {
+    case afINET:
+        memcpy(&in_addr, addr, sizeof(struct in_addr));
+        ndAddr::Create(a, &in_addr);
+        a.SetPort(port);
+        break;
+    case afINET6:
+        memcpy(&in6_addr, addr, sizeof(struct in6_addr));
+        ndAddr::Create(a, &in6_addr);
+        a.SetPort(port);
+        break;
+    case afETHER:
+        ndAddr::Create(a, addr, ETH_ALEN);
+        break;
+    default: break;
+    }
+
+    return a;
+}
+
 ndAddrType::ndAddrType() {
     // Add private networks
     AddAddress(ndAddr::atRESERVED, "127.0.0.0/8");
@@ -774,6 +836,21 @@ size_t ndInterface::UpdateAddrs(ndInterfaces &interfaces) {
     return count;
 }
 
+uint32_t ndInterface::GetIndex(const string &ifname) {
+    static mutex index_lock;
+    static map<string, uint32_t> index;
+
+    lock_guard<mutex> ul(index_lock);
+
+    auto it = index.find(ifname);
+    if (it != index.end()) return it->second;
+
+    uint32_t id = (uint32_t)index.size() + 1;
+    index.insert(make_pair(ifname, id));
+
+    return id;
+}
+
 size_t ndInterface::UpdateAddrs(const struct ifaddrs *if_addrs) {
     size_t count = 0;
     const struct ifaddrs *ifa_addr = if_addrs;
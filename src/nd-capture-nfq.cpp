@@ -119,23 +119,6 @@ static int ndCaptureNFQueue_Callback(
     if (attr[NFQA_CAP_LEN])
         pkt_caplen = ntohl(mnl_attr_get_u32(attr[NFQA_CAP_LEN]));
 
-    ndPacket *pkt = nullptr;
-    // One-and-only packet copy...
-    uint8_t *pkt_data =
-      new uint8_t[sizeof(struct ether_header) + pkt_len];
-    if (pkt_data == nullptr) {
-        throw ndSystemException(__PRETTY_FUNCTION__,
-          "new pkt_data", errno);
-    }
-
-    struct ether_header *hdr_eth = (struct ether_header *)pkt_data;
-    memset(hdr_eth, 0, sizeof(struct ether_addr));
-    hdr_eth->ether_type = pkt_hdr->hw_protocol;
-    if (pkt_hwaddr != nullptr) {
-        memcpy(&hdr_eth->ether_shost[0],
-          &pkt_hwaddr->hw_addr[0], ETH_ALEN);
-    }
-
     struct timeval tv;
 
     if (pkt_ts == nullptr) {
@@ -149,17 +132,23 @@ static int ndCaptureNFQueue_Callback(
         tv.tv_usec = (time_t)pkt_ts->usec;
     };
 
+    // One-and-only packet copy...
+    uint8_t *pkt_data = nullptr;
+    ndPacket *pkt = nfq->GetPacketPool()->Create(ndPacket::STATUS_OK,
+      pkt_caplen, sizeof(struct ether_header) + pkt_len, tv, pkt_data);
+
+    struct ether_header *hdr_eth = (struct ether_header *)pkt_data;
+    memset(hdr_eth, 0, sizeof(struct ether_header));
+    hdr_eth->ether_type = pkt_hdr->hw_protocol;
+    if (pkt_hwaddr != nullptr) {
+        memcpy(&hdr_eth->ether_shost[0],
+          &pkt_hwaddr->hw_addr[0], ETH_ALEN);
+    }
+
     uint8_t *pkt_offset = pkt_data + sizeof(struct ether_header);
     memcpy(pkt_offset, payload, pkt_len);
 
-    pkt = new ndPacket(ndPacket::STATUS_OK, pkt_caplen,
-      sizeof(struct ether_header) + pkt_len, pkt_data, tv);
-
-    if (pkt != nullptr) nfq->PushPacket(pkt);
-    else {
-        throw ndSystemException(__PRETTY_FUNCTION__,
-          "new ndPacket", errno);
-    }
+    nfq->PushPacket(pkt);
 
     if (skbinfo & NFQA_SKB_GSO)
         nd_dprintf("%s: GSO packet.\n", tag);
@@ -330,6 +319,8 @@ void *ndCaptureNFQueue::Entry(void) {
             Unlock();
 
             pkt_queue.clear();
+
+            NotifyDetectionThreads();
         }
     }
 
@@ -90,16 +90,12 @@ void *ndCapturePcap::Entry(void) {
               (rc = pcap_next_ex(pcap, &pkt_header, &pkt_data)) > 0)
             {
                 // One-and-only packet copy...
-                uint8_t *pd = new uint8_t[pkt_header->caplen];
-                if (pd == nullptr)
-                    throw ndCaptureThreadException(strerror(ENOMEM));
+                uint8_t *pd = nullptr;
+                pkt = packet_pool->Create(pkt_status,
+                  pkt_header->len, pkt_header->caplen,
+                  pkt_header->ts, pd);
                 memcpy(pd, pkt_data, pkt_header->caplen);
 
-                pkt = new ndPacket(pkt_status, pkt_header->len,
-                  pkt_header->caplen, pd, pkt_header->ts);
-                if (pkt == nullptr)
-                    throw ndCaptureThreadException(strerror(ENOMEM));
-
                 Lock();
 
                 try {
@@ -114,6 +110,8 @@ void *ndCapturePcap::Entry(void) {
                 Unlock();
             }
 
+            NotifyDetectionThreads();
+
             if (rc < 0) {
                 capture_state = STATE_OFFLINE;
 
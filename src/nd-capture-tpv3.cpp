@@ -22,11 +22,15 @@
 #include "config.h"
 #endif
 
+#include <atomic>
+
+#include <linux/filter.h>
 #include <net/if.h>
 #include <pcap/pcap.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 
 #if defined(HAVE_PCAP_DLT_H)
 #include <pcap/dlt.h>
@@ -47,11 +51,17 @@
 
 #define _ND_VLAN_OFFSET (2 * ETH_ALEN)
 
+// Snap length returned by a kernel-attached filter for packets
+// that do not match.  Such packets take up only a header's worth
+// of ring space, are counted as filtered, and are never copied.
+// Matching packets are always longer than this.
+#define _ND_BPF_FILTERED_SNAPLEN 1
+
 class ndPacketRing;
 class ndPacketRingBlock
 {
 public:
-    ndPacketRingBlock(void *entry);
+    ndPacketRingBlock(ndPacketRing *ring, void *entry);
 
     inline uint32_t GetStatus(void) {
         return hdr.bdh->hdr.bh1.block_status;
@@ -61,10 +71,17 @@ public:
         hdr.bdh->hdr.bh1.block_status = status;
     }
 
-    inline void Release(void) {
-        hdr.bdh->hdr.bh1.block_status = TP_STATUS_KERNEL;
+    inline bool IsReferenced(void) const {
+        return (refs.load() > 0);
     }
 
+    // The capture thread holds one reference while a block is
+    // being processed, plus one for every zero-copy packet that
+    // still points into it.  The block is handed back to the
+    // kernel when the last reference is dropped.
+    void Acquire(void);
+    void Release(void);
+
     size_t ProcessPackets(ndPacketRing *ring,
       vector<ndPacket *> &pkt_queue);
 
@@ -72,6 +89,9 @@ protected:
     friend class ndPacket;
     friend class ndPacketRing;
 
+    ndPacketRing *ring;
+    atomic<unsigned> refs;
+
     union {
         uint8_t *raw;
         struct tpacket_block_desc *bdh;
@@ -80,32 +100,74 @@ protected:
 
 typedef vector<ndPacketRingBlock *> ndPacketRingBlocks;
 
+// Zero-copy packet: data points directly into a ring block
+// and is never freed; destruction drops the block reference.
+// The object itself comes from the capture thread's pool.
+class ndPacketRingEntry : public ndPacket
+{
+public:
+    static void *operator new(size_t size, ndPacketPool *pool) {
+        return pool->Alloc(size);
+    }
+    static void operator delete(void *ptr) {
+        ndPacketPool::Free(ptr);
+    }
+    static void operator delete(void *ptr, ndPacketPool *pool) {
+        ndPacketPool::Free(ptr);
+    }
+
+    ndPacketRingEntry(ndPacketRingBlock *block,
+      const status_flags &status, const uint16_t &length,
+      const uint16_t &caplen, uint8_t *data,
+      const struct timeval &tv)
+      : ndPacket(status, length, caplen, data, tv),
+        block(block) {
+        block->Acquire();
+    }
+
+    virtual ~ndPacketRingEntry() {
+        data = nullptr;
+        block->Release();
+    }
+
+protected:
+    ndPacketRingBlock *block;
+};
+
 class ndPacketRing
 {
 public:
     ndPacketRing(const string &ifname,
       const nd_config_tpv3 &config,
-      ndPacketStats *stats);
-
-    virtual ~ndPacketRing();
+      ndPacketStats *stats, ndPacketPool *pool);
 
     inline int GetDescriptor(void) { return sd; }
 
     void SetFilter(const string &expr);
-    bool ApplyFilter(const uint8_t *pkt, size_t snaplen,
-      size_t length) const;
+    bool ApplyFilter(const uint8_t *pkt, size_t length,
+      size_t snaplen) const;
 
     ndPacketRingBlock *Next(void);
 
-    ndPacket *CopyPacket(const void *entry,
-      ndPacket::status_flags &status);
+    ndPacket *CopyPacket(ndPacketRingBlock *block,
+      const void *entry, ndPacket::status_flags &status);
 
     bool GetStats(void);
 
+    // The ring is reference counted so that the mapped blocks
+    // outlive the capture thread while zero-copy packets are
+    // still waiting in detection queues.
+    inline void Acquire(void) { refs++; }
+    inline void Release(void) {
+        if (refs.fetch_sub(1) == 1) delete this;
+    }
+
 protected:
     friend class ndPacket;
     friend class ndPacketRingBlock;
 
+    virtual ~ndPacketRing();
+
     string ifname;
     int sd;
     void *buffer;
@@ -120,15 +182,46 @@ protected:
     struct tpacket_req3 tp_req;
 
     struct bpf_program filter;
+    bool filter_kernel;
+    // When the filter was attached; frames received before then
+    // are still filtered in userspace.
+    struct timeval filter_attached;
+
+    bool zero_copy;
+    atomic<unsigned> refs;
 
     ndPacketStats *stats;
+    ndPacketPool *pool;
 };
 
-ndPacketRingBlock::ndPacketRingBlock(void *entry) {
+ndPacketRingBlock::ndPacketRingBlock(ndPacketRing *ring, void *entry)
+  : ring(ring), refs(0) {
     hdr.raw = static_cast<uint8_t *>(entry);
     hdr.bdh = static_cast<struct tpacket_block_desc *>(entry);
 }
 
+void ndPacketRingBlock::Acquire(void) {
+    if (refs.fetch_add(1) == 0) ring->Acquire();
+}
+
+void ndPacketRingBlock::Release(void) {
+    unsigned count = refs.load();
+
+    // The block must be back with the kernel before it shows as
+    // unreferenced, or Next() could walk it again.  No one else
+    // takes a reference on a block held only by the caller, so
+    // the last reference is safe to drop after the hand-back.
+    while (count > 1) {
+        if (refs.compare_exchange_weak(count, count - 1)) return;
+    }
+
+    atomic_thread_fence(memory_order_release);
+    hdr.bdh->hdr.bh1.block_status = TP_STATUS_KERNEL;
+
+    refs.store(0);
+    ring->Release();
+}
+
 size_t ndPacketRingBlock::ProcessPackets(ndPacketRing *ring,
   vector<ndPacket *> &pkt_queue) {
     struct tpacket3_hdr *entry;
@@ -139,7 +232,7 @@ size_t ndPacketRingBlock::ProcessPackets(ndPacketRing *ring,
 
     for (size_t i = 0; i < packets; i++) {
         ndPacket::status_flags status;
-        ndPacket *pkt = ring->CopyPacket(entry, status);
+        ndPacket *pkt = ring->CopyPacket(this, entry, status);
 
         if (status & ndPacket::STATUS_FILTERED)
             ring->stats->pkt.capture_filtered++;
@@ -160,10 +253,13 @@ size_t ndPacketRingBlock::ProcessPackets(ndPacketRing *ring,
 
 ndPacketRing::ndPacketRing(const string &ifname,
   const nd_config_tpv3 &config,
-  ndPacketStats *stats)
+  ndPacketStats *stats, ndPacketPool *pool)
   : ifname(ifname), sd(-1), buffer(nullptr), tp_hdr_len(0),
     tp_reserved(0), tp_frame_size(0),
-    tp_ring_size(0), tp_req{ 0 }, filter{ 0 }, stats(stats) {
+    tp_ring_size(0), tp_req{ 0 }, filter{ 0 }, filter_kernel(false),
+    filter_attached{ 0, 0 },
+    zero_copy(config.rb_zero_copy), refs(1), stats(stats),
+    pool(pool) {
     unsigned so_uintval;
 
     struct ifreq ifr;
@@ -392,29 +488,32 @@ ndPacketRing::ndPacketRing(const string &ifname,
           "error requesting RX ring");
     }
 
-    buffer = mmap(0, tp_req.tp_block_size * tp_req.tp_block_nr,
-      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED, sd, 0);
+    tp_ring_size = tp_req.tp_block_size * tp_req.tp_block_nr;
+
+    buffer = mmap(0, tp_ring_size, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_LOCKED, sd, 0);
     if (buffer == MAP_FAILED) {
-        nd_dprintf("%s: mmap(%u): %s\n", ifname.c_str(),
-          tp_req.tp_block_size * tp_req.tp_block_nr,
-          strerror(errno));
+        nd_dprintf("%s: mmap(%lu): %s\n", ifname.c_str(),
+          tp_ring_size, strerror(errno));
         throw ndCaptureThreadException(
           "error mapping RX ring");
     }
 
     for (unsigned b = 0; b < tp_req.tp_block_nr; b++) {
-        ndPacketRingBlock *entry = new ndPacketRingBlock(
+        ndPacketRingBlock *entry = new ndPacketRingBlock(this,
           (void *)(((size_t)buffer) + (b * tp_req.tp_block_size)));
         blocks.push_back(entry);
     }
 
     it_block = blocks.begin();
 
-    nd_dprintf("%s: created %lu packet ring blocks.\n",
-      ifname.c_str(), blocks.size());
+    nd_dprintf("%s: created %lu packet ring blocks%s.\n",
+      ifname.c_str(), blocks.size(),
+      (zero_copy) ? " (zero-copy)" : "");
 }
 
 ndPacketRing::~ndPacketRing() {
+    if (filter.bf_insns != nullptr) pcap_freecode(&filter);
     if (buffer) munmap(buffer, tp_ring_size);
     if (sd != -1) close(sd);
     for (auto &i : blocks) delete i;
@@ -442,6 +541,53 @@ void ndPacketRing::SetFilter(const string &expr) {
 #ifdef HAVE_PCAP_OPEN_DEAD
     pcap_close(pcap);
 #endif
+
+#ifdef SKF_AD_VLAN_TAG_PRESENT
+    // VLAN tags are stripped (off-loaded) before the kernel runs
+    // socket filters, and are only restored later by CopyPacket.
+    // The attached copy of the program therefore passes tagged
+    // packets straight through, to be filtered in userspace on
+    // the restored frame.  Everything else that does not match is
+    // truncated to _ND_BPF_FILTERED_SNAPLEN rather than dropped,
+    // so that capture_filtered remains exact.
+    vector<struct sock_filter> insns;
+    insns.reserve(filter.bf_len + 3);
+
+    insns.push_back(BPF_STMT(BPF_LD | BPF_B | BPF_ABS,
+      (uint32_t)SKF_AD_OFF + SKF_AD_VLAN_TAG_PRESENT));
+    insns.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 1, 0));
+    insns.push_back(BPF_STMT(BPF_RET | BPF_K,
+      (uint32_t)ndGC.max_capture_length));
+
+    for (unsigned i = 0; i < filter.bf_len; i++) {
+        uint32_t k = filter.bf_insns[i].k;
+        if (filter.bf_insns[i].code == (BPF_RET | BPF_K) && k == 0)
+            k = _ND_BPF_FILTERED_SNAPLEN;
+
+        insns.push_back(BPF_JUMP(filter.bf_insns[i].code, k,
+          filter.bf_insns[i].jt, filter.bf_insns[i].jf));
+    }
+
+    struct sock_fprog prog;
+    prog.len = (unsigned short)insns.size();
+    prog.filter = &insns[0];
+
+    if (setsockopt(sd, SOL_SOCKET, SO_ATTACH_FILTER,
+          (const void *)&prog, sizeof(struct sock_fprog)) < 0)
+    {
+        nd_dprintf(
+          "%s: setsockopt(SO_ATTACH_FILTER): %s, using "
+          "userspace BPF.\n",
+          ifname.c_str(), strerror(errno));
+        return;
+    }
+
+    gettimeofday(&filter_attached, NULL);
+    filter_kernel = true;
+
+    nd_dprintf("%s: BPF filter attached to socket.\n",
+      ifname.c_str());
+#endif
 }
 
 bool ndPacketRing::ApplyFilter(const uint8_t *pkt,
@@ -478,7 +624,10 @@ bool ndPacketRing::GetStats(void) {
 ndPacketRingBlock *ndPacketRing::Next(void) {
     ndPacketRingBlock *block = nullptr;
 
-    if ((*it_block)->hdr.bdh->hdr.bh1.block_status & TP_STATUS_USER)
+    // A block still referenced by queued zero-copy packets has
+    // not been returned to the kernel yet; it is not new data.
+    if (! (*it_block)->IsReferenced() &&
+      ((*it_block)->hdr.bdh->hdr.bh1.block_status & TP_STATUS_USER))
     {
         block = (*it_block);
 
@@ -489,8 +638,8 @@ ndPacketRingBlock *ndPacketRing::Next(void) {
     return block;
 }
 
-ndPacket *ndPacketRing::CopyPacket(const void *entry,
-  ndPacket::status_flags &status) {
+ndPacket *ndPacketRing::CopyPacket(ndPacketRingBlock *block,
+  const void *entry, ndPacket::status_flags &status) {
     const struct tpacket3_hdr *hdr = (const struct tpacket3_hdr *)entry;
 
     unsigned int tp_len, tp_mac, tp_snaplen;
@@ -502,6 +651,16 @@ ndPacket *ndPacketRing::CopyPacket(const void *entry,
 
     status = ndPacket::STATUS_INIT;
 
+    // Frames already in the ring when the filter was attached
+    // were never seen by it.
+    bool filtered = (filter_kernel &&
+      timercmp(&tv, &filter_attached, >));
+
+    if (filtered && tp_snaplen == _ND_BPF_FILTERED_SNAPLEN) {
+        status = ndPacket::STATUS_FILTERED;
+        return nullptr;
+    }
+
     if (tp_len != tp_snaplen)
         nd_dprintf("tp_len: %u, tp_snaplen: %u\n", tp_len, tp_snaplen);
 
@@ -548,22 +707,42 @@ ndPacket *ndPacketRing::CopyPacket(const void *entry,
         status |= ndPacket::STATUS_VLAN_TAG_RESTORED;
     }
 
-    if (ApplyFilter(data, tp_len, tp_snaplen)) {
+    // Only tagged packets get past a kernel-attached filter
+    // unfiltered; see SetFilter().
+    if ((! filtered ||
+          (status & ndPacket::STATUS_VLAN_TAG_RESTORED)) &&
+      ApplyFilter(data, tp_len, tp_snaplen))
+    {
         status = ndPacket::STATUS_FILTERED;
         return nullptr;
     }
 
     ndPacket *pkt = nullptr;
+
+    if (zero_copy) {
+        try {
+            pkt = new (pool) ndPacketRingEntry(block, status,
+              tp_len, tp_snaplen, data, tv);
+            status |= ndPacket::STATUS_OK;
+        }
+        catch (ndSystemException &e) {
+            status = ndPacket::STATUS_ENOMEM;
+        }
+
+        return pkt;
+    }
+
     // One-and-only packet copy...
-    uint8_t *pkt_data = new uint8_t[tp_snaplen];
+    uint8_t *pkt_data = nullptr;
 
-    if (pkt_data) {
+    try {
+        pkt = pool->Create(status, tp_len, tp_snaplen, tv, pkt_data);
         memcpy(pkt_data, data, tp_snaplen);
-        pkt = new ndPacket(status, tp_len, tp_snaplen, pkt_data, tv);
+        status |= ndPacket::STATUS_OK;
+    }
+    catch (ndSystemException &e) {
+        status = ndPacket::STATUS_ENOMEM;
     }
-
-    if (pkt) status |= ndPacket::STATUS_OK;
-    else status = ndPacket::STATUS_ENOMEM;
 
     return pkt;
 }
@@ -583,7 +762,7 @@ ndCaptureTPv3::~ndCaptureTPv3() {
     Join();
 
     ndPacketRing *_ring = static_cast<ndPacketRing *>(ring);
-    if (_ring != nullptr) delete _ring;
+    if (_ring != nullptr) _ring->Release();
 
     nd_dprintf("%s: TPv3 capture thread destroyed.\n", tag.c_str());
 }
@@ -592,7 +771,7 @@ void *ndCaptureTPv3::Entry(void) {
     fd_set fds_read;
 
     ndPacketRing *_ring = new ndPacketRing(iface->ifname,
-      iface->config_tpv3, &stats);
+      iface->config_tpv3, &stats, packet_pool);
     if (_ring == nullptr)
         throw runtime_error(strerror(ENOMEM));
 
@@ -661,8 +840,8 @@ void *ndCaptureTPv3::Entry(void) {
             capture_state = STATE_ONLINE;
         }
 
+        entry->Acquire();
         entry->ProcessPackets(_ring, pkt_queue);
-        entry->Release();
 
         if (pkt_queue.size()) {
             Lock();
@@ -675,6 +854,7 @@ void *ndCaptureTPv3::Entry(void) {
             }
             catch (...) {
                 Unlock();
+                entry->Release();
                 capture_state = STATE_OFFLINE;
                 throw;
             }
@@ -682,7 +862,11 @@ void *ndCaptureTPv3::Entry(void) {
             Unlock();
 
             pkt_queue.clear();
+
+            NotifyDetectionThreads();
         }
+
+        entry->Release();
     }
 
     capture_state = STATE_OFFLINE;
@@ -0,0 +1,939 @@
+// Netify Agent
+// Copyright (C) 2015-2023 eGloo Incorporated
+// <http://www.egloo.ca>
+//
+// This program is free software: you can redistribute it
+// and/or modify it under the terms of the GNU General
+// Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your
+// option) any later version.
+//
+// This program is distributed in the hope that it will be
+// useful, but WITHOUT ANY WARRANTY; without even the
+// implied warranty of MERCHANTABILITY or FITNESS FOR A
+// PARTICULAR PURPOSE.  See the GNU General Public License
+// for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this program.  If not, see
+// <http://www.gnu.org/licenses/>.
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <atomic>
+#include <cstddef>
+
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <linux/rtnetlink.h>
+#include <net/if.h>
+#include <pcap/pcap.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#if defined(HAVE_PCAP_DLT_H)
+#include <pcap/dlt.h>
+#elif defined(_ND_PCAP_DLT_IN_BPF_H)
+#include <pcap/bpf.h>
+#else
+#include "pcap-compat/dlt.h"
+#endif
+
+#include "nd-capture-xdp.hpp"
+#include "nd-detection.hpp"
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+// Maximum number of RX queues (XSKMAP entries) per interface
+#define _ND_XDP_MAX_QUEUES 64
+
+// Maximum descriptors to consume from the RX ring per pass
+#define _ND_XDP_RX_BATCH 64
+
+// Enable XDP socket debug logging
+// #define _ND_LOG_XDP 1
+
+static inline int nd_bpf(int cmd, union bpf_attr *attr) {
+    return (int)syscall(__NR_bpf, cmd, attr, sizeof(union bpf_attr));
+}
+
+// Attach (fd > -1) or detach (fd == -1) an XDP program to/from
+// an interface via rtnetlink.
+static int nd_xdp_link_set(int ifindex, int fd, uint32_t flags) {
+    int sd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC,
+      NETLINK_ROUTE);
+    if (sd < 0) return -errno;
+
+    struct {
+        struct nlmsghdr nh;
+        struct ifinfomsg ifi;
+        uint8_t attrs[64];
+    } req;
+
+    memset(&req, 0, sizeof(req));
+    req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg));
+    req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+    req.nh.nlmsg_type = RTM_SETLINK;
+    req.nh.nlmsg_seq = 1;
+    req.ifi.ifi_family = AF_UNSPEC;
+    req.ifi.ifi_index = ifindex;
+
+    struct rtattr *nest = (struct rtattr *)((uint8_t *)&req +
+      NLMSG_ALIGN(req.nh.nlmsg_len));
+    nest->rta_type = NLA_F_NESTED | IFLA_XDP;
+    nest->rta_len = RTA_LENGTH(0);
+
+    struct rtattr *rta = (struct rtattr *)((uint8_t *)nest +
+      nest->rta_len);
+    rta->rta_type = IFLA_XDP_FD;
+    rta->rta_len = RTA_LENGTH(sizeof(int));
+    memcpy(RTA_DATA(rta), &fd, sizeof(int));
+    nest->rta_len += RTA_ALIGN(rta->rta_len);
+
+    if (flags) {
+        rta = (struct rtattr *)((uint8_t *)nest + nest->rta_len);
+        rta->rta_type = IFLA_XDP_FLAGS;
+        rta->rta_len = RTA_LENGTH(sizeof(uint32_t));
+        memcpy(RTA_DATA(rta), &flags, sizeof(uint32_t));
+        nest->rta_len += RTA_ALIGN(rta->rta_len);
+    }
+
+    req.nh.nlmsg_len = NLMSG_ALIGN(req.nh.nlmsg_len) +
+      nest->rta_len;
+
+    int rc = 0;
+
+    if (send(sd, &req, req.nh.nlmsg_len, 0) < 0) rc = -errno;
+    else {
+        uint8_t buffer[4096];
+        ssize_t bytes = recv(sd, buffer, sizeof(buffer), 0);
+
+        if (bytes < 0) rc = -errno;
+        else {
+            struct nlmsghdr *nh = (struct nlmsghdr *)buffer;
+            for (; NLMSG_OK(nh, (size_t)bytes);
+                 nh = NLMSG_NEXT(nh, bytes))
+            {
+                if (nh->nlmsg_type != NLMSG_ERROR) continue;
+                struct nlmsgerr *err = (struct nlmsgerr *)NLMSG_DATA(nh);
+                rc = err->error;
+                break;
+            }
+        }
+    }
+
+    close(sd);
+    return rc;
+}
+
+// Per-interface XDP redirect program and XSKMAP, shared by all
+// capture instances (RX queues) of the same interface.
+class ndXDPProgram
+{
+public:
+    static ndXDPProgram *Acquire(const string &ifname,
+      int ifindex, unsigned mode);
+
+    void Release(void);
+
+    void Register(unsigned queue_id, int xsk_fd);
+    void Unregister(unsigned queue_id);
+
+protected:
+    ndXDPProgram(const string &ifname, int ifindex, unsigned mode);
+    virtual ~ndXDPProgram();
+
+    bool Attach(uint32_t flags);
+
+    static mutex registry_lock;
+    static map<string, ndXDPProgram *> registry;
+
+    string ifname;
+    int ifindex;
+    int map_fd;
+    int prog_fd;
+    uint32_t xdp_flags;
+    unsigned refs;
+};
+
+mutex ndXDPProgram::registry_lock;
+map<string, ndXDPProgram *> ndXDPProgram::registry;
+
+ndXDPProgram *ndXDPProgram::Acquire(const string &ifname,
+  int ifindex, unsigned mode) {
+    lock_guard<mutex> ul(registry_lock);
+
+    auto it = registry.find(ifname);
+    if (it != registry.end()) {
+        it->second->refs++;
+        return it->second;
+    }
+
+    ndXDPProgram *prog = new ndXDPProgram(ifname, ifindex, mode);
+    if (prog == nullptr) {
+        throw ndSystemException(__PRETTY_FUNCTION__,
+          "new ndXDPProgram", ENOMEM);
+    }
+
+    registry[ifname] = prog;
+
+    return prog;
+}
+
+void ndXDPProgram::Release(void) {
+    lock_guard<mutex> ul(registry_lock);
+
+    if (--refs > 0) return;
+
+    registry.erase(ifname);
+    delete this;
+}
+
+ndXDPProgram::ndXDPProgram(const string &ifname, int ifindex,
+  unsigned mode)
+  : ifname(ifname), ifindex(ifindex), map_fd(-1), prog_fd(-1),
+    xdp_flags(0), refs(1) {
+    // Kernels prior to 5.11 charge BPF objects to RLIMIT_MEMLOCK
+    struct rlimit rl = { RLIM_INFINITY, RLIM_INFINITY };
+    setrlimit(RLIMIT_MEMLOCK, &rl);
+
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size = sizeof(uint32_t);
+    attr.value_size = sizeof(int);
+    attr.max_entries = _ND_XDP_MAX_QUEUES;
+
+    if ((map_fd = nd_bpf(BPF_MAP_CREATE, &attr)) < 0) {
+        throw ndSystemException(__PRETTY_FUNCTION__,
+          "bpf(BPF_MAP_CREATE)", errno);
+    }
+
+    // Redirect each RX queue to its registered AF_XDP socket.
+    // Queues without a socket fall through to the stack
+    // (XDP_PASS in the flags argument, Linux 5.3+).
+    struct bpf_insn insns[] = {
+        // r2 = ctx->rx_queue_index
+        { BPF_LDX | BPF_W | BPF_MEM, BPF_REG_2, BPF_REG_1,
+          offsetof(struct xdp_md, rx_queue_index), 0 },
+        // r1 = xskmap (64-bit immediate, two instructions)
+        { BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD,
+          0, map_fd },
+        { 0, 0, 0, 0, 0 },
+        // r3 = XDP_PASS
+        { BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, XDP_PASS },
+        // r0 = bpf_redirect_map(r1, r2, r3)
+        { BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map },
+        { BPF_JMP | BPF_EXIT, 0, 0, 0, 0 },
+    };
+
+    static const char license[] = "GPL";
+
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.insns = (uint64_t)(uintptr_t)insns;
+    attr.insn_cnt = sizeof(insns) / sizeof(struct bpf_insn);
+    attr.license = (uint64_t)(uintptr_t)license;
+
+    if ((prog_fd = nd_bpf(BPF_PROG_LOAD, &attr)) < 0) {
+        int rc = errno;
+        close(map_fd);
+        throw ndSystemException(__PRETTY_FUNCTION__,
+          "bpf(BPF_PROG_LOAD)", rc);
+    }
+
+    bool attached = false;
+
+    switch (mode) {
+    case ndXDP_DRV:
+        attached = Attach(XDP_FLAGS_DRV_MODE);
+        break;
+    case ndXDP_SKB:
+        attached = Attach(XDP_FLAGS_SKB_MODE);
+        break;
+    default:
+        attached = (Attach(XDP_FLAGS_DRV_MODE) ||
+          Attach(XDP_FLAGS_SKB_MODE));
+        break;
+    }
+
+    if (! attached) {
+        close(prog_fd);
+        close(map_fd);
+        throw ndCaptureThreadException(
+          "error attaching XDP program");
+    }
+
+    nd_dprintf("%s: XDP program attached (%s mode).\n",
+      ifname.c_str(),
+      (xdp_flags & XDP_FLAGS_SKB_MODE) ? "generic" : "native");
+}
+
+ndXDPProgram::~ndXDPProgram() {
+    int rc = nd_xdp_link_set(ifindex, -1, xdp_flags);
+
+    if (rc < 0) {
+        nd_dprintf("%s: error detaching XDP program: %s\n",
+          ifname.c_str(), strerror(-rc));
+    }
+
+    if (prog_fd != -1) close(prog_fd);
+    if (map_fd != -1) close(map_fd);
+
+    nd_dprintf("%s: XDP program detached.\n", ifname.c_str());
+}
+
+bool ndXDPProgram::Attach(uint32_t flags) {
+    int rc = nd_xdp_link_set(ifindex, prog_fd,
+      flags | XDP_FLAGS_UPDATE_IF_NOEXIST);
+
+    if (rc < 0) {
+        nd_dprintf("%s: error attaching XDP program (%s): %s\n",
+          ifname.c_str(),
+          (flags & XDP_FLAGS_SKB_MODE) ? "generic" : "native",
+          strerror(-rc));
+        return false;
+    }
+
+    xdp_flags = flags;
+    return true;
+}
+
+void ndXDPProgram::Register(unsigned queue_id, int xsk_fd) {
+    uint32_t key = queue_id;
+
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = map_fd;
+    attr.key = (uint64_t)(uintptr_t)&key;
+    attr.value = (uint64_t)(uintptr_t)&xsk_fd;
+    attr.flags = BPF_ANY;
+
+    if (nd_bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0) {
+        throw ndSystemException(__PRETTY_FUNCTION__,
+          "bpf(BPF_MAP_UPDATE_ELEM)", errno);
+    }
+}
+
+void ndXDPProgram::Unregister(unsigned queue_id) {
+    uint32_t key = queue_id;
+
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = map_fd;
+    attr.key = (uint64_t)(uintptr_t)&key;
+
+    nd_bpf(BPF_MAP_DELETE_ELEM, &attr);
+}
+
+// Single producer/consumer view of an mmap'd XDP ring.
+class ndXDPRing
+{
+public:
+    ndXDPRing()
+      : producer(nullptr), consumer(nullptr), flags(nullptr),
+        ring(nullptr), size(0), mask(0), map(MAP_FAILED),
+        map_len(0) { }
+
+    virtual ~ndXDPRing() {
+        if (map != MAP_FAILED) munmap(map, map_len);
+    }
+
+    void Map(int sd, const struct xdp_ring_offset &off,
+      uint32_t size, size_t entry_size, off_t pgoff);
+
+    inline uint32_t Ready(uint32_t &head) const {
+        head = *consumer;
+        return __atomic_load_n(producer, __ATOMIC_ACQUIRE) - head;
+    }
+
+    inline uint32_t Free(uint32_t &head) const {
+        head = *producer;
+        return size - (head -
+          __atomic_load_n(consumer, __ATOMIC_ACQUIRE));
+    }
+
+    inline void Consume(uint32_t count) {
+        __atomic_store_n(consumer, *consumer + count,
+          __ATOMIC_RELEASE);
+    }
+
+    inline void Produce(uint32_t count) {
+        __atomic_store_n(producer, *producer + count,
+          __ATOMIC_RELEASE);
+    }
+
+    uint32_t *producer;
+    uint32_t *consumer;
+    uint32_t *flags;
+    void *ring;
+    uint32_t size;
+    uint32_t mask;
+
+protected:
+    void *map;
+    size_t map_len;
+};
+
+void ndXDPRing::Map(int sd, const struct xdp_ring_offset &off,
+  uint32_t size, size_t entry_size, off_t pgoff) {
+    map_len = off.desc + size * entry_size;
+    map = mmap(nullptr, map_len, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, sd, pgoff);
+
+    if (map == MAP_FAILED) {
+        throw ndSystemException(__PRETTY_FUNCTION__,
+          "mmap(XDP ring)", errno);
+    }
+
+    uint8_t *base = static_cast<uint8_t *>(map);
+    producer = (uint32_t *)(base + off.producer);
+    consumer = (uint32_t *)(base + off.consumer);
+    flags = (uint32_t *)(base + off.flags);
+    ring = (void *)(base + off.desc);
+
+    this->size = size;
+    mask = size - 1;
+}
+
+class ndXDPSocket;
+
+// Zero-copy packet: data points directly into a UMEM frame
+// which is handed back to the socket on destruction.  The
+// object itself comes from the capture thread's pool.
+class ndPacketXDPFrame : public ndPacket
+{
+public:
+    static void *operator new(size_t size, ndPacketPool *pool) {
+        return pool->Alloc(size);
+    }
+    static void operator delete(void *ptr) {
+        ndPacketPool::Free(ptr);
+    }
+    static void operator delete(void *ptr, ndPacketPool *pool) {
+        ndPacketPool::Free(ptr);
+    }
+
+    ndPacketXDPFrame(ndXDPSocket *xsk, uint32_t frame,
+      const status_flags &status, const uint16_t &length,
+      const uint16_t &caplen, uint8_t *data,
+      const struct timeval &tv);
+
+    virtual ~ndPacketXDPFrame();
+
+protected:
+    ndXDPSocket *xsk;
+    uint32_t frame;
+};
+
+// AF_XDP socket bound to one RX queue, with its own UMEM.
+//
+// Frames are owned by the kernel while on the fill ring and
+// by userspace once received.  Received frames may be freed by
+// any thread; they are pushed on to a lock-free return stack
+// which the capture thread drains back into the fill ring.
+class ndXDPSocket
+{
+public:
+    ndXDPSocket(const string &ifname, unsigned queue_id,
+      const nd_config_xdp &config, ndPacketStats *stats,
+      ndPacketPool *pool);
+
+    inline int GetDescriptor(void) { return sd; }
+
+    void SetFilter(const string &expr);
+    bool ApplyFilter(const uint8_t *pkt, size_t length,
+      size_t snaplen) const;
+
+    size_t Receive(vector<ndPacket *> &pkt_queue);
+
+    void Refill(void);
+
+    bool GetStats(void);
+
+    // Any thread
+    void FreeFrame(uint32_t frame);
+
+    inline void Acquire(void) { refs++; }
+    inline void Release(void) {
+        if (refs.fetch_sub(1) == 1) delete this;
+    }
+
+protected:
+    virtual ~ndXDPSocket();
+
+    void Open(const nd_config_xdp &config);
+
+    // Release the socket, UMEM and program; also used to unwind
+    // a constructor that throws part way through.
+    void Close(void);
+
+    string ifname;
+    unsigned queue_id;
+    int sd;
+
+    ndXDPProgram *program;
+
+    uint8_t *umem;
+    size_t umem_size;
+    uint32_t frame_size;
+    uint32_t frames;
+
+    // The kernel will not bind a socket without a completion
+    // ring, but nothing is ever transmitted, so it is created
+    // and never mapped.
+    ndXDPRing ring_fill;
+    ndXDPRing ring_rx;
+
+    // Frames available to the fill ring (capture thread only)
+    vector<uint32_t> frames_free;
+
+    // Lock-free return stack, linked through frames_next
+    static const uint32_t FRAME_NONE = UINT32_MAX;
+    vector<uint32_t> frames_next;
+    atomic<uint32_t> frames_returned;
+
+    struct bpf_program filter;
+
+    atomic<unsigned> refs;
+
+    ndPacketStats *stats;
+    ndPacketPool *pool;
+};
+
+ndPacketXDPFrame::ndPacketXDPFrame(ndXDPSocket *xsk,
+  uint32_t frame, const status_flags &status,
+  const uint16_t &length, const uint16_t &caplen, uint8_t *data,
+  const struct timeval &tv)
+  : ndPacket(status, length, caplen, data, tv), xsk(xsk),
+    frame(frame) {
+    xsk->Acquire();
+}
+
+ndPacketXDPFrame::~ndPacketXDPFrame() {
+    data = nullptr;
+    xsk->FreeFrame(frame);
+    xsk->Release();
+}
+
+ndXDPSocket::ndXDPSocket(const string &ifname, unsigned queue_id,
+  const nd_config_xdp &config, ndPacketStats *stats,
+  ndPacketPool *pool)
+  : ifname(ifname), queue_id(queue_id), sd(-1), program(nullptr),
+    umem(nullptr), umem_size(0), frame_size(config.frame_size),
+    frames(config.frames), frames_returned(FRAME_NONE),
+    filter{ 0 }, refs(1), stats(stats), pool(pool) {
+    try {
+        Open(config);
+    }
+    catch (...) {
+        Close();
+        throw;
+    }
+}
+
+void ndXDPSocket::Open(const nd_config_xdp &config) {
+    if (frame_size < 2048 || (frame_size & (frame_size - 1))) {
+        throw ndCaptureThreadException(
+          "XDP frame size must be a power of two >= 2048");
+    }
+
+    if (config.ring_size == 0 ||
+      (config.ring_size & (config.ring_size - 1)))
+    {
+        throw ndCaptureThreadException(
+          "XDP ring size must be a power of two");
+    }
+
+    if (queue_id >= _ND_XDP_MAX_QUEUES) {
+        throw ndCaptureThreadException(
+          "XDP queue ID out of range");
+    }
+
+    struct ifreq ifr;
+    if (nd_ifreq(ifname.c_str(), SIOCGIFINDEX, &ifr) < 0)
+        throw ndCaptureThreadException(
+          "error getting interface index");
+
+    sd = socket(AF_XDP, SOCK_RAW | SOCK_CLOEXEC, 0);
+
+    if (sd < 0) {
+        nd_dprintf("%s: socket: %s\n", ifname.c_str(),
+          strerror(errno));
+        throw ndCaptureThreadException(
+          "error creating AF_XDP socket");
+    }
+
+    umem_size = (size_t)frame_size * frames;
+    void *area = mmap(nullptr, umem_size,
+      PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (area == MAP_FAILED) {
+        nd_dprintf("%s: mmap(%lu): %s\n", ifname.c_str(),
+          umem_size, strerror(errno));
+        throw ndCaptureThreadException(
+          "error allocating XDP UMEM");
+    }
+
+    umem = static_cast<uint8_t *>(area);
+
+    struct xdp_umem_reg mr;
+    memset(&mr, 0, sizeof(struct xdp_umem_reg));
+    mr.addr = (uint64_t)(uintptr_t)umem;
+    mr.len = umem_size;
+    mr.chunk_size = frame_size;
+    mr.headroom = 0;
+
+    if (setsockopt(sd, SOL_XDP, XDP_UMEM_REG, &mr,
+          sizeof(struct xdp_umem_reg)) < 0)
+    {
+        nd_dprintf("%s: setsockopt(XDP_UMEM_REG): %s\n",
+          ifname.c_str(), strerror(errno));
+        throw ndCaptureThreadException(
+          "error registering XDP UMEM");
+    }
+
+    const int ring_size = (int)config.ring_size;
+    const vector<pair<int, const char *>> ring_opts = {
+        { XDP_UMEM_FILL_RING, "XDP_UMEM_FILL_RING" },
+        { XDP_UMEM_COMPLETION_RING, "XDP_UMEM_COMPLETION_RING" },
+        { XDP_RX_RING, "XDP_RX_RING" },
+    };
+
+    for (auto &opt : ring_opts) {
+        if (setsockopt(sd, SOL_XDP, opt.first, &ring_size,
+              sizeof(int)) < 0)
+        {
+            nd_dprintf("%s: setsockopt(%s): %s\n",
+              ifname.c_str(), opt.second, strerror(errno));
+            throw ndCaptureThreadException(
+              "error creating XDP rings");
+        }
+    }
+
+    struct xdp_mmap_offsets off;
+    socklen_t optlen = sizeof(struct xdp_mmap_offsets);
+
+    if (getsockopt(sd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) < 0)
+    {
+        nd_dprintf("%s: getsockopt(XDP_MMAP_OFFSETS): %s\n",
+          ifname.c_str(), strerror(errno));
+        throw ndCaptureThreadException(
+          "error getting XDP ring offsets");
+    }
+
+    ring_fill.Map(sd, off.fr, config.ring_size, sizeof(uint64_t),
+      XDP_UMEM_PGOFF_FILL_RING);
+    ring_rx.Map(sd, off.rx, config.ring_size,
+      sizeof(struct xdp_desc), XDP_PGOFF_RX_RING);
+
+    frames_next.resize(frames, FRAME_NONE);
+    frames_free.reserve(frames);
+    for (uint32_t f = frames; f > 0; f--)
+        frames_free.push_back(f - 1);
+
+    Refill();
+
+    struct sockaddr_xdp sxdp;
+    memset(&sxdp, 0, sizeof(struct sockaddr_xdp));
+    sxdp.sxdp_family = AF_XDP;
+    sxdp.sxdp_ifindex = ifr.ifr_ifindex;
+    sxdp.sxdp_queue_id = queue_id;
+    sxdp.sxdp_flags = (config.zero_copy) ? XDP_ZEROCOPY : 0;
+#ifdef XDP_USE_NEED_WAKEUP
+    sxdp.sxdp_flags |= XDP_USE_NEED_WAKEUP;
+#endif
+
+    if (bind(sd, (const struct sockaddr *)&sxdp,
+          sizeof(struct sockaddr_xdp)) < 0)
+    {
+        nd_dprintf("%s: bind(queue: %u): %s\n", ifname.c_str(),
+          queue_id, strerror(errno));
+        throw ndCaptureThreadException(
+          "unable to bind AF_XDP socket to interface");
+    }
+
+    program = ndXDPProgram::Acquire(ifname, ifr.ifr_ifindex,
+      config.mode);
+    program->Register(queue_id, sd);
+
+    nd_dprintf(
+      "%s: AF_XDP socket bound to queue %u: %u frames of %u bytes, "
+      "ring size: %u\n",
+      ifname.c_str(), queue_id, frames, frame_size,
+      config.ring_size);
+}
+
+ndXDPSocket::~ndXDPSocket() {
+    Close();
+}
+
+void ndXDPSocket::Close(void) {
+    if (program != nullptr) {
+        program->Unregister(queue_id);
+        program->Release();
+        program = nullptr;
+    }
+
+    if (filter.bf_insns != nullptr) pcap_freecode(&filter);
+    if (sd != -1) close(sd);
+    if (umem != nullptr) munmap(umem, umem_size);
+
+    sd = -1;
+    umem = nullptr;
+}
+
+void ndXDPSocket::SetFilter(const string &expr) {
+#ifdef HAVE_PCAP_OPEN_DEAD
+    pcap_t *pcap = pcap_open_dead(DLT_EN10MB, ndGC.max_capture_length);
+    if (pcap == nullptr) {
+        throw ndCaptureThreadException(
+          "error creating PCAP context");
+    }
+    if (pcap_compile(pcap, &filter, expr.c_str(), 1,
+          PCAP_NETMASK_UNKNOWN) == -1)
+    {
+#else
+    if (pcap_compile_nopcap(ndGC.max_capture_length, DLT_EN10MB,
+          &filter, expr.c_str(), 1, PCAP_NETMASK_UNKNOWN) == -1)
+    {
+#endif
+        throw ndCaptureThreadException(
+          "error compiling BPF filter");
+    }
+
+#ifdef HAVE_PCAP_OPEN_DEAD
+    pcap_close(pcap);
+#endif
+}
+
+bool ndXDPSocket::ApplyFilter(const uint8_t *pkt,
+  size_t length, size_t snaplen) const {
+    return (filter.bf_insns &&
+      bpf_filter(filter.bf_insns, pkt, length, snaplen) == 0);
+}
+
+size_t ndXDPSocket::Receive(vector<ndPacket *> &pkt_queue) {
+    uint32_t head;
+    uint32_t ready = ring_rx.Ready(head);
+
+    if (ready == 0) return 0;
+    if (ready > _ND_XDP_RX_BATCH) ready = _ND_XDP_RX_BATCH;
+
+    // AF_XDP provides no per-packet timestamps.
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+
+    const struct xdp_desc *descs =
+      static_cast<const struct xdp_desc *>(ring_rx.ring);
+
+    for (uint32_t i = 0; i < ready; i++) {
+        const struct xdp_desc *desc = &descs[(head + i) & ring_rx.mask];
+        uint32_t frame = (uint32_t)(desc->addr / frame_size);
+        uint8_t *data = umem + desc->addr;
+        uint16_t length = (desc->len > ndGC.max_capture_length) ?
+          ndGC.max_capture_length :
+          (uint16_t)desc->len;
+
+        // The whole frame is in UMEM; filter all of it.
+        if (ApplyFilter(data, desc->len, desc->len)) {
+            stats->pkt.capture_filtered++;
+            stats->pkt.discard++;
+            stats->pkt.discard_bytes += desc->len;
+            frames_free.push_back(frame);
+            continue;
+        }
+
+        try {
+            pkt_queue.push_back(new (pool) ndPacketXDPFrame(this,
+              frame, ndPacket::STATUS_OK, (uint16_t)desc->len,
+              length, data, tv));
+        }
+        catch (ndSystemException &e) {
+            stats->pkt.discard++;
+            stats->pkt.discard_bytes += desc->len;
+            frames_free.push_back(frame);
+        }
+    }
+
+    ring_rx.Consume(ready);
+
+    return ready;
+}
+
+void ndXDPSocket::Refill(void) {
+    uint32_t frame = frames_returned.exchange(FRAME_NONE,
+      memory_order_acquire);
+
+    while (frame != FRAME_NONE) {
+        uint32_t next = frames_next[frame];
+        frames_free.push_back(frame);
+        frame = next;
+    }
+
+    if (frames_free.empty()) return;
+
+    uint32_t head;
+    uint32_t slots = ring_fill.Free(head);
+
+    if (slots > frames_free.size()) slots = frames_free.size();
+    if (slots == 0) return;
+
+    uint64_t *addrs = static_cast<uint64_t *>(ring_fill.ring);
+
+    for (uint32_t i = 0; i < slots; i++) {
+        addrs[(head + i) & ring_fill.mask] =
+          (uint64_t)frames_free.back() * frame_size;
+        frames_free.pop_back();
+    }
+
+    ring_fill.Produce(slots);
+#ifdef XDP_USE_NEED_WAKEUP
+    if (__atomic_load_n(ring_fill.flags, __ATOMIC_ACQUIRE) &
+      XDP_RING_NEED_WAKEUP)
+        recvfrom(sd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+#endif
+}
+
+void ndXDPSocket::FreeFrame(uint32_t frame) {
+    uint32_t head = frames_returned.load(memory_order_relaxed);
+    do {
+        frames_next[frame] = head;
+    }
+    while (! frames_returned.compare_exchange_weak(head, frame,
+      memory_order_release, memory_order_relaxed));
+}
+
+bool ndXDPSocket::GetStats(void) {
+    struct xdp_statistics xs;
+    socklen_t optlen = sizeof(struct xdp_statistics);
+
+    memset(&xs, 0, optlen);
+
+    if (getsockopt(sd, SOL_XDP, XDP_STATISTICS, &xs, &optlen) < 0) {
+        nd_dprintf(
+          "%s: error getting XDP statistics: %s\n",
+          ifname.c_str(), strerror(errno));
+        return false;
+    }
+
+    stats->pkt.capture_dropped = xs.rx_dropped;
+
+    return true;
+}
+
+ndCaptureXDP::ndCaptureXDP(int16_t cpu, nd_iface_ptr &iface,
+  const nd_detection_threads &threads_dpi, unsigned instance_id,
+  ndDNSHintCache *dhc, uint8_t private_addr)
+  : ndCaptureThread(ndCT_XDP, cpu, iface, threads_dpi, dhc,
+      private_addr),
+    xsk(nullptr) {
+    dl_type = DLT_EN10MB;
+
+    queue_id = iface->config_xdp.queue_id + instance_id;
+
+    tag.append("#" + to_string(queue_id));
+
+    nd_dprintf("%s: XDP capture thread created.\n", tag.c_str());
+}
+
+ndCaptureXDP::~ndCaptureXDP() {
+    Join();
+
+    ndXDPSocket *_xsk = static_cast<ndXDPSocket *>(xsk);
+    if (_xsk != nullptr) _xsk->Release();
+
+    nd_dprintf("%s: XDP capture thread destroyed.\n", tag.c_str());
+}
+
+void *ndCaptureXDP::Entry(void) {
+    ndXDPSocket *_xsk = new ndXDPSocket(iface->ifname, queue_id,
+      iface->config_xdp, &stats, packet_pool);
+    if (_xsk == nullptr)
+        throw runtime_error(strerror(ENOMEM));
+
+    xsk = static_cast<void *>(_xsk);
+
+    auto it_filter = ndGC.interface_filters.find(iface->ifname);
+
+    if (it_filter != ndGC.interface_filters.end())
+        _xsk->SetFilter(it_filter->second);
+
+    vector<ndPacket *> pkt_queue;
+    pkt_queue.reserve(_ND_XDP_RX_BATCH);
+
+    struct pollfd pfd;
+    pfd.fd = _xsk->GetDescriptor();
+    pfd.events = POLLIN;
+
+    capture_state = STATE_ONLINE;
+
+    nd_dprintf("%s: XDP capture started on CPU: %lu\n",
+      tag.c_str(), cpu >= 0 ? cpu : 0);
+
+    while (! ShouldTerminate()) {
+        _xsk->Refill();
+
+        if (_xsk->Receive(pkt_queue) == 0) {
+            pfd.revents = 0;
+            int rc = poll(&pfd, 1, 1000);
+
+            if (rc == -1 && errno != EINTR) {
+                capture_state = STATE_OFFLINE;
+                throw ndSystemException(__PRETTY_FUNCTION__,
+                  "poll", errno);
+            }
+
+            continue;
+        }
+
+        if (pkt_queue.size()) {
+            Lock();
+
+            try {
+                for (auto &pkt : pkt_queue) {
+                    if (ProcessPacket(pkt) != nullptr)
+                        delete pkt;
+                }
+            }
+            catch (...) {
+                Unlock();
+                capture_state = STATE_OFFLINE;
+                throw;
+            }
+
+            Unlock();
+
+            pkt_queue.clear();
+
+            NotifyDetectionThreads();
+        }
+    }
+
+    capture_state = STATE_OFFLINE;
+
+    nd_dprintf("%s: XDP capture ended on CPU: %lu\n",
+      tag.c_str(), cpu >= 0 ? cpu : 0);
+
+    return NULL;
+}
+
+void ndCaptureXDP::GetCaptureStats(ndPacketStats &stats) {
+    ndXDPSocket *_xsk = static_cast<ndXDPSocket *>(xsk);
+    if (_xsk != nullptr) _xsk->GetStats();
+
+    ndCaptureThread::GetCaptureStats(stats);
+}
@@ -28,6 +28,8 @@
 #include <sys/types.h>
 #endif
 
+#include <algorithm>
+
 #include <net/ethernet.h>
 #include <pcap/pcap.h>
 #include <resolv.h>
@@ -224,10 +226,27 @@ ndCaptureThread::ndCaptureThread(unsigned cs_type, int16_t cpu,
   : ndThread(iface->ifname, (long)cpu, /* IPC? */ false),
     ndInstanceClient(), dl_type(0), cs_type(cs_type),
     iface(iface), flow(iface), tv_epoch(0), ts_pkt_first(0),
-    ts_pkt_last(0), dhc(dhc), threads_dpi(threads_dpi),
-    dpi_thread_id(rand() % threads_dpi.size()) {
+    ts_pkt_last(0), packet_pool(nullptr), flow_arena(nullptr),
+    flow_shard(0),
+    iface_index(ndInterface::GetIndex(iface->ifname)),
+    flow_cache(ndGC.fm_cache_slots), flow_cache_misses(0),
+    flow_lookup_ns(0), dhc(dhc),
+    threads_dpi(threads_dpi),
+    dpi_inline(nullptr), dpi_inline_id(-1), dpi_pending_packets(0) {
     capture_state = STATE_INIT;
 
+    packet_pool = new ndPacketPool(tag);
+    if (packet_pool == nullptr) {
+        throw ndSystemException(__PRETTY_FUNCTION__,
+          "new ndPacketPool", ENOMEM);
+    }
+
+    flow_arena = new ndFlowArena(tag);
+    if (flow_arena == nullptr) {
+        throw ndSystemException(__PRETTY_FUNCTION__,
+          "new ndFlowArena", ENOMEM);
+    }
+
     if (ndGC_REPLAY_DELAY &&
       ndCT_TYPE(iface->capture_type) != ndCT_PCAP_OFFLINE)
     {
@@ -630,33 +649,33 @@ nd_process_ip:
           sizeof(struct in_addr));
 
         if (addr_cmp < 0) {
-            ndAddr::Create(flow.lower_addr,
+            ndFlowAddr::Create(flow.lower_addr,
               (const struct in_addr *)_ND_ADDROFF(hdr_ip,
                 struct ip, ip_src));
-            ndAddr::Create(flow.upper_addr,
+            ndFlowAddr::Create(flow.upper_addr,
               (const struct in_addr *)_ND_ADDROFF(hdr_ip,
                 struct ip, ip_dst));
             if (dl_type == DLT_EN10MB) {
-                ndAddr::Create(flow.lower_mac,
+                ndFlowAddr::Create(flow.lower_mac,
                   (const uint8_t *)hdr_eth->ether_shost,
                   ETH_ALEN);
-                ndAddr::Create(flow.upper_mac,
+                ndFlowAddr::Create(flow.upper_mac,
                   (const uint8_t *)hdr_eth->ether_dhost,
                   ETH_ALEN);
             }
         }
         else {
-            ndAddr::Create(flow.lower_addr,
+            ndFlowAddr::Create(flow.lower_addr,
               (const struct in_addr *)_ND_ADDROFF(hdr_ip,
                 struct ip, ip_dst));
-            ndAddr::Create(flow.upper_addr,
+            ndFlowAddr::Create(flow.upper_addr,
               (const struct in_addr *)_ND_ADDROFF(hdr_ip,
                 struct ip, ip_src));
             if (dl_type == DLT_EN10MB) {
-                ndAddr::Create(flow.lower_mac,
+                ndFlowAddr::Create(flow.lower_mac,
                   (const uint8_t *)hdr_eth->ether_dhost,
                   ETH_ALEN);
-                ndAddr::Create(flow.upper_mac,
+                ndFlowAddr::Create(flow.upper_mac,
                   (const uint8_t *)hdr_eth->ether_shost,
                   ETH_ALEN);
             }
@@ -704,30 +723,30 @@ nd_process_ip:
         }
 
         if (addr_cmp < 0) {
-            ndAddr::Create(flow.lower_addr,
+            ndFlowAddr::Create(flow.lower_addr,
               (const struct in6_addr *)_ND_ADDROFF(hdr_ip6,
                 struct ip6_hdr, ip6_src));
-            ndAddr::Create(flow.upper_addr,
+            ndFlowAddr::Create(flow.upper_addr,
               (const struct in6_addr *)_ND_ADDROFF(hdr_ip6,
                 struct ip6_hdr, ip6_dst));
             if (dl_type == DLT_EN10MB) {
-                ndAddr::Create(flow.lower_mac,
+                ndFlowAddr::Create(flow.lower_mac,
                   hdr_eth->ether_shost, ETH_ALEN);
-                ndAddr::Create(flow.upper_mac,
+                ndFlowAddr::Create(flow.upper_mac,
                   hdr_eth->ether_dhost, ETH_ALEN);
             }
         }
         else {
-            ndAddr::Create(flow.lower_addr,
+            ndFlowAddr::Create(flow.lower_addr,
               (const struct in6_addr *)_ND_ADDROFF(hdr_ip6,
                 struct ip6_hdr, ip6_dst));
-            ndAddr::Create(flow.upper_addr,
+            ndFlowAddr::Create(flow.upper_addr,
               (const struct in6_addr *)_ND_ADDROFF(hdr_ip6,
                 struct ip6_hdr, ip6_src));
             if (dl_type == DLT_EN10MB) {
-                ndAddr::Create(flow.lower_mac,
+                ndFlowAddr::Create(flow.lower_mac,
                   hdr_eth->ether_dhost, ETH_ALEN);
-                ndAddr::Create(flow.upper_mac,
+                ndFlowAddr::Create(flow.upper_mac,
                   hdr_eth->ether_shost, ETH_ALEN);
             }
         }
@@ -772,10 +791,18 @@ nd_process_ip:
                 if (flow.tunnel_type == ndFlow::TUNNEL_NONE) {
                     flow.tunnel_type = ndFlow::TUNNEL_GTP;
 
-                    flow.gtp.version = hdr_gtpv1->flags.version;
-                    flow.gtp.ip_version = flow.ip_version;
-                    flow.gtp.lower_addr = flow.lower_addr;
-                    flow.gtp.upper_addr = flow.upper_addr;
+                    if (flow.gtp == nullptr) {
+                        flow.gtp = new ndFlowGTP;
+                        if (flow.gtp == nullptr) {
+                            throw ndSystemException(__PRETTY_FUNCTION__,
+                              "new ndFlowGTP", ENOMEM);
+                        }
+                    }
+
+                    flow.gtp->version = hdr_gtpv1->flags.version;
+                    flow.gtp->ip_version = flow.ip_version;
+                    flow.gtp->lower_addr = flow.lower_addr;
+                    flow.gtp->upper_addr = flow.upper_addr;
                 }
 
                 if (hdr_gtpv1->type == _ND_GTP_G_PDU) {
@@ -942,11 +969,34 @@ nd_process_ip:
         break;
     }
 
-    flow.Hash(tag);
-    flow_digest.assign(flow.digest_lower.begin(),
-      flow.digest_lower.end());
+    flow.UpdateKey(iface_index, false);
+
+    if (flow_cache.Lookup(ndi.flow_buckets, flow.key, nf)) {
+        stats.flow.cache_hits++;
+        stats.flow.cache_saved_ns += flow_lookup_ns;
+    }
+    else {
+        // Sample the cost of a full lookup (hash and probe) so
+        // that the time saved by cache hits can be estimated.
+        struct timespec ts_lookup[2];
+        bool sample = (flow_cache_misses++ % 64 == 0);
+        if (sample) clock_gettime(CLOCK_MONOTONIC, &ts_lookup[0]);
+
+        flow.key.Update();
+        nf = flow_cache.Fill(ndi.flow_buckets, flow.key, flow_shard);
+
+        if (sample) {
+            clock_gettime(CLOCK_MONOTONIC, &ts_lookup[1]);
+            uint64_t ns = (ts_lookup[1].tv_sec - ts_lookup[0].tv_sec) *
+                1000000000 +
+              (ts_lookup[1].tv_nsec - ts_lookup[0].tv_nsec);
+            flow_lookup_ns = (flow_lookup_ns == 0) ?
+              ns :
+              (flow_lookup_ns * 7 + ns) / 8;
+        }
 
-    nf = ndi.flow_buckets->Lookup(flow_digest, true);
+        stats.flow.cache_misses++;
+    }
 
     if (nf) {
         // Flow exists in map.
@@ -957,16 +1007,16 @@ nd_process_ip:
                 if (nf->tunnel_type == ndFlow::TUNNEL_GTP) {
                     switch (nf->origin) {
                     case ndFlow::ORIGIN_LOWER:
-                        if (nf->gtp.upper_teid == 0)
-                            nf->gtp.upper_teid = hdr_gtpv1->teid;
-                        else if (hdr_gtpv1->teid != nf->gtp.upper_teid)
-                            nf->gtp.upper_teid = hdr_gtpv1->teid;
+                        if (nf->gtp->upper_teid == 0)
+                            nf->gtp->upper_teid = hdr_gtpv1->teid;
+                        else if (hdr_gtpv1->teid != nf->gtp->upper_teid)
+                            nf->gtp->upper_teid = hdr_gtpv1->teid;
                         break;
                     case ndFlow::ORIGIN_UPPER:
-                        if (nf->gtp.lower_teid == 0)
-                            nf->gtp.lower_teid = hdr_gtpv1->teid;
-                        else if (hdr_gtpv1->teid != nf->gtp.lower_teid)
-                            nf->gtp.lower_teid = hdr_gtpv1->teid;
+                        if (nf->gtp->lower_teid == 0)
+                            nf->gtp->lower_teid = hdr_gtpv1->teid;
+                        else if (hdr_gtpv1->teid != nf->gtp->lower_teid)
+                            nf->gtp->lower_teid = hdr_gtpv1->teid;
                         break;
                     }
                 }
@@ -980,56 +1030,72 @@ nd_process_ip:
         }
     }
     else {
-        if (ndGC.max_flows > 0 &&
-          ndi.status.flows.load() + 1 > ndGC.max_flows)
+        // A new TCP flow must only have SYN+ACK bits set
+        if (ndGC_SYN_SCAN_PROTECTION && flow.ip_protocol == IPPROTO_TCP &&
+          hdr_tcp->th_flags != (TH_SYN | TH_ACK))
         {
-#ifdef _ND_LOG_FLOW_DISCARD
+#ifdef _ND_LOG_PKT_TCP_DISCARD
             nd_dprintf(
-              "%s: discard: maximum flows exceeded: %u\n",
-              tag.c_str(), ndGC.max_flows);
+              "%s: discard: new TCP flow without "
+              "SYN/ACK.\n",
+              tag.c_str());
 #endif
             stats.pkt.discard++;
             stats.pkt.discard_bytes += packet->length;
             stats.flow.dropped++;
 
-            ndi.flow_buckets->Release(flow_digest);
+            ndi.flow_buckets->Release(flow.key, flow_shard);
             return packet;
         }
 
-        // A new TCP flow must only have SYN+ACK bits set
-        if (ndGC_SYN_SCAN_PROTECTION && flow.ip_protocol == IPPROTO_TCP &&
-          hdr_tcp->th_flags != (TH_SYN | TH_ACK))
+        // Refuse sources creating flows too quickly (scans,
+        // floods) before any flow state is allocated.
+        if (ndi.flow_admission != nullptr &&
+          ! ndi.flow_admission->Admit(
+            (addr_cmp < 0) ? flow.lower_addr : flow.upper_addr,
+            (time_t)(ts_pkt / ND_DETECTION_TICKS)))
         {
-#ifdef _ND_LOG_PKT_TCP_DISCARD
-            nd_dprintf(
-              "%s: discard: new TCP flow without "
-              "SYN/ACK.\n",
+#ifdef _ND_LOG_FLOW_DISCARD
+            nd_dprintf("%s: discard: flow admission refused.\n",
               tag.c_str());
 #endif
             stats.pkt.discard++;
             stats.pkt.discard_bytes += packet->length;
-            stats.flow.dropped++;
+            stats.flow.refused++;
 
-            ndi.flow_buckets->Release(flow_digest);
+            ndi.flow_buckets->Release(flow.key, flow_shard);
             return packet;
         }
 
-        nf = make_shared<ndFlow>(flow);
-        if (! nf)
-            throw ndCaptureThreadException(strerror(ENOMEM));
+        // Make room by evicting existing flows, if enabled; a
+        // sampled victim may be smaller than a new flow.
+        for (unsigned evictions = 0; ndi.IsFlowTableFull() &&
+             evictions < ND_FLOW_EVICT_MAX;
+             evictions++)
+        {
+            if (! ndi.EvictFlow(flow.key, flow_shard)) break;
+            stats.flow.evicted++;
+        }
 
-        nf->direction = addr_cmp;
+        if (ndi.IsFlowTableFull()) {
+#ifdef _ND_LOG_FLOW_DISCARD
+            nd_dprintf(
+              "%s: discard: maximum flows exceeded: %u\n",
+              tag.c_str(), ndGC.max_flows);
+#endif
+            stats.pkt.discard++;
+            stats.pkt.discard_bytes += packet->length;
+            stats.flow.dropped++;
 
-        if (! ndi.flow_buckets->InsertUnlocked(flow_digest, nf))
-        {
-            ndi.flow_buckets->Release(flow_digest);
-            // Flow exists in map!  Impossible!
-            throw ndCaptureThreadException(strerror(EINVAL));
+            ndi.flow_buckets->Release(flow.key, flow_shard);
+            return packet;
         }
 
-        ndi.status.flows++;
+        nf = flow_arena->Create(flow);
+
+        nf->direction = addr_cmp;
 
-        // New flow inserted, initialize...
+        // New flow, initialize before inserting...
         nf->ts_first_seen = ts_pkt;
 
         // Set initial flow origin:
@@ -1072,19 +1138,47 @@ nd_process_ip:
         if (nf->tunnel_type == ndFlow::TUNNEL_GTP) {
             switch (nf->origin) {
             case ndFlow::ORIGIN_LOWER:
-                nf->gtp.lower_teid = hdr_gtpv1->teid;
+                nf->gtp->lower_teid = hdr_gtpv1->teid;
                 break;
             case ndFlow::ORIGIN_UPPER:
-                nf->gtp.upper_teid = hdr_gtpv1->teid;
+                nf->gtp->upper_teid = hdr_gtpv1->teid;
                 break;
             }
         }
 
-        ndi.plugins.BroadcastProcessorEvent(
-          ndPluginProcessor::EVENT_FLOW_NEW);
+        nf->mem_charged = ndFlow::GetMinimumSize();
+
+        // The flow's SHA1 digest (its identity to plugins and
+        // sinks) is computed once, here, rather than per packet.
+        nf->Hash(nf->iface->ifname);
+
+        if (ndi.flow_buckets->InsertUnlocked(flow.key, nf,
+              flow_shard))
+        {
+            ndi.status.flows++;
+            ndi.status.flows_bytes += nf->mem_charged;
+            flow_timers.push_back(flow.key);
+
+            ndi.plugins.BroadcastProcessorEvent(
+              ndPluginProcessor::EVENT_FLOW_NEW);
+        }
+        else {
+            // Lost an insert race with another capture thread
+            // sharing this shard; use the winning flow.
+            nf = ndi.flow_buckets->Lookup(flow.key, true, flow_shard);
+            if (! nf) {
+                // ...which has since been purged.
+                stats.pkt.discard++;
+                stats.pkt.discard_bytes += packet->length;
+                stats.flow.dropped++;
+
+                ndi.flow_buckets->Release(flow.key, flow_shard);
+                return packet;
+            }
+        }
     }
 
-    ndi.flow_buckets->Release(flow_digest);
+    ndi.flow_buckets->Release(flow.key, flow_shard);
 
     stats.pkt.wire_bytes += packet->length + 24;
 
@@ -1103,6 +1197,11 @@ nd_process_ip:
     nf->stats.total_packets++;
     nf->stats.total_bytes += packet->length;
 
+    // First packet this update interval; the flow's interval
+    // counters are reset (by the instance) at the end of it.
+    if (! nf->flags.active.load() && ! nf->flags.active.exchange(true))
+        flow_active.push_back(nf->key);
+
     if (addr_cmp < 0) {
         nf->stats.lower_packets++;
         nf->stats.lower_bytes += packet->length;
@@ -1132,7 +1231,11 @@ nd_process_ip:
 
         if ((hdr_tcp->th_flags & TH_FIN) &&
           (hdr_tcp->th_flags & TH_ACK))
-            nf->flags.tcp_fin_ack++;
+        {
+            // The first FIN/ACK shortens the flow's idle TTL.
+            if (nf->flags.tcp_fin_ack++ == 0)
+                flow_timers.push_back(nf->key);
+        }
         if (hdr_tcp->th_flags & TH_RST) {
 #ifdef _ND_EXTENDED_STATS
             nf->stats.tcp_resets++;
@@ -1168,6 +1271,7 @@ nd_process_ip:
                 // remote ports.
                 nf->Reset(true);
                 nf->stats = flow.stats;
+                flow_timers.push_back(nf->key);
 #ifdef _ND_LOG_DHC
                 nd_dprintf("%s: Reset DNS flow.\n", tag.c_str());
 #endif
@@ -1179,26 +1283,41 @@ nd_process_ip:
       nf->flags.expired.load() == false &&
       nf->stats.detection_packets.load() <= ndGC.max_detection_pkts)
     {
-        if (nf->dpi_thread_id < 0) {
-            nf->dpi_thread_id = dpi_thread_id;
-            if (++dpi_thread_id == (int16_t)threads_dpi.size())
-                dpi_thread_id = 0;
-        }
+        const uint8_t *l3ptr = (nf->ip_version == 4) ?
+          (uint8_t *)hdr_ip :
+          (uint8_t *)hdr_ip6;
+
+        if (dpi_inline != nullptr) {
+            // Run-to-completion; packet ownership is retained
+            nf->dpi_thread_id = dpi_inline_id;
+            dpi_inline->ProcessInline(nf, packet, l3ptr,
+              packet->caplen - l2_len);
 
-        auto idpi = threads_dpi.find(nf->dpi_thread_id);
+            return packet;
+        }
 
-        if (idpi != threads_dpi.end()) {
-            idpi->second->QueuePacket(nf, packet,
-              (nf->ip_version == 4) ? (uint8_t *)hdr_ip : (uint8_t *)hdr_ip6,
-              packet->caplen - l2_len);
+        ndDetectionThread *dpi = nullptr;
 
-            // Hand over packet ownership to the DPI queue
+        // Hand over packet ownership to the DPI queue, unless it
+        // is full (the detection thread has fallen behind).
+        if (ndi.dpi_scheduler->QueuePacket(nf, dpi, packet, l3ptr,
+              packet->caplen - l2_len))
+        {
             packet = NULL;
+
+            if (find(dpi_pending.begin(), dpi_pending.end(), dpi) ==
+              dpi_pending.end())
+                dpi_pending.push_back(dpi);
+
+            if (++dpi_pending_packets >= ND_DETECTION_WAKE_BATCH)
+                NotifyDetectionThreads();
         }
+        else if (dpi != nullptr)
+            stats.pkt.queue_dropped++;
         else {
             nd_dprintf(
               "ERROR: detection thread ID not found: %hd\n",
-              nf->dpi_thread_id);
+              nf->dpi_thread_id.load());
             throw ndCaptureThreadException(
               "detection thread ID not found!");
         }
@@ -1207,6 +1326,13 @@ nd_process_ip:
     return packet;
 }
 
+void ndCaptureThread::NotifyDetectionThreads(void) {
+    for (auto &dpi : dpi_pending) dpi->Notify();
+
+    dpi_pending.clear();
+    dpi_pending_packets = 0;
+}
+
 bool ndCaptureThread::ProcessDNSPacket(nd_flow_ptr &flow,
   const uint8_t *pkt,
   uint16_t pkt_len,
@@ -1319,6 +1445,7 @@ bool ndCaptureThread::ProcessDNSPacket(nd_flow_ptr &flow,
             }
 
             const uint8_t *p = (const uint8_t *)ns_rr_rdata(rr);
+            char *domain_name = flow->Metadata().mdns.domain_name;
 
             unsigned i = 0;
             while (*p != 0 && p < (const uint8_t *)(pkt + pkt_len) &&
@@ -1333,19 +1460,19 @@ bool ndCaptureThread::ProcessDNSPacket(nd_flow_ptr &flow,
                 uint8_t len = *p;
                 p++;
                 if (i != 0)
-                    flow->mdns.domain_name[i++] = '.';
+                    domain_name[i++] = '.';
                 for (uint8_t j = 0;
                      j < len && i < ND_FLOW_HOSTNAME - 1 &&
                      p < (const uint8_t *)(pkt + pkt_len);
                      p++, i++, j++)
                 {
-                    flow->mdns.domain_name[i] = *p;
+                    domain_name[i] = *p;
                 }
             }
 
-            if (flow->mdns.domain_name[0] != '\0') {
-                nd_set_hostname(flow->mdns.domain_name,
-                  flow->mdns.domain_name, ND_FLOW_HOSTNAME, false);
+            if (domain_name[0] != '\0') {
+                nd_set_hostname(domain_name, domain_name,
+                  ND_FLOW_HOSTNAME, false);
             }
 #ifdef _ND_LOG_DHC
             if (flow->HasMDNSDomainName() == false)
@@ -1355,7 +1482,7 @@ bool ndCaptureThread::ProcessDNSPacket(nd_flow_ptr &flow,
               "%d: "
               "%s\n",
               tag.c_str(), ns_rr_ttl(rr), ns_rr_rdlen(rr),
-              flow->mdns.domain_name);
+              domain_name);
 #endif
             continue;
         }
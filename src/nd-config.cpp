@@ -57,19 +57,24 @@ ndGlobalConfig::ndGlobalConfig()
     path_uuid_site(ND_SITE_UUID_PATH),
     url_napi_bootstrap(ND_URL_API_BOOTSTRAP),
     dhc_save(ndDHC_PERSISTENT), fhc_save(ndFHC_PERSISTENT),
+    flow_evict(ndFE_DISABLED), flow_snapshot_save(ndFSS_DISABLED),
     capture_type(ndCT_NONE),
     capture_read_timeout(ND_CAPTURE_READ_TIMEOUT),
     h_flow(stderr), ca_capture_base(0), ca_conntrack(-1),
     ca_detection_base(0), ca_detection_cores(-1),
-    max_packet_queue(ND_MAX_PKT_QUEUE_KB * 1024),
+    max_packet_queue(ND_MAX_PKT_QUEUE_KB * 1024), max_flow_memory(0),
     max_capture_length(ND_PCAP_SNAPLEN), flags(0),
     digest_app_config{ 0 }, digest_legacy_config{ 0 },
     verbosity(0), verbosity_flags(VFLAG_EVENT_DPI_NEW),
-    fhc_purge_divisor(ND_FHC_PURGE_DIVISOR),
-    fm_buckets(ND_FLOW_MAP_BUCKETS),
+    fhc_purge_divisor(ND_FHC_PURGE_DIVISOR), flow_admit_rate(0),
+    fm_buckets(ND_FLOW_MAP_BUCKETS), fm_shards(0),
+    fm_cache_slots(ND_FLOW_MAP_CACHE_SLOTS),
+    max_detection_cache(ND_MAX_DETECTION_CACHE_ENTRIES),
     max_detection_pkts(ND_MAX_DETECTION_PKTS),
     max_fhc(ND_MAX_FHC_ENTRIES), max_flows(0),
-    ttl_capture_delay(0), ttl_dns_entry(ND_TTL_IDLE_DHC_ENTRY),
+    ttl_capture_delay(0),
+    ttl_detection_cache(ND_TTL_DETECTION_CACHE_ENTRY),
+    ttl_dns_entry(ND_TTL_IDLE_DHC_ENTRY),
     ttl_idle_flow(ND_TTL_IDLE_FLOW),
     ttl_idle_tcp_flow(ND_TTL_IDLE_TCP_FLOW),
     ttl_napi_tick(ND_TTL_API_TICK),
@@ -231,6 +236,50 @@ bool ndGlobalConfig::Load(const string &filename) {
 
     max_flows = (size_t)r->GetInteger("netifyd", "max_flows", 0);
 
+    // Flow table memory budget; zero is unlimited.
+    max_flow_memory =
+      r->GetInteger("netifyd", "max_flow_memory_kb", 0) * 1024;
+
+    // Make room for new flows once max_flows or max_flow_memory
+    // is reached, rather than dropping them:
+    //   oldest-idle: oldest flow without traffic this interval
+    //   lru: least recently seen flow
+    //   detection-complete: least recently seen classified flow,
+    //     or if none, least recently seen unclassified flow
+    // Classified flows are evicted outright; unclassified ones
+    // have detection finalized, and are expired instead.
+    string flow_evict_mode = r->Get("netifyd", "flow_eviction",
+      "disabled");
+
+    if (flow_evict_mode == "oldest-idle")
+        flow_evict = ndFE_OLDEST_IDLE;
+    else if (flow_evict_mode == "lru") flow_evict = ndFE_LRU;
+    else if (flow_evict_mode == "detection-complete")
+        flow_evict = ndFE_DETECTION_COMPLETE;
+    else if (flow_evict_mode == "disabled")
+        flow_evict = ndFE_DISABLED;
+    else {
+        fprintf(stderr, "Invalid flow eviction mode: %s\n",
+          flow_evict_mode.c_str());
+        return false;
+    }
+
+    // Maximum new flows per second from any one source address
+    // (see ndFlowAdmission); zero disables.
+    flow_admit_rate = (unsigned)r->GetInteger("netifyd",
+      "flow_admission_rate", 0);
+
+    // Save classified flows on shutdown, and restore them on
+    // start-up (see ndFlowSnapshot).
+    string flow_snapshot_mode = r->Get("netifyd", "flow_snapshot",
+      "disabled");
+
+    if (flow_snapshot_mode == "persistent")
+        flow_snapshot_save = ndFSS_PERSISTENT;
+    else if (flow_snapshot_mode == "volatile")
+        flow_snapshot_save = ndFSS_VOLATILE;
+    else flow_snapshot_save = ndFSS_DISABLED;
+
     ndGC_SetFlag(ndGF_SOFT_DISSECTORS,
       r->GetBoolean("netifyd", "soft_dissectors", true));
 
@@ -240,6 +289,16 @@ bool ndGlobalConfig::Load(const string &filename) {
     fm_buckets = (unsigned)r->GetInteger("netifyd",
       "flow_map_buckets", ND_FLOW_MAP_BUCKETS);
 
+    // Maximum number of private, per-capture thread flow map
+    // shards.  Zero disables sharding.
+    fm_shards = (unsigned)r->GetInteger("netifyd",
+      "flow_map_shards", 0);
+
+    // Per capture thread flow map cache size, rounded down to a
+    // power of 2.  Zero disables the cache.
+    fm_cache_slots = (unsigned)r->GetInteger("netifyd",
+      "flow_map_cache_slots", ND_FLOW_MAP_CACHE_SLOTS);
+
     // Threading section
     ca_capture_base = (int16_t)r->GetInteger("threads",
       "capture_base", this->ca_capture_base);
@@ -278,6 +337,13 @@ bool ndGlobalConfig::Load(const string &filename) {
         ct, static_cast<void *>(&tpv3_defaults)))
         return false;
 
+    // XDP capture defaults section
+    ct = ndCT_XDP;
+    if (
+      ! LoadCaptureSettings(reader, "capture-defaults-xdp",
+        ct, static_cast<void *>(&xdp_defaults)))
+        return false;
+
     // Flow Hash Cache section
     ndGC_SetFlag(ndGF_USE_FHC,
       r->GetBoolean("flow-hash-cache", "enable", true));
@@ -296,6 +362,14 @@ bool ndGlobalConfig::Load(const string &filename) {
     fhc_purge_divisor = (size_t)r->GetInteger(
       "flow-hash-cache", "purge_divisor", ND_FHC_PURGE_DIVISOR);
 
+    // Detection Cache section (shared by all detection threads,
+    // a size of zero disables)
+    max_detection_cache = (unsigned)r->GetInteger(
+      "detection-cache", "cache_size",
+      ND_MAX_DETECTION_CACHE_ENTRIES);
+    ttl_detection_cache = (unsigned)r->GetInteger(
+      "detection-cache", "ttl", ND_TTL_DETECTION_CACHE_ENTRY);
+
     // DNS Cache section
     ndGC_SetFlag(ndGF_USE_DHC,
       r->GetBoolean("dns-hint-cache", "enable", true));
@@ -428,6 +502,9 @@ bool ndGlobalConfig::Load(const string &filename) {
     // Protocols section
     r->GetSection("protocols", protocols);
 
+    // Detection budgets section (packets, by protocol name)
+    r->GetSection("detection-budget", detection_budgets);
+
     // Add plugins
     vector<string> files;
     if (nd_scan_dotd(path_plugins, files)) {
@@ -632,6 +709,17 @@ bool ndGlobalConfig::LoadInterfaces(const string &filename) {
     return true;
 }
 
+bool ndGlobalConfig::LoadProtocols(const string &filename) {
+    if (! Open(filename)) return false;
+
+    INIReader *r = static_cast<INIReader *>(reader);
+
+    protocols.clear();
+    r->GetSection("protocols", protocols);
+
+    return true;
+}
+
 bool ndGlobalConfig::AddInterface(const string &iface,
   nd_interface_role role,
   unsigned type,
@@ -684,6 +772,15 @@ bool ndGlobalConfig::AddInterface(const string &iface,
                 throw ndSystemException(__PRETTY_FUNCTION__,
                   "new nd_config_nfq", ENOMEM);
             }
+            break;
+        case ndCT_XDP:
+            config = static_cast<void *>(new nd_config_xdp);
+            if (config == nullptr) {
+                throw ndSystemException(__PRETTY_FUNCTION__,
+                  "new nd_config_xdp", ENOMEM);
+            }
+            memcpy(config, &xdp_defaults, sizeof(nd_config_xdp));
+            break;
         default: break;
         }
     }
@@ -703,6 +800,9 @@ bool ndGlobalConfig::AddInterface(const string &iface,
         case ndCT_NFQ:
             delete static_cast<nd_config_nfq *>(config);
             break;
+        case ndCT_XDP:
+            delete static_cast<nd_config_xdp *>(config);
+            break;
         default: break;
         }
     }
@@ -843,6 +943,12 @@ bool ndGlobalConfig::LoadInterfaces(void *config_reader) {
             static_cast<nd_config_nfq *>(config)->queue_id =
               (unsigned)strtol(iface.substr(p).c_str(), NULL, 0);
             break;
+        case ndCT_XDP:
+            config = static_cast<void *>(new nd_config_xdp);
+            memcpy(config, &xdp_defaults, sizeof(nd_config_xdp));
+            if (! LoadCaptureSettings(r, s, type, config))
+                return false;
+            break;
         default: break;
         }
 
@@ -905,6 +1011,10 @@ void ndGlobalConfig::ClearInterfaces(bool cmdline_entries) {
                     delete static_cast<nd_config_nfq *>(
                       it->second.second);
                     break;
+                case ndCT_XDP:
+                    delete static_cast<nd_config_xdp *>(
+                      it->second.second);
+                    break;
                 default: break;
                 }
             }
@@ -946,6 +1056,9 @@ enum nd_capture_type ndGlobalConfig::LoadCaptureType(
 #endif
 #if defined(_ND_USE_NFQUEUE)
     else if (capture_type == "nfqueue") ct = ndCT_NFQ;
+#endif
+#if defined(_ND_USE_AF_XDP)
+    else if (capture_type == "xdp") ct = ndCT_XDP;
 #endif
     else {
         fprintf(stderr, "Invalid capture type: %s\n",
@@ -1041,12 +1154,53 @@ bool ndGlobalConfig::LoadCaptureSettings(void *config_reader,
 
         tpv3->rb_blocks = (unsigned)r->GetInteger(section,
           "rb_blocks", tpv3_defaults.rb_blocks);
+
+        tpv3->rb_zero_copy = r->GetBoolean(section,
+          "rb_zero_copy", tpv3_defaults.rb_zero_copy);
+
+        tpv3->run_to_completion = r->GetBoolean(section,
+          "run_to_completion", tpv3_defaults.run_to_completion);
     }
     else if (ndCT_TYPE(type) == ndCT_NFQ) {
         nd_config_nfq *nfq = static_cast<nd_config_nfq *>(config);
         nfq->instances = (unsigned)r->GetInteger(section,
           "queue_instances", 1);
     }
+    else if (ndCT_TYPE(type) == ndCT_XDP) {
+        nd_config_xdp *xdp = static_cast<nd_config_xdp *>(config);
+
+        string xdp_mode = r->Get(section, "xdp_mode", "auto");
+
+        if (xdp_mode == "skb" || xdp_mode == "generic")
+            xdp->mode = ndXDP_SKB;
+        else if (xdp_mode == "drv" || xdp_mode == "native")
+            xdp->mode = ndXDP_DRV;
+        else if (xdp_mode == "auto")
+            xdp->mode = ndXDP_AUTO;
+        else {
+            fprintf(stderr, "Invalid XDP mode: %s\n",
+              xdp_mode.c_str());
+            return false;
+        }
+
+        xdp->queue_id = (unsigned)r->GetInteger(section,
+          "queue_id", xdp_defaults.queue_id);
+
+        xdp->instances = (unsigned)r->GetInteger(section,
+          "queue_instances", xdp_defaults.instances);
+
+        xdp->frame_size = (unsigned)r->GetInteger(section,
+          "umem_frame_size", xdp_defaults.frame_size);
+
+        xdp->frames = (unsigned)r->GetInteger(section,
+          "umem_frames", xdp_defaults.frames);
+
+        xdp->ring_size = (unsigned)r->GetInteger(section,
+          "ring_size", xdp_defaults.ring_size);
+
+        xdp->zero_copy = r->GetBoolean(section,
+          "zero_copy", xdp_defaults.zero_copy);
+    }
 
     return true;
 }
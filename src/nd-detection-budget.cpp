@@ -0,0 +1,214 @@
+// Netify Agent
+// Copyright (C) 2015-2023 eGloo Incorporated
+// <http://www.egloo.ca>
+//
+// This program is free software: you can redistribute it
+// and/or modify it under the terms of the GNU General
+// Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your
+// option) any later version.
+//
+// This program is distributed in the hope that it will be
+// useful, but WITHOUT ANY WARRANTY; without even the
+// implied warranty of MERCHANTABILITY or FITNESS FOR A
+// PARTICULAR PURPOSE.  See the GNU General Public License
+// for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this program.  If not, see
+// <http://www.gnu.org/licenses/>.
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#include "nd-config.hpp"
+#include "nd-detection-budget.hpp"
+#include "nd-except.hpp"
+#include "nd-util.hpp"
+
+ndDetectionBudget::ndDetectionBudget() : protocols(nullptr) {
+    protocols = new Protocol[ND_PROTO_MAX];
+    if (protocols == nullptr) {
+        throw ndSystemException(__PRETTY_FUNCTION__,
+          "new Protocol", ENOMEM);
+    }
+
+    for (size_t i = 0; i < ND_PROTO_MAX; i++) {
+        Protocol &p = protocols[i];
+
+        p.budget = ND_MAX_DETECTION_PKTS;
+        p.configured = false;
+        for (auto &bin : p.bins) bin = 0;
+        p.flows = 0;
+        p.detected = 0;
+        p.packets = 0;
+    }
+}
+
+ndDetectionBudget::~ndDetectionBudget() {
+    if (protocols != nullptr) delete[] protocols;
+}
+
+void ndDetectionBudget::Load(void) {
+    for (size_t i = 0; i < ND_PROTO_MAX; i++) {
+        protocols[i].budget = ndGC.max_detection_pkts;
+        protocols[i].configured = false;
+    }
+
+    for (auto &it : ndGC.detection_budgets) {
+        nd_proto_id_t id = (nd_proto_id_t)nd_proto_get_id(it.first);
+
+        if (id == ND_PROTO_UNKNOWN &&
+          strcasecmp(it.first.c_str(), "unknown"))
+        {
+            nd_printf(
+              "WARNING: detection budget for unknown "
+              "protocol: %s\n",
+              it.first.c_str());
+            continue;
+        }
+
+        unsigned budget = (unsigned)strtoul(it.second.c_str(),
+          nullptr, 0);
+
+        if (budget == 0) {
+            nd_printf("WARNING: invalid detection budget: %s: %s\n",
+              it.first.c_str(), it.second.c_str());
+            continue;
+        }
+
+        Protocol &p = protocols[Index(id)];
+
+        p.budget = min(budget, ndGC.max_detection_pkts);
+        p.configured = true;
+
+        nd_dprintf("Detection budget: %s: %u\n",
+          nd_proto_get_name(id), p.budget.load());
+    }
+}
+
+unsigned ndDetectionBudget::Get(nd_proto_id_t protocol,
+  bool congested) const {
+    unsigned budget = protocols[Index(protocol)].budget.load(
+      memory_order_relaxed);
+
+    if (congested && Index(protocol) == ND_PROTO_UNKNOWN) {
+        budget = max((unsigned)ND_DETECTION_BUDGET_MIN,
+          budget / ND_DETECTION_BUDGET_CONGESTED_DIVISOR);
+    }
+
+    return budget;
+}
+
+void ndDetectionBudget::AddDetected(unsigned packets) {
+    AddSample(protocols[ND_PROTO_UNKNOWN], packets);
+}
+
+void ndDetectionBudget::AddComplete(nd_proto_id_t protocol,
+  bool detected, unsigned packets, Completion completion) {
+    Protocol &p = protocols[Index(protocol)];
+
+    p.flows.fetch_add(1, memory_order_relaxed);
+    if (detected) p.detected.fetch_add(1, memory_order_relaxed);
+    p.packets.fetch_add(packets, memory_order_relaxed);
+
+    // A flow that ran out of budget needed (at least) one more
+    // packet.  Undetected flows count against the unknown budget
+    // (detected ones learn from AddDetected()), or it would only
+    // ever learn from flows that fit in it.  Flows cut short
+    // under congestion count as needing more than the full one.
+    if (! detected) {
+        if (completion != COMPLETE_EXHAUSTED) return;
+
+        Protocol &u = protocols[ND_PROTO_UNKNOWN];
+        AddSample(u,
+          max(packets, u.budget.load(memory_order_relaxed)) + 1);
+        return;
+    }
+
+    if (Index(protocol) == ND_PROTO_UNKNOWN) return;
+
+    switch (completion) {
+    case COMPLETE_DISSECTED: AddSample(p, packets); break;
+    case COMPLETE_EXHAUSTED: AddSample(p, packets + 1); break;
+    default: break;
+    }
+}
+
+void ndDetectionBudget::Update(
+  vector<ndDetectionBudgetStats> &stats) {
+    stats.clear();
+
+    for (size_t i = 0; i < ND_PROTO_MAX; i++) {
+        Protocol &p = protocols[i];
+
+        if (! p.configured) Learn(p);
+
+        uint64_t flows = p.flows.exchange(0, memory_order_relaxed);
+        if (flows == 0) continue;
+
+        ndDetectionBudgetStats entry;
+
+        entry.protocol = (nd_proto_id_t)i;
+        entry.budget = p.budget.load(memory_order_relaxed);
+        entry.flows = flows;
+        entry.detected = p.detected.exchange(0,
+          memory_order_relaxed);
+        entry.packets = p.packets.exchange(0, memory_order_relaxed);
+
+        stats.push_back(entry);
+    }
+}
+
+void ndDetectionBudget::AddSample(Protocol &p, unsigned packets) {
+    if (packets == 0) return;
+
+    // The last bin also counts anything longer.
+    size_t bin = min((size_t)packets,
+      (size_t)_ND_DETECTION_BUDGET_BINS);
+
+    p.bins[bin - 1].fetch_add(1, memory_order_relaxed);
+}
+
+void ndDetectionBudget::Learn(Protocol &p) {
+    uint64_t samples = 0;
+    uint32_t bins[_ND_DETECTION_BUDGET_BINS];
+
+    for (size_t i = 0; i < _ND_DETECTION_BUDGET_BINS; i++) {
+        bins[i] = p.bins[i].load(memory_order_relaxed);
+        samples += bins[i];
+    }
+
+    if (samples < ND_DETECTION_BUDGET_SAMPLES) return;
+
+    // Smallest packet count that covers the percentile...
+    uint64_t target =
+      (samples * ND_DETECTION_BUDGET_PERCENTILE + 99) / 100;
+    uint64_t count = 0;
+    unsigned budget = _ND_DETECTION_BUDGET_BINS;
+
+    for (size_t i = 0; i < _ND_DETECTION_BUDGET_BINS; i++) {
+        if ((count += bins[i]) < target) continue;
+        budget = (unsigned)i + 1;
+        break;
+    }
+
+    // ...plus a margin, so that a budget learned from flows it
+    // has already cut short can still grow.
+    budget = min(budget + ND_DETECTION_BUDGET_MARGIN,
+      ndGC.max_detection_pkts);
+
+    p.budget.store(budget, memory_order_relaxed);
+
+    // Age the history, so budgets follow changes in traffic.
+    if (samples >= ND_DETECTION_BUDGET_DECAY) {
+        for (auto &bin : p.bins)
+            bin.store(bin.load(memory_order_relaxed) / 2,
+              memory_order_relaxed);
+    }
+}
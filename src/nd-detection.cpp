@@ -23,7 +23,12 @@
 #include "config.h"
 #endif
 
+#include <algorithm>
+
+#include <sched.h>
+
 #include "nd-detection.hpp"
+#include "nd-hash.hpp"
 #include "nd-protos.hpp"
 #include "nd-tls-alpn.hpp"
 #include "ndpi_protocol_ids.h"
@@ -44,9 +49,255 @@
 // #define _ND_LOG_RISKS 1
 
 #define ndEF    entry->flow
+#define ndEFM   entry->flow->Metadata()
 #define ndEFNF  entry->flow->ndpi_flow
 #define ndEFNFP entry->flow->ndpi_flow->protos
 
+static inline uint64_t nd_queue_time_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline void nd_cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+ndDetectionQueue::ndDetectionQueue(size_t max_bytes)
+  : slots(nullptr), mask(0), max_bytes(max_bytes), head(0),
+    tail(0), bytes(0), high_water(0), latency_ns(0),
+    latency_samples(0), latency_max_ns(0) {
+    size_t count = ND_DETECTION_QUEUE_MIN_SLOTS;
+    while (count < max_bytes / ND_DETECTION_QUEUE_SLOT_SIZE)
+        count <<= 1;
+
+    try {
+        slots = new Slot[count];
+    }
+    catch (bad_alloc &e) {
+        throw ndSystemException(__PRETTY_FUNCTION__,
+          "new Slot", ENOMEM);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        slots[i].seq.store(i, memory_order_relaxed);
+        slots[i].bytes = 0;
+        slots[i].ts_queued = 0;
+    }
+
+    mask = count - 1;
+}
+
+ndDetectionQueue::~ndDetectionQueue() {
+    while (Front() != nullptr) Pop();
+
+    delete[] slots;
+}
+
+bool ndDetectionQueue::Push(nd_flow_ptr &flow,
+  const ndPacket *packet, const uint8_t *data, uint16_t length) {
+    // Expiry requests (no packet) are not charged; they are
+    // bounded by the ring alone.
+    size_t charge = (packet != nullptr) ?
+      sizeof(ndPacket) + length :
+      0;
+
+    if (charge > 0 &&
+      bytes.fetch_add(charge, memory_order_relaxed) + charge > max_bytes)
+    {
+        bytes.fetch_sub(charge, memory_order_relaxed);
+        return false;
+    }
+
+    Slot *slot;
+    size_t pos = tail.load(memory_order_relaxed);
+
+    for (;;) {
+        slot = &slots[pos & mask];
+        intptr_t delta =
+          (intptr_t)slot->seq.load(memory_order_acquire) -
+          (intptr_t)pos;
+
+        if (delta == 0) {
+            if (tail.compare_exchange_weak(pos, pos + 1,
+                  memory_order_relaxed))
+                break;
+        }
+        else if (delta < 0) {
+            // Full: the consumer has not yet freed this slot.
+            bytes.fetch_sub(charge, memory_order_relaxed);
+            return false;
+        }
+        else pos = tail.load(memory_order_relaxed);
+    }
+
+    slot->bytes = charge;
+    slot->ts_queued = (pos % ND_DETECTION_QUEUE_SAMPLE == 0) ?
+      nd_queue_time_ns() :
+      0;
+    slot->entry.flow = flow;
+    slot->entry.packet = packet;
+    slot->entry.data = data;
+    slot->entry.length = length;
+
+    flow->dpi_queued++;
+
+    // Until the slot is published, the consumer can't get past
+    // it, so the depth can't wrap.
+    size_t depth = pos + 1 - head.load(memory_order_acquire);
+
+    slot->seq.store(pos + 1, memory_order_release);
+
+    size_t hwm = high_water.load(memory_order_relaxed);
+    while (depth > hwm &&
+      ! high_water.compare_exchange_weak(hwm, depth,
+        memory_order_relaxed))
+        ;
+
+    return true;
+}
+
+ndDetectionQueueEntry *ndDetectionQueue::Front(void) {
+    size_t pos = head.load(memory_order_relaxed);
+    Slot *slot = &slots[pos & mask];
+
+    if (slot->seq.load(memory_order_acquire) != pos + 1)
+        return nullptr;
+
+    return &slot->entry;
+}
+
+void ndDetectionQueue::Pop(void) {
+    size_t pos = head.load(memory_order_relaxed);
+    Slot *slot = &slots[pos & mask];
+
+    if (slot->entry.packet != nullptr) {
+        delete slot->entry.packet;
+        slot->entry.packet = nullptr;
+    }
+    slot->entry.flow->dpi_queued--;
+    slot->entry.flow.reset();
+
+    bytes.fetch_sub(slot->bytes, memory_order_relaxed);
+
+    if (slot->ts_queued != 0) {
+        uint64_t ns = nd_queue_time_ns() - slot->ts_queued;
+
+        latency_ns.fetch_add(ns, memory_order_relaxed);
+        latency_samples.fetch_add(1, memory_order_relaxed);
+        if (ns > latency_max_ns.load(memory_order_relaxed))
+            latency_max_ns.store(ns, memory_order_relaxed);
+    }
+
+    head.store(pos + 1, memory_order_relaxed);
+    slot->seq.store(pos + mask + 1, memory_order_release);
+}
+
+size_t ndDetectionQueue::GetHighWater(void) {
+    return high_water.exchange(GetDepth(), memory_order_relaxed);
+}
+
+void ndDetectionQueue::GetLatency(uint64_t &total_ns,
+  uint64_t &samples, uint64_t &max_ns) {
+    total_ns = latency_ns.exchange(0, memory_order_relaxed);
+    samples = latency_samples.exchange(0, memory_order_relaxed);
+    max_ns = latency_max_ns.exchange(0, memory_order_relaxed);
+}
+
+uint64_t ndDetectionCache::MakeKey(const ndFlow &flow,
+  const char *host) {
+    const ndFlowAddr *server;
+
+    switch (flow.origin) {
+    case ndFlow::ORIGIN_LOWER: server = &flow.upper_addr; break;
+    case ndFlow::ORIGIN_UPPER: server = &flow.lower_addr; break;
+    default: return 0;
+    }
+
+    if (! server->IsIP()) return 0;
+
+    uint8_t buffer[sizeof(ndFlowAddr) + 1 + ND_FLOW_HOSTNAME];
+    size_t length = sizeof(ndFlowAddr);
+
+    memcpy(buffer, server, sizeof(ndFlowAddr));
+    buffer[length++] = flow.ip_protocol;
+
+    if (host != nullptr) {
+        size_t host_length = strnlen(host, ND_FLOW_HOSTNAME);
+        memcpy(&buffer[length], host, host_length);
+        length += host_length;
+    }
+
+    uint64_t key = nd_hash64(buffer, length, nd_hash_key());
+
+    // Zero is reserved for "no key".
+    return (key != 0) ? key : 1;
+}
+
+bool ndDetectionCache::Lookup(uint64_t key, uint64_t ts_now,
+  Entry &entry) {
+    lock_guard<mutex> ul(lock);
+
+    nd_dc_map::iterator i = lookup.find(key);
+
+    if (i == lookup.end()) {
+        misses++;
+        return false;
+    }
+
+    if (i->second->ts_expires <= ts_now) {
+        index.erase(i->second);
+        lookup.erase(i);
+        entries = lookup.size();
+
+        misses++;
+        return false;
+    }
+
+    index.splice(index.begin(), index, i->second);
+    entry = index.front();
+
+    hits++;
+    return true;
+}
+
+void ndDetectionCache::Insert(Entry &entry, uint64_t ts_now) {
+    lock_guard<mutex> ul(lock);
+
+    entry.ts_expires = ts_now + (uint64_t)ttl * 1000;
+
+    nd_dc_map::iterator i = lookup.find(entry.key);
+
+    if (i != lookup.end()) {
+        *i->second = entry;
+        index.splice(index.begin(), index, i->second);
+        return;
+    }
+
+    if (lookup.size() >= cache_size) {
+        lookup.erase(index.back().key);
+        index.pop_back();
+    }
+
+    index.push_front(entry);
+    lookup[entry.key] = index.begin();
+
+    entries = lookup.size();
+}
+
+void ndDetectionCache::Clear(void) {
+    lock_guard<mutex> ul(lock);
+
+    index.clear();
+    lookup.clear();
+
+    entries = 0;
+}
+
 ndDetectionThread::ndDetectionThread(int16_t cpu, const string &tag,
 #ifdef _ND_USE_NETLINK
   ndNetlink *netlink,
@@ -54,7 +305,8 @@ ndDetectionThread::ndDetectionThread(int16_t cpu, const string &tag,
 #ifdef _ND_USE_CONNTRACK
   ndConntrackThread *thread_conntrack,
 #endif
-  ndDNSHintCache *dhc, ndFlowHashCache *fhc, uint8_t private_addr)
+  ndDNSHintCache *dhc, ndFlowHashCache *fhc, ndDetectionCache *dc,
+  uint8_t private_addr)
   : ndThread(tag, (long)cpu, true), ndInstanceClient(),
 #ifdef _ND_USE_NETLINK
     netlink(netlink),
@@ -62,8 +314,23 @@ ndDetectionThread::ndDetectionThread(int16_t cpu, const string &tag,
 #ifdef _ND_USE_CONNTRACK
     thread_conntrack(thread_conntrack),
 #endif
-    ndpi(nullptr), dhc(dhc), fhc(fhc), flows(0) {
-    Reload();
+    ndpi_module(nullptr), ndpi_pending(nullptr),
+    ndpi_flow_pool(nullptr), dhc(dhc), fhc(fhc), dc(dc),
+    pkt_queue(ndGC.max_packet_queue), parked(false),
+    spin_limit(ND_DETECTION_SPIN_MIN), wakeups(0),
+    scheduler(nullptr), steal_request(-1), cpu_load(0),
+    ts_load_wall{ 0, 0 }, ts_load_cpu{ 0, 0 }, flows(0) {
+    ndpi_module = new ndNDPIModule(ndi.ndpi_config);
+    if (ndpi_module == nullptr) {
+        throw ndSystemException(__PRETTY_FUNCTION__,
+          "new ndNDPIModule", ENOMEM);
+    }
+
+    ndpi_flow_pool = new ndNDPIFlowPool(tag);
+    if (ndpi_flow_pool == nullptr) {
+        throw ndSystemException(__PRETTY_FUNCTION__,
+          "new ndNDPIFlowPool", ENOMEM);
+    }
 
     private_addrs.first.ss_family = AF_INET;
     nd_private_ipaddr(private_addr, private_addrs.first);
@@ -96,14 +363,10 @@ ndDetectionThread::~ndDetectionThread() {
     pthread_cond_destroy(&pkt_queue_cond);
     pthread_mutex_destroy(&pkt_queue_cond_mutex);
 
-    while (pkt_queue.size()) {
-        ndDetectionQueueEntry *entry = pkt_queue.front();
-        pkt_queue.pop();
-
-        delete entry;
-    }
-
-    if (ndpi != nullptr) nd_ndpi_free(ndpi);
+    ndNDPIModule *module = ndpi_pending.exchange(nullptr);
+    if (module != nullptr) module->Release();
+    if (ndpi_module != nullptr) ndpi_module->Release();
+    if (ndpi_flow_pool != nullptr) ndpi_flow_pool->Release();
 
     nd_dprintf(
       "%s: detection thread destroyed, %u flows "
@@ -111,42 +374,139 @@ ndDetectionThread::~ndDetectionThread() {
       tag.c_str(), flows);
 }
 
-void ndDetectionThread::Reload(void) {
-    if (ndpi != nullptr) nd_ndpi_free(ndpi);
-    ndpi = nd_ndpi_init();
+void ndDetectionThread::Reload(ndNDPIModule *module) {
+    // Replaces (and drops) any module not yet picked up.
+    module = ndpi_pending.exchange(module, memory_order_acq_rel);
+    if (module != nullptr) module->Release();
 }
 
-void ndDetectionThread::QueuePacket(nd_flow_ptr &flow,
+void ndDetectionThread::SwapModule(void) {
+    if (ndpi_pending.load(memory_order_relaxed) == nullptr) return;
+
+    ndNDPIModule *module = ndpi_pending.exchange(nullptr,
+      memory_order_acq_rel);
+    if (module == nullptr) return;
+
+    // Flows already in detection hold on to the old module,
+    // which is freed once the last of them is done.
+    ndpi_module->Release();
+    ndpi_module = module;
+
+    nd_dprintf("%s: nDPI detection module reloaded.\n", tag.c_str());
+}
+
+bool ndDetectionThread::QueuePacket(nd_flow_ptr &flow,
   const ndPacket *packet,
   const uint8_t *data,
   uint16_t length) {
-    ndDetectionQueueEntry *entry = new ndDetectionQueueEntry(
-      flow, packet, data, length);
-
-    if (entry == nullptr)
-        throw ndDetectionThreadException(strerror(ENOMEM));
-
-    Lock();
+    return pkt_queue.Push(flow, packet, data, length);
+}
 
-    pkt_queue.push(entry);
+void ndDetectionThread::Notify(void) {
+    // Pairs with the fence in Park(): either we see the thread
+    // parked, or it sees our queued entries before waiting.
+    atomic_thread_fence(memory_order_seq_cst);
 
-    Unlock();
+    if (parked.load(memory_order_relaxed) == false ||
+      parked.exchange(false) == false)
+        return;
 
     int rc;
-    if ((rc = pthread_cond_broadcast(&pkt_queue_cond)) != 0)
+    if ((rc = pthread_mutex_lock(&pkt_queue_cond_mutex)) != 0)
         throw ndDetectionThreadException(strerror(rc));
+    if ((rc = pthread_cond_signal(&pkt_queue_cond)) != 0) {
+        pthread_mutex_unlock(&pkt_queue_cond_mutex);
+        throw ndDetectionThreadException(strerror(rc));
+    }
+    if ((rc = pthread_mutex_unlock(&pkt_queue_cond_mutex)) != 0)
+        throw ndDetectionThreadException(strerror(rc));
+
+    wakeups++;
 }
 
 void *ndDetectionThread::Entry(void) {
+    do {
+        ProcessPacketQueue();
+
+        UpdateLoad();
+
+        if (SpinPacketQueue()) continue;
+
+        // Out of work; ask a busy thread for some before parking.
+        if (scheduler != nullptr) scheduler->RequestSteal(this);
+
+        Park();
+    }
+    while (ShouldTerminate() == false);
+
+    ProcessPacketQueue();
+
+    nd_dprintf("%s: detection thread ended on CPU: %hu\n",
+      tag.c_str(), cpu);
+
+    return nullptr;
+}
+
+// Poll the (empty) queue for a while before parking.  The spin
+// budget adapts: it grows while spinning finds work, and shrinks
+// when it does not.
+bool ndDetectionThread::SpinPacketQueue(void) {
+    for (unsigned i = 0; i < spin_limit; i++) {
+        if (pkt_queue.Front() != nullptr) {
+            if (spin_limit < ND_DETECTION_SPIN_MAX) spin_limit <<= 1;
+            return true;
+        }
+
+        nd_cpu_relax();
+    }
+
+    if (spin_limit > ND_DETECTION_SPIN_MIN) spin_limit >>= 1;
+
+    return false;
+}
+
+void ndDetectionThread::UpdateLoad(void) {
+    struct timespec ts_wall, ts_cpu;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts_wall);
+
+    uint64_t wall_ms =
+      (ts_wall.tv_sec - ts_load_wall.tv_sec) * 1000 +
+      (ts_wall.tv_nsec - ts_load_wall.tv_nsec) / 1000000;
+    if (wall_ms < ND_DETECTION_LOAD_INTERVAL) return;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts_cpu);
+
+    uint64_t cpu_ms =
+      (ts_cpu.tv_sec - ts_load_cpu.tv_sec) * 1000 +
+      (ts_cpu.tv_nsec - ts_load_cpu.tv_nsec) / 1000000;
+
+    if (ts_load_wall.tv_sec != 0) {
+        cpu_load.store((unsigned)min((uint64_t)1000,
+                         cpu_ms * 1000 / wall_ms),
+          memory_order_relaxed);
+    }
+
+    ts_load_wall = ts_wall;
+    ts_load_cpu = ts_cpu;
+}
+
+void ndDetectionThread::Park(void) {
     int rc;
 
-    do {
-        if ((rc = pthread_mutex_lock(&pkt_queue_cond_mutex)) != 0)
-            throw ndDetectionThreadException(strerror(rc));
+    if ((rc = pthread_mutex_lock(&pkt_queue_cond_mutex)) != 0)
+        throw ndDetectionThreadException(strerror(rc));
+
+    parked = true;
+    atomic_thread_fence(memory_order_seq_cst);
 
+    if (pkt_queue.Front() == nullptr && ShouldTerminate() == false)
+    {
         struct timespec ts_cond;
-        if (clock_gettime(CLOCK_MONOTONIC, &ts_cond) != 0)
-            throw ndDetectionThreadException(strerror(rc));
+        if (clock_gettime(CLOCK_MONOTONIC, &ts_cond) != 0) {
+            pthread_mutex_unlock(&pkt_queue_cond_mutex);
+            throw ndDetectionThreadException(strerror(errno));
+        }
 
         ts_cond.tv_sec += 1;
 
@@ -154,78 +514,282 @@ void *ndDetectionThread::Entry(void) {
                &pkt_queue_cond_mutex, &ts_cond)) != 0 &&
           rc != ETIMEDOUT)
         {
+            pthread_mutex_unlock(&pkt_queue_cond_mutex);
             throw ndDetectionThreadException(strerror(rc));
         }
+    }
 
-        if ((rc = pthread_mutex_unlock(&pkt_queue_cond_mutex)) != 0)
-            throw ndDetectionThreadException(strerror(rc));
+    parked = false;
 
-        ProcessPacketQueue();
+    if ((rc = pthread_mutex_unlock(&pkt_queue_cond_mutex)) != 0)
+        throw ndDetectionThreadException(strerror(rc));
+}
+
+void ndDetectionThread::ProcessPacketQueue(void) {
+    ndDetectionQueueEntry *entry;
+
+    while ((entry = pkt_queue.Front()) != nullptr) {
+        // Between packets; the queue may never drain under load.
+        SwapModule();
+        // Rate limited to ND_DETECTION_LOAD_INTERVAL.
+        UpdateLoad();
+
+        // An idle thread is asking for work; hand over this flow
+        // if it can be moved.
+        if (steal_request.load(memory_order_relaxed) >= 0 &&
+          scheduler != nullptr && scheduler->Donate(this, entry))
+        {
+            pkt_queue.Pop();
+            continue;
+        }
+
+        try {
+            ProcessEntry(entry);
+        }
+        catch (...) {
+            pkt_queue.Pop();
+            throw;
+        }
+
+        pkt_queue.Pop();
     }
-    while (ShouldTerminate() == false);
 
-    ProcessPacketQueue();
+    // Nothing left to hand over; drop any stale steal request.
+    if (steal_request.load(memory_order_relaxed) >= 0)
+        steal_request.store(-1, memory_order_relaxed);
+}
 
-    nd_dprintf("%s: detection thread ended on CPU: %hu\n",
-      tag.c_str(), cpu);
+ndDetectionScheduler::ndDetectionScheduler(
+  const nd_detection_threads &threads)
+  : cursor(0), enabled(true), donating(0), steals(0) {
+    for (auto &it : threads)
+        this->threads.push_back(make_pair(it.first, it.second));
+}
 
-    return nullptr;
+bool ndDetectionScheduler::QueuePacket(nd_flow_ptr &flow,
+  ndDetectionThread *&thread, const ndPacket *packet,
+  const uint8_t *data, uint16_t length) {
+    LockFlow(flow);
+
+    if (flow->dpi_thread_id < 0) flow->dpi_thread_id = Place();
+
+    thread = Find(flow->dpi_thread_id);
+
+    bool queued = (thread != nullptr &&
+      thread->QueuePacket(flow, packet, data, length));
+
+    UnlockFlow(flow);
+
+    return queued;
 }
 
-void ndDetectionThread::ProcessPacketQueue(void) {
-    ndDetectionQueueEntry *entry;
+void ndDetectionScheduler::RequestSteal(ndDetectionThread *thief) {
+    if (enabled.load() == false) return;
 
-    do {
-        Lock();
+    ndDetectionThread *victim = nullptr;
+    size_t depth = ND_DETECTION_STEAL_DEPTH - 1;
 
-        if (pkt_queue.size()) {
-            entry = pkt_queue.front();
-            pkt_queue.pop();
+    for (auto &it : threads) {
+        if (it.second == thief) continue;
+
+        size_t d = it.second->GetQueue().GetDepth();
+        if (d > depth) {
+            victim = it.second;
+            depth = d;
         }
-        else entry = nullptr;
+    }
 
-        Unlock();
+    if (victim == nullptr) return;
 
-        if (entry != nullptr) {
-            if (ndEF->stats.detection_packets.load() == 0 ||
-              (ndEF->flags.detection_complete.load() == false &&
-                ndEF->flags.expiring.load() == false &&
-                ndEF->stats.detection_packets.load() <
-                  ndGC.max_detection_pkts))
-            {
-                ndEF->stats.detection_packets++;
+    int16_t none = -1;
+    victim->steal_request.compare_exchange_strong(none,
+      FindId(thief));
+}
 
-                ProcessPacket(entry);
-            }
+bool ndDetectionScheduler::Donate(ndDetectionThread *donor,
+  ndDetectionQueueEntry *entry) {
+    // Only packets of flows yet to start detection; nDPI state
+    // is never moved.
+    if (entry->packet == nullptr || ndEFNF != nullptr ||
+      ndEF->stats.detection_packets.load() != 0)
+        return false;
 
-            if (ndEF->stats.detection_packets.load() ==
-                ndGC.max_detection_pkts ||
-              (ndEF->flags.expiring.load() &&
-                ndEF->flags.expired.load() == false))
-            {
-                if (entry->packet != nullptr)
-                    ProcessPacket(entry);
+    if (ndEF->dpi_lock.exchange(true, memory_order_acquire))
+        return false;
 
-                ProcessFlow(entry);
+    bool donated = false;
 
-                if (ndEF->detected_protocol == ND_PROTO_UNKNOWN)
-                    SetGuessedProtocol(entry);
+    // Sole entry queued for the flow, and (with the flow locked)
+    // no more can be queued until we are done.
+    if (ndEF->dpi_queued.load() == 1) {
+        donating++;
 
-                SetDetectionComplete(entry);
+        int16_t id = donor->steal_request.exchange(-1);
+        ndDetectionThread *thief = Find(id);
 
-                if (ndEF->flags.expiring.load()) {
-                    ndEF->flags.expired = true;
-                    ndEF->flags.expiring = false;
-                }
+        if (enabled.load() && thief != nullptr && thief != donor) {
+            int16_t donor_id = ndEF->dpi_thread_id;
+            ndEF->dpi_thread_id = id;
+
+            if (thief->QueuePacket(ndEF, entry->packet, entry->data,
+                  entry->length))
+            {
+                // Packet ownership passes to the thief's queue.
+                entry->packet = nullptr;
+                thief->Notify();
+                steals++;
+                donated = true;
             }
+            else ndEF->dpi_thread_id = donor_id;
+        }
 
-            if (ndEF->flags.detection_complete.load())
-                ndEF->Release();
+        donating--;
+    }
 
-            delete entry;
+    UnlockFlow(ndEF);
+
+    return donated;
+}
+
+void ndDetectionScheduler::Disable(void) {
+    enabled = false;
+    while (donating.load() != 0) sched_yield();
+}
+
+int16_t ndDetectionScheduler::Place(void) {
+    size_t count = threads.size();
+    if (count == 0) return -1;
+
+    // Start from a rotating position, so that idle threads share
+    // new flows rather than the first one taking them all.
+    size_t start = cursor.fetch_add(1, memory_order_relaxed);
+    size_t best = start % count;
+    size_t best_load = threads[best].second->GetLoad();
+
+    for (size_t i = 1; i < count && best_load > 0; i++) {
+        size_t n = (start + i) % count;
+        size_t load = threads[n].second->GetLoad();
+
+        if (load < best_load) {
+            best = n;
+            best_load = load;
         }
     }
-    while (entry != nullptr);
+
+    return threads[best].first;
+}
+
+ndDetectionThread *ndDetectionScheduler::Find(int16_t id) const {
+    for (auto &it : threads) {
+        if (it.first == id) return it.second;
+    }
+
+    return nullptr;
+}
+
+int16_t ndDetectionScheduler::FindId(
+  const ndDetectionThread *thread) const {
+    for (auto &it : threads) {
+        if (it.second == thread) return it.first;
+    }
+
+    return -1;
+}
+
+void ndDetectionThread::ProcessInline(nd_flow_ptr &flow,
+  const ndPacket *packet,
+  const uint8_t *data,
+  uint16_t length) {
+    ndDetectionQueueEntry entry(flow, packet, data, length);
+
+    Lock();
+
+    try {
+        SwapModule();
+        ProcessEntry(&entry);
+    }
+    catch (...) {
+        Unlock();
+        entry.packet = nullptr;
+        throw;
+    }
+
+    Unlock();
+
+    // Packet ownership stays with the caller
+    entry.packet = nullptr;
+}
+
+void ndDetectionThread::ProcessEntry(ndDetectionQueueEntry *entry) {
+    bool detection_init = ndEF->flags.detection_init.load();
+    bool detection_complete = ndEF->flags.detection_complete.load();
+    bool expiring = ndEF->flags.expiring.load();
+    bool gave_up = false;
+
+    unsigned budget = ndi.dpi_budget.Get(ndEF->detected_protocol,
+      pkt_queue.IsCongested());
+
+    if (ndEF->stats.detection_packets.load() == 0 ||
+      (detection_complete == false && expiring == false &&
+        ndEF->stats.detection_packets.load() < budget))
+    {
+        ndEF->stats.detection_packets++;
+
+        ProcessPacket(entry);
+
+        // The budget follows the protocol, which may have just
+        // been detected.
+        budget = ndi.dpi_budget.Get(ndEF->detected_protocol,
+          pkt_queue.IsCongested());
+    }
+
+    if ((ndEF->flags.detection_complete.load() == false &&
+          ndEF->stats.detection_packets.load() >= budget) ||
+      (expiring && ndEF->flags.expired.load() == false))
+    {
+        gave_up = true;
+
+        if (entry->packet != nullptr)
+            ProcessPacket(entry);
+
+        ProcessFlow(entry);
+
+        if (ndEF->detected_protocol == ND_PROTO_UNKNOWN)
+            SetGuessedProtocol(entry);
+
+        SetDetectionComplete(entry);
+
+        if (ndEF->flags.expiring.load()) {
+            ndEF->flags.expired = true;
+            ndEF->flags.expiring = false;
+        }
+    }
+
+    if (detection_init == false && gave_up == false &&
+      ndEF->flags.detection_init.load())
+        ndi.dpi_budget.AddDetected(
+          ndEF->stats.detection_packets.load());
+
+    if (detection_complete == false &&
+      ndEF->flags.detection_complete.load())
+    {
+        ndi.dpi_budget.AddComplete(ndEF->detected_protocol,
+          (ndEF->detected_protocol != ND_PROTO_UNKNOWN &&
+            ndEF->flags.detection_guessed.load() == false),
+          ndEF->stats.detection_packets.load(),
+          (ndEF->flags.detection_cached.load() || expiring) ?
+            ndDetectionBudget::COMPLETE_OTHER :
+            (gave_up) ? ndDetectionBudget::COMPLETE_EXHAUSTED :
+                        ndDetectionBudget::COMPLETE_DISSECTED);
+    }
+
+    // Detection is done; recycle the nDPI flow state now rather
+    // than carry it until the flow is destroyed.
+    if (ndEF->flags.detection_complete.load() && ndEFNF != nullptr)
+    {
+        ndpi_flow_pool->Put(ndEFNF);
+        ndEFNF = nullptr;
+    }
 }
 
 void ndDetectionThread::ProcessPacket(ndDetectionQueueEntry *entry) {
@@ -234,14 +798,14 @@ void ndDetectionThread::ProcessPacket(ndDetectionQueueEntry *entry) {
     if (ndEFNF == nullptr) {
         flows++;
 
-        ndEFNF = (ndpi_flow_struct *)ndpi_malloc(
-          sizeof(ndpi_flow_struct));
-        if (ndEFNF == nullptr)
-            throw ndDetectionThreadException(strerror(ENOMEM));
-
-        memset(ndEFNF, 0, sizeof(ndpi_flow_struct));
+        ndEFNF = ndpi_flow_pool->Create(ndpi_module);
     }
 
+    // The module detection started on, which may since have
+    // been replaced by Reload().
+    struct ndpi_detection_module_struct *ndpi =
+      ndNDPIFlowPool::GetModule(ndEFNF)->Get();
+
     ndpi_protocol ndpi_rc = ndpi_detection_process_packet(ndpi,
       ndEFNF, entry->data, entry->length,
       ndEF->ts_last_seen.load(), nullptr);
@@ -317,6 +881,10 @@ void ndDetectionThread::ProcessPacket(ndDetectionQueueEntry *entry) {
     if (ndEF->flags.detection_init.load() == false &&
       ndEF->detected_protocol != ND_PROTO_UNKNOWN)
     {
+        // A cached result completes detection now, rather than
+        // after any extra packets.
+        if (SetCachedDetection(entry)) check_extra_packets = false;
+
         ProcessFlow(entry);
         flow_update = true;
     }
@@ -327,19 +895,19 @@ void ndDetectionThread::ProcessPacket(ndDetectionQueueEntry *entry) {
         switch (ndEF->GetMasterProtocol()) {
         case ND_PROTO_TLS:
         case ND_PROTO_QUIC:
-            if (ndEF->ssl.cipher_suite == 0 &&
+            if (ndEFM.ssl.cipher_suite == 0 &&
               ndEFNFP.tls_quic.server_cipher != 0)
             {
-                ndEF->ssl.cipher_suite = ndEFNFP.tls_quic.server_cipher;
+                ndEFM.ssl.cipher_suite = ndEFNFP.tls_quic.server_cipher;
 
                 flow_update = true;
                 ndEF->flags.detection_updated = true;
             }
 
-            if (ndEF->ssl.server_cn[0] == '\0' &&
+            if (ndEFM.ssl.server_cn[0] == '\0' &&
               ndEFNFP.tls_quic.serverCN != nullptr)
             {
-                nd_set_hostname(ndEF->ssl.server_cn,
+                nd_set_hostname(ndEFM.ssl.server_cn,
                   ndEFNFP.tls_quic.serverCN,
                   ND_FLOW_TLS_CNLEN);
                 free(ndEFNFP.tls_quic.serverCN);
@@ -348,16 +916,16 @@ void ndDetectionThread::ProcessPacket(ndDetectionQueueEntry *entry) {
                 // Detect application by server CN if still
                 // unknown.
                 SetDetectedApplication(entry,
-                  ndi.apps.Find(ndEF->ssl.server_cn));
+                  ndi.apps.Find(ndEFM.ssl.server_cn));
 
                 flow_update = true;
                 ndEF->flags.detection_updated = true;
             }
 
-            if (ndEF->ssl.issuer_dn == nullptr &&
+            if (ndEFM.ssl.issuer_dn == nullptr &&
               ndEFNFP.tls_quic.issuerDN != nullptr)
             {
-                ndEF->ssl.issuer_dn = strdup(
+                ndEFM.ssl.issuer_dn = strdup(
                   ndEFNFP.tls_quic.issuerDN);
                 free(ndEFNFP.tls_quic.issuerDN);
                 ndEFNFP.tls_quic.issuerDN = nullptr;
@@ -366,10 +934,10 @@ void ndDetectionThread::ProcessPacket(ndDetectionQueueEntry *entry) {
                 ndEF->flags.detection_updated = true;
             }
 
-            if (ndEF->ssl.subject_dn == nullptr &&
+            if (ndEFM.ssl.subject_dn == nullptr &&
               ndEFNFP.tls_quic.subjectDN != nullptr)
             {
-                ndEF->ssl.subject_dn = strdup(
+                ndEFM.ssl.subject_dn = strdup(
                   ndEFNFP.tls_quic.subjectDN);
                 free(ndEFNFP.tls_quic.subjectDN);
                 ndEFNFP.tls_quic.subjectDN = nullptr;
@@ -378,24 +946,24 @@ void ndDetectionThread::ProcessPacket(ndDetectionQueueEntry *entry) {
                 ndEF->flags.detection_updated = true;
             }
 
-            if (ndEF->ssl.server_ja3[0] == '\0' &&
+            if (ndEFM.ssl.server_ja3[0] == '\0' &&
               ndEFNFP.tls_quic.ja3_server[0] != '\0')
             {
-                snprintf(ndEF->ssl.server_ja3, ND_FLOW_TLS_JA3LEN,
+                snprintf(ndEFM.ssl.server_ja3, ND_FLOW_TLS_JA3LEN,
                   "%s", ndEFNFP.tls_quic.ja3_server);
 
                 flow_update = true;
                 ndEF->flags.detection_updated = true;
             }
 
-            if (! ndEF->ssl.cert_fingerprint_found &&
+            if (! ndEFM.ssl.cert_fingerprint_found &&
               ndEFNFP.tls_quic.fingerprint_set)
             {
-                memcpy(ndEF->ssl.cert_fingerprint,
+                memcpy(ndEFM.ssl.cert_fingerprint,
                   ndEFNFP.tls_quic.sha1_certificate_fingerprint,
                   ND_FLOW_TLS_HASH_LEN);
 
-                ndEF->ssl.cert_fingerprint_found = true;
+                ndEFM.ssl.cert_fingerprint_found = true;
 
                 flow_update = true;
                 ndEF->flags.detection_updated = true;
@@ -426,16 +994,16 @@ void ndDetectionThread::ProcessPacket(ndDetectionQueueEntry *entry) {
             // nd_dprintf("mDNS flow updated: %s, %s, %s\n",
             //     ndEF->host_server_name,
             //     ndEFNF->host_server_name,
-            //     ndEF->mdns.domain_name);
+            //     ndEFM.mdns.domain_name);
             break;
         case ND_PROTO_LLMNR:
             // nd_dprintf("LLMNR flow updated.\n");
             break;
         case ND_PROTO_SSH:
-            if (ndEF->ssh.server_agent[0] == '\0' &&
+            if (ndEFM.ssh.server_agent[0] == '\0' &&
               ndEFNFP.ssh.server_signature[0] != '\0')
             {
-                snprintf(ndEF->ssh.server_agent, ND_FLOW_SSH_UALEN,
+                snprintf(ndEFM.ssh.server_agent, ND_FLOW_SSH_UALEN,
                   "%s", ndEFNFP.ssh.server_signature);
                 flow_update = true;
                 ndEF->flags.detection_updated = true;
@@ -499,14 +1067,14 @@ bool ndDetectionThread::ProcessALPN(
             string alpn;
             getline(ss, alpn, ',');
 
-            ndEF->tls_alpn.push_back(alpn);
+            ndEFM.tls_alpn.push_back(alpn);
         }
 
-        flow_update = (ndEF->tls_alpn.size() > 0);
+        flow_update = (ndEFM.tls_alpn.size() > 0);
         ndEF->tls_alpn_set = flow_update;
     }
     else if (! ndEF->tls_alpn_server_set.load()) {
-        ndEF->tls_alpn_server.push_back(detected_alpn);
+        ndEFM.tls_alpn_server.push_back(detected_alpn);
         ndEF->tls_alpn_server_set = true;
 
         auto alpn = nd_alpn_protos.find(detected_alpn);
@@ -535,22 +1103,25 @@ bool ndDetectionThread::ProcessALPN(
 }
 
 void ndDetectionThread::ProcessFlow(ndDetectionQueueEntry *entry) {
-    ndi.addr_types.Classify(ndEF->lower_type, ndEF->lower_addr);
-    ndi.addr_types.Classify(ndEF->upper_type, ndEF->upper_addr);
+    // Flows store compact addresses; expand them once here for
+    // classification and lookups.
+    const ndAddr lower_addr = ndEF->lower_addr.GetAddr();
+    const ndAddr upper_addr = ndEF->upper_addr.GetAddr();
+
+    ndi.addr_types.Classify(ndEF->lower_type, lower_addr);
+    ndi.addr_types.Classify(ndEF->upper_type, upper_addr);
 
     if (dhc != nullptr && ndEF->GetMasterProtocol() != ND_PROTO_DNS)
     {
         string hostname;
 
         if (ndEF->lower_type == ndAddr::atOTHER)
-            ndEF->flags.dhc_hit = dhc->Lookup(
-              ndEF->lower_addr, hostname);
+            ndEF->flags.dhc_hit = dhc->Lookup(lower_addr, hostname);
 
         if (! ndEF->flags.dhc_hit.load() &&
           ndEF->upper_type == ndAddr::atOTHER)
         {
-            ndEF->flags.dhc_hit = dhc->Lookup(
-              ndEF->upper_addr, hostname);
+            ndEF->flags.dhc_hit = dhc->Lookup(upper_addr, hostname);
         }
 
         if (ndEF->flags.dhc_hit.load()) {
@@ -690,19 +1261,19 @@ void ndDetectionThread::ProcessFlow(ndDetectionQueueEntry *entry) {
     {
         if (ndEF->lower_type == ndAddr::atOTHER) {
             SetDetectedApplication(entry,
-              ndi.apps.Find(ndEF->lower_addr));
+              ndi.apps.Find(lower_addr));
 
             if (ndEF->detected_application == ND_APP_UNKNOWN)
                 SetDetectedApplication(entry,
-                  ndi.apps.Find(ndEF->upper_addr));
+                  ndi.apps.Find(upper_addr));
         }
         else {
             SetDetectedApplication(entry,
-              ndi.apps.Find(ndEF->upper_addr));
+              ndi.apps.Find(upper_addr));
 
             if (ndEF->detected_application == ND_APP_UNKNOWN)
                 SetDetectedApplication(entry,
-                  ndi.apps.Find(ndEF->lower_addr));
+                  ndi.apps.Find(lower_addr));
         }
     }
 
@@ -710,13 +1281,13 @@ void ndDetectionThread::ProcessFlow(ndDetectionQueueEntry *entry) {
     switch (ndEF->GetMasterProtocol()) {
     case ND_PROTO_TLS:
     case ND_PROTO_QUIC:
-        ndEF->ssl.version = ndEFNFP.tls_quic.ssl_version;
-        ndEF->ssl.cipher_suite = ndEFNFP.tls_quic.server_cipher;
+        ndEFM.ssl.version = ndEFNFP.tls_quic.ssl_version;
+        ndEFM.ssl.cipher_suite = ndEFNFP.tls_quic.server_cipher;
 
-        if (ndEF->ssl.server_cn[0] == '\0' &&
+        if (ndEFM.ssl.server_cn[0] == '\0' &&
           ndEFNFP.tls_quic.serverCN != nullptr)
         {
-            nd_set_hostname(ndEF->ssl.server_cn,
+            nd_set_hostname(ndEFM.ssl.server_cn,
               ndEFNFP.tls_quic.serverCN,
               ND_FLOW_TLS_CNLEN);
             free(ndEFNFP.tls_quic.serverCN);
@@ -725,21 +1296,21 @@ void ndDetectionThread::ProcessFlow(ndDetectionQueueEntry *entry) {
             // Detect application by server CN if still unknown.
             if (ndEF->detected_application == ND_APP_UNKNOWN)
                 SetDetectedApplication(entry,
-                  ndi.apps.Find(ndEF->ssl.server_cn));
+                  ndi.apps.Find(ndEFM.ssl.server_cn));
         }
 
-        if (ndEF->ssl.issuer_dn == nullptr &&
+        if (ndEFM.ssl.issuer_dn == nullptr &&
           ndEFNFP.tls_quic.issuerDN != nullptr)
         {
-            ndEF->ssl.issuer_dn = strdup(ndEFNFP.tls_quic.issuerDN);
+            ndEFM.ssl.issuer_dn = strdup(ndEFNFP.tls_quic.issuerDN);
             free(ndEFNFP.tls_quic.issuerDN);
             ndEFNFP.tls_quic.issuerDN = nullptr;
         }
 
-        if (ndEF->ssl.subject_dn == nullptr &&
+        if (ndEFM.ssl.subject_dn == nullptr &&
           ndEFNFP.tls_quic.subjectDN != nullptr)
         {
-            ndEF->ssl.subject_dn = strdup(ndEFNFP.tls_quic.subjectDN);
+            ndEFM.ssl.subject_dn = strdup(ndEFNFP.tls_quic.subjectDN);
             free(ndEFNFP.tls_quic.subjectDN);
             ndEFNFP.tls_quic.subjectDN = nullptr;
         }
@@ -760,34 +1331,34 @@ void ndDetectionThread::ProcessFlow(ndDetectionQueueEntry *entry) {
                 }
             }
 
-            snprintf(ndEF->http.user_agent, ND_FLOW_UA_LEN,
+            snprintf(ndEFM.http.user_agent, ND_FLOW_UA_LEN,
               "%s", ndEFNF->http.user_agent);
         }
 
         if (ndEFNF->http.url != nullptr) {
-            snprintf(ndEF->http.url, ND_FLOW_URL_LEN, "%s",
+            snprintf(ndEFM.http.url, ND_FLOW_URL_LEN, "%s",
               ndEFNF->http.url);
         }
 
         break;
     case ND_PROTO_DHCP:
-        snprintf(ndEF->dhcp.fingerprint, ND_FLOW_DHCPFP_LEN,
+        snprintf(ndEFM.dhcp.fingerprint, ND_FLOW_DHCPFP_LEN,
           "%s", ndEFNFP.dhcp.fingerprint);
-        snprintf(ndEF->dhcp.class_ident, ND_FLOW_DHCPCI_LEN,
+        snprintf(ndEFM.dhcp.class_ident, ND_FLOW_DHCPCI_LEN,
           "%s", ndEFNFP.dhcp.class_ident);
         break;
     case ND_PROTO_SSH:
-        snprintf(ndEF->ssh.client_agent, ND_FLOW_SSH_UALEN,
+        snprintf(ndEFM.ssh.client_agent, ND_FLOW_SSH_UALEN,
           "%s", ndEFNFP.ssh.client_signature);
-        snprintf(ndEF->ssh.server_agent, ND_FLOW_SSH_UALEN,
+        snprintf(ndEFM.ssh.server_agent, ND_FLOW_SSH_UALEN,
           "%s", ndEFNFP.ssh.server_signature);
         break;
     case ND_PROTO_BITTORRENT:
 #if 0
         if (ndEFNFP.bittorrent.hash_valid) {
-            ndEF->bt.info_hash_valid = true;
+            ndEFM.bt.info_hash_valid = true;
             memcpy(
-                ndEF->bt.info_hash,
+                ndEFM.bt.info_hash,
                 ndEFNFP.bittorrent.hash,
                 ND_FLOW_BTIHASH_LEN
             );
@@ -843,7 +1414,8 @@ void ndDetectionThread::ProcessFlow(ndDetectionQueueEntry *entry) {
 
     for (int t = ndFlow::TYPE_LOWER; t < ndFlow::TYPE_MAX; t++)
     {
-        const ndAddr *mac, *ip;
+        ndAddr mac;
+        const ndAddr *ip;
         ndAddr::Type type = ndAddr::atNONE;
 
         if (t == ndFlow::TYPE_LOWER &&
@@ -851,27 +1423,24 @@ void ndDetectionThread::ProcessFlow(ndDetectionQueueEntry *entry) {
             ndEF->lower_type == ndAddr::atLOCALNET ||
             ndEF->lower_type == ndAddr::atRESERVED))
         {
-            ndi.addr_types.Classify(type, ndEF->lower_mac);
-
-            mac = &ndEF->lower_mac;
-            ip = &ndEF->lower_addr;
+            mac = ndEF->lower_mac.GetAddr();
+            ip = &lower_addr;
         }
         else if (t == ndFlow::TYPE_UPPER &&
           (ndEF->upper_type == ndAddr::atLOCAL ||
             ndEF->upper_type == ndAddr::atLOCALNET ||
             ndEF->upper_type == ndAddr::atRESERVED))
         {
-            ndi.addr_types.Classify(type, ndEF->upper_mac);
-
-            mac = &ndEF->upper_mac;
-            ip = &ndEF->upper_addr;
+            mac = ndEF->upper_mac.GetAddr();
+            ip = &upper_addr;
         }
         else continue;
 
-        if (type != ndAddr::atOTHER || mac == nullptr || ip == nullptr)
-            continue;
+        ndi.addr_types.Classify(type, mac);
 
-        ndEF->iface->PushEndpoint(*mac, *ip);
+        if (type != ndAddr::atOTHER) continue;
+
+        ndEF->iface->PushEndpoint(mac, *ip);
     }
 
 #ifdef _ND_USE_CONNTRACK
@@ -914,17 +1483,10 @@ void ndDetectionThread::ProcessFlow(ndDetectionQueueEntry *entry) {
            (ndFlow::PRIVATE_LOWER | ndFlow::PRIVATE_UPPER);
          i++)
     {
-#if defined(__linux__)
-        if (! memcmp((*i), ndEF->lower_mac.addr.ll.sll_addr, ETH_ALEN))
-            ndEF->privacy_mask |= ndFlow::PRIVATE_LOWER;
-        if (! memcmp((*i), ndEF->upper_mac.addr.ll.sll_addr, ETH_ALEN))
-            ndEF->privacy_mask |= ndFlow::PRIVATE_UPPER;
-#elif defined(__FreeBSD__)
-        if (! memcmp((*i), LLADDR(&ndEF->lower_mac.addr.dl), ETH_ALEN))
+        if (! memcmp((*i), ndEF->lower_mac.addr, ETH_ALEN))
             ndEF->privacy_mask |= ndFlow::PRIVATE_LOWER;
-        if (! memcmp((*i), LLADDR(&ndEF->upper_mac.addr.dl), ETH_ALEN))
+        if (! memcmp((*i), ndEF->upper_mac.addr, ETH_ALEN))
             ndEF->privacy_mask |= ndFlow::PRIVATE_UPPER;
-#endif
     }
 
     for (vector<struct sockaddr *>::const_iterator i =
@@ -940,22 +1502,22 @@ void ndDetectionThread::ProcessFlow(ndDetectionQueueEntry *entry) {
         switch ((*i)->sa_family) {
         case AF_INET:
             sa_in = reinterpret_cast<struct sockaddr_in *>((*i));
-            if (! memcmp(&ndEF->lower_addr.addr.in.sin_addr,
+            if (! memcmp(ndEF->lower_addr.addr,
                   &sa_in->sin_addr,
                   sizeof(struct in_addr)))
                 ndEF->privacy_mask |= ndFlow::PRIVATE_LOWER;
-            if (! memcmp(&ndEF->upper_addr.addr.in.sin_addr,
+            if (! memcmp(ndEF->upper_addr.addr,
                   &sa_in->sin_addr,
                   sizeof(struct in_addr)))
                 ndEF->privacy_mask |= ndFlow::PRIVATE_UPPER;
             break;
         case AF_INET6:
             sa_in6 = reinterpret_cast<struct sockaddr_in6 *>((*i));
-            if (! memcmp(&ndEF->lower_addr.addr.in6.sin6_addr,
+            if (! memcmp(ndEF->lower_addr.addr,
                   &sa_in6->sin6_addr,
                   sizeof(struct in6_addr)))
                 ndEF->privacy_mask |= ndFlow::PRIVATE_LOWER;
-            if (! memcmp(&ndEF->upper_addr.addr.in6.sin6_addr,
+            if (! memcmp(ndEF->upper_addr.addr,
                   &sa_in6->sin6_addr,
                   sizeof(struct in6_addr)))
                 ndEF->privacy_mask |= ndFlow::PRIVATE_UPPER;
@@ -996,6 +1558,35 @@ void ndDetectionThread::ProcessRisks(ndDetectionQueueEntry *entry) {
     ndEF->flags.risks_checked = true;
 }
 
+bool ndDetectionThread::SetCachedDetection(
+  ndDetectionQueueEntry *entry) {
+    if (dc == nullptr) return false;
+
+    // Keyed on the host name as parsed by nDPI, before any DNS
+    // hint is applied by ProcessFlow().
+    ndEF->detection_cache_key = ndDetectionCache::MakeKey(*ndEF,
+      (const char *)ndEFNF->host_server_name);
+
+    if (ndEF->detection_cache_key == 0) return false;
+
+    ndDetectionCache::Entry dce;
+
+    if (! dc->Lookup(ndEF->detection_cache_key,
+          ndEF->ts_last_seen.load(), dce))
+        return false;
+
+    ndEF->detected_protocol = dce.protocol;
+    SetDetectedApplication(entry, dce.application);
+
+    ndEF->category.application = dce.category_application;
+    ndEF->category.protocol = dce.category_protocol;
+    ndEF->category.domain = dce.category_domain;
+
+    ndEF->flags.detection_cached = true;
+
+    return true;
+}
+
 void ndDetectionThread::SetDetectedApplication(
   ndDetectionQueueEntry *entry, nd_app_id_t app_id) {
     if (app_id == ND_APP_UNKNOWN) return;
@@ -1010,7 +1601,9 @@ void ndDetectionThread::SetDetectedApplication(
 void ndDetectionThread::SetGuessedProtocol(
   ndDetectionQueueEntry *entry) {
     uint8_t guessed = 0;
-    ndpi_protocol ndpi_rc = ndpi_detection_giveup(ndpi,
+    ndNDPIModule *module = (ndEFNF != nullptr) ?
+      ndNDPIFlowPool::GetModule(ndEFNF) : ndpi_module;
+    ndpi_protocol ndpi_rc = ndpi_detection_giveup(module->Get(),
       ndEFNF, 1, &guessed);
 
     if (guessed) {
@@ -1036,6 +1629,25 @@ void ndDetectionThread::SetDetectionComplete(
         ProcessRisks(entry);
 
     FlowUpdate(entry);
+
+    // Cache what was detected, for later flows to the same
+    // server.  Guesses are never cached.
+    if (ndEF->detection_cache_key != 0 &&
+      ndEF->flags.detection_cached.load() == false &&
+      ndEF->flags.detection_guessed.load() == false &&
+      ndEF->detected_protocol != ND_PROTO_UNKNOWN)
+    {
+        ndDetectionCache::Entry dce;
+
+        dce.key = ndEF->detection_cache_key;
+        dce.protocol = ndEF->detected_protocol;
+        dce.application = ndEF->detected_application;
+        dce.category_application = ndEF->category.application;
+        dce.category_protocol = ndEF->category.protocol;
+        dce.category_domain = ndEF->category.domain;
+
+        dc->Insert(dce, ndEF->ts_last_seen.load());
+    }
 }
 
 void ndDetectionThread::FlowUpdate(ndDetectionQueueEntry *entry) {
@@ -0,0 +1,138 @@
+// Netify Agent
+// Copyright (C) 2015-2023 eGloo Incorporated
+// <http://www.egloo.ca>
+//
+// This program is free software: you can redistribute it
+// and/or modify it under the terms of the GNU General
+// Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your
+// option) any later version.
+//
+// This program is distributed in the hope that it will be
+// useful, but WITHOUT ANY WARRANTY; without even the
+// implied warranty of MERCHANTABILITY or FITNESS FOR A
+// PARTICULAR PURPOSE.  See the GNU General Public License
+// for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this program.  If not, see
+// <http://www.gnu.org/licenses/>.
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <algorithm>
+
+#include "nd-flow-admit.hpp"
+#include "nd-hash.hpp"
+#include "netifyd.hpp"
+
+// Count of a sketch counter in the given window.  Capture
+// threads' clocks may differ slightly, so a counter already
+// moved on to a later window is taken as current.
+static inline uint32_t nd_flow_admit_count(uint64_t counter,
+  uint32_t window) {
+    if ((uint32_t)(counter >> 32) < window) return 0;
+    return (uint32_t)counter;
+}
+
+ndFlowAdmission::ndFlowAdmission(unsigned rate) : rate(rate) {
+    for (unsigned d = 0; d < _ND_FLOW_ADMIT_DEPTH; d++) {
+        for (unsigned w = 0; w < _ND_FLOW_ADMIT_WIDTH; w++)
+            counters[d][w] = 0;
+    }
+
+    for (unsigned w = 0; w < _ND_FLOW_ADMIT_WIDTH; w++) seen[w] = 0;
+
+    offenders.reserve(ND_FLOW_ADMIT_OFFENDERS);
+}
+
+bool ndFlowAdmission::Admit(const ndFlowAddr &addr, time_t now) {
+    uint32_t window = (uint32_t)now;
+    uint64_t digest[2];
+    nd_hash128(addr.GetAddress(), addr.GetAddressSize(),
+      nd_hash_key(), digest);
+
+    size_t index[_ND_FLOW_ADMIT_DEPTH];
+    uint32_t estimate = UINT32_MAX;
+
+    for (unsigned d = 0; d < _ND_FLOW_ADMIT_DEPTH; d++) {
+        index[d] = (size_t)(digest[0] + d * digest[1]) &
+          _ND_FLOW_ADMIT_MASK;
+        estimate = min(estimate,
+          nd_flow_admit_count(
+            counters[d][index[d]].load(memory_order_relaxed),
+            window));
+    }
+
+    // Conservative update: only raise the smallest counters.  A
+    // counter left over from an earlier window restarts at one.
+    for (unsigned d = 0; d < _ND_FLOW_ADMIT_DEPTH; d++) {
+        uint64_t counter =
+          counters[d][index[d]].load(memory_order_relaxed);
+
+        while (nd_flow_admit_count(counter, window) == estimate) {
+            uint64_t tag = max((uint32_t)(counter >> 32), window);
+            if (counters[d][index[d]].compare_exchange_weak(counter,
+                  (tag << 32) | (estimate + 1), memory_order_relaxed))
+                break;
+        }
+    }
+
+    if (++estimate <= rate) return true;
+
+    // Record the source once per window: only the thread which
+    // tags the source's seen slot with this window does so.
+    uint32_t last = seen[index[0]].load(memory_order_relaxed);
+    if (last < window &&
+      seen[index[0]].compare_exchange_strong(last, window,
+        memory_order_relaxed))
+        AddOffender(addr);
+
+    return false;
+}
+
+void ndFlowAdmission::GetOffenders(
+  vector<ndFlowAdmissionOffender> &offenders) {
+    lock_guard<mutex> ul(offenders_lock);
+
+    offenders.clear();
+    offenders.swap(this->offenders);
+    this->offenders.reserve(ND_FLOW_ADMIT_OFFENDERS);
+
+    sort(offenders.begin(), offenders.end(),
+      [](const ndFlowAdmissionOffender &a,
+        const ndFlowAdmissionOffender &b) {
+          return a.windows > b.windows;
+      });
+}
+
+void ndFlowAdmission::AddOffender(const ndFlowAddr &addr) {
+    ndFlowAddr source(addr);
+    source.SetPort(0);
+
+    lock_guard<mutex> ul(offenders_lock);
+
+    auto lightest = offenders.end();
+
+    for (auto i = offenders.begin(); i != offenders.end(); i++) {
+        if (i->addr == source) {
+            i->windows++;
+            return;
+        }
+        if (lightest == offenders.end() ||
+          i->windows < lightest->windows)
+            lightest = i;
+    }
+
+    if (offenders.size() < ND_FLOW_ADMIT_OFFENDERS) {
+        offenders.push_back({ source, 1 });
+        return;
+    }
+
+    // Table full; the newcomer replaces the lightest entry and
+    // inherits its count (an upper bound on its own).
+    lightest->addr = source;
+    lightest->windows++;
+}
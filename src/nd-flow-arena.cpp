@@ -0,0 +1,148 @@
+// Netify Agent
+// Copyright (C) 2015-2023 eGloo Incorporated
+// <http://www.egloo.ca>
+//
+// This program is free software: you can redistribute it
+// and/or modify it under the terms of the GNU General
+// Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your
+// option) any later version.
+//
+// This program is distributed in the hope that it will be
+// useful, but WITHOUT ANY WARRANTY; without even the
+// implied warranty of MERCHANTABILITY or FITNESS FOR A
+// PARTICULAR PURPOSE.  See the GNU General Public License
+// for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this program.  If not, see
+// <http://www.gnu.org/licenses/>.
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <cerrno>
+#include <cstdlib>
+
+#include "nd-except.hpp"
+#include "nd-flow-arena.hpp"
+#include "nd-flow.hpp"
+#include "nd-util.hpp"
+
+static_assert(alignof(ndFlow) <= 16,
+  "ndFlow alignment exceeds arena object alignment");
+
+static inline ndFlowArenaObject *nd_flow_arena_object(ndFlow *flow) {
+    return reinterpret_cast<ndFlowArenaObject *>(
+      reinterpret_cast<uint8_t *>(flow) - _ND_FLOW_ARENA_HDR_SIZE);
+}
+
+static inline ndFlow *nd_flow_arena_flow(ndFlowArenaObject *object) {
+    return reinterpret_cast<ndFlow *>(
+      reinterpret_cast<uint8_t *>(object) + _ND_FLOW_ARENA_HDR_SIZE);
+}
+
+ndFlowArena::ndFlowArena(const string &tag)
+  : tag(tag), refs(1), returned(nullptr), free_list(nullptr),
+    object_size(
+      (_ND_FLOW_ARENA_HDR_SIZE + sizeof(ndFlow) + 63) & ~((size_t)63)),
+    allocs(0), hits(0) { }
+
+ndFlowArena::~ndFlowArena() {
+    for (auto &slab : slabs) free(slab);
+
+    nd_dprintf("%s: flow arena destroyed, %lu slab(s), "
+               "%lu allocations, %lu recycled.\n",
+      tag.c_str(), slabs.size(), allocs, hits);
+}
+
+nd_flow_ptr ndFlowArena::Create(const ndFlow &flow) {
+    if (free_list == nullptr) Reclaim();
+
+    if (free_list == nullptr) Grow();
+    else hits++;
+
+    ndFlowArenaObject *object = free_list;
+    free_list = object->next;
+
+    try {
+        new (nd_flow_arena_flow(object)) ndFlow(flow);
+    }
+    catch (...) {
+        object->next = free_list;
+        free_list = object;
+        throw;
+    }
+
+    object->next = nullptr;
+    object->refs.store(1, memory_order_relaxed);
+
+    allocs++;
+    refs.fetch_add(1, memory_order_relaxed);
+
+    return nd_flow_ptr(nd_flow_arena_flow(object));
+}
+
+void ndFlowArena::Free(ndFlow *flow) {
+    ndFlowArenaObject *object = nd_flow_arena_object(flow);
+    ndFlowArena *arena = object->arena;
+
+    flow->~ndFlow();
+
+    ndFlowArenaObject *head = arena->returned.load(
+      memory_order_relaxed);
+    do {
+        object->next = head;
+    }
+    while (! arena->returned.compare_exchange_weak(head, object,
+      memory_order_release, memory_order_relaxed));
+
+    if (arena->refs.fetch_sub(1, memory_order_acq_rel) == 1)
+        delete arena;
+}
+
+void ndFlowArena::Release(void) {
+    if (refs.fetch_sub(1, memory_order_acq_rel) == 1) delete this;
+}
+
+void ndFlowArena::Reclaim(void) {
+    ndFlowArenaObject *object = returned.exchange(nullptr,
+      memory_order_acquire);
+
+    while (object != nullptr) {
+        ndFlowArenaObject *next = object->next;
+        object->next = free_list;
+        free_list = object;
+        object = next;
+    }
+}
+
+void ndFlowArena::Grow(void) {
+    void *slab = nullptr;
+    if (posix_memalign(&slab, 64,
+          object_size * ND_FLOW_ARENA_SLAB_FLOWS) != 0)
+    {
+        throw ndSystemException(__PRETTY_FUNCTION__,
+          "posix_memalign", ENOMEM);
+    }
+
+    try {
+        slabs.push_back(slab);
+    }
+    catch (...) {
+        free(slab);
+        throw;
+    }
+
+    uint8_t *base = static_cast<uint8_t *>(slab);
+    for (size_t i = ND_FLOW_ARENA_SLAB_FLOWS; i > 0; i--) {
+        ndFlowArenaObject *object = new (base + (i - 1) * object_size)
+          ndFlowArenaObject;
+        object->refs.store(0, memory_order_relaxed);
+        object->arena = this;
+        object->next = free_list;
+        free_list = object;
+    }
+}
@@ -3669,7 +3669,7 @@ yyreduce:
   case 186: /* expr_ssl_version: FLOW_SSL_VERSION  */
 #line 1407 "nd-flow-expr.ypp"
                        {
-        _NDFP_result = ((yyval.bool_result) = (_NDFP_flow->ssl.version != 0));
+        _NDFP_result = ((yyval.bool_result) = (_NDFP_flow->GetTLSVersion() != 0));
         _NDFP_debugf("SSL version set? %s\n", (_NDFP_result) ? "yes" : "no");
     }
 #line 3676 "nd-flow-expr.cpp"
@@ -3678,7 +3678,7 @@ yyreduce:
   case 187: /* expr_ssl_version: '!' FLOW_SSL_VERSION  */
 #line 1411 "nd-flow-expr.ypp"
                            {
-        _NDFP_result = ((yyval.bool_result) = (_NDFP_flow->ssl.version == 0));
+        _NDFP_result = ((yyval.bool_result) = (_NDFP_flow->GetTLSVersion() == 0));
         _NDFP_debugf("SSL version not set? %s\n", (_NDFP_result) ? "yes" : "no");
     }
 #line 3685 "nd-flow-expr.cpp"
@@ -3687,7 +3687,7 @@ yyreduce:
   case 188: /* expr_ssl_version: FLOW_SSL_VERSION CMP_EQUAL VALUE_NUMBER  */
 #line 1415 "nd-flow-expr.ypp"
                                               {
-        _NDFP_result = ((yyval.bool_result) = (_NDFP_flow->ssl.version == (yyvsp[0].ul_number)));
+        _NDFP_result = ((yyval.bool_result) = (_NDFP_flow->GetTLSVersion() == (yyvsp[0].ul_number)));
         _NDFP_debugf("SSL version == %lu? %s\n", (yyvsp[0].ul_number), (_NDFP_result) ? "yes" : "no");
     }
 #line 3694 "nd-flow-expr.cpp"
@@ -3696,7 +3696,7 @@ yyreduce:
   case 189: /* expr_ssl_version: FLOW_SSL_VERSION CMP_NOTEQUAL VALUE_NUMBER  */
 #line 1419 "nd-flow-expr.ypp"
                                                  {
-        _NDFP_result = ((yyval.bool_result) = (_NDFP_flow->ssl.version != (yyvsp[0].ul_number)));
+        _NDFP_result = ((yyval.bool_result) = (_NDFP_flow->GetTLSVersion() != (yyvsp[0].ul_number)));
         _NDFP_debugf("SSL version != %lu? %s\n", (yyvsp[0].ul_number), (_NDFP_result) ? "yes" : "no");
     }
 #line 3703 "nd-flow-expr.cpp"
@@ -3705,7 +3705,7 @@ yyreduce:
   case 190: /* expr_ssl_version: FLOW_SSL_VERSION CMP_GTHANEQUAL VALUE_NUMBER  */
 #line 1423 "nd-flow-expr.ypp"
                                                    {
-        _NDFP_result = ((yyval.bool_result) = (_NDFP_flow->ssl.version >= (yyvsp[0].ul_number)));
+        _NDFP_result = ((yyval.bool_result) = (_NDFP_flow->GetTLSVersion() >= (yyvsp[0].ul_number)));
         _NDFP_debugf("SSL version >= %lu? %s\n", (yyvsp[0].ul_number), (_NDFP_result) ? "yes" : "no");
     }
 #line 3712 "nd-flow-expr.cpp"
@@ -3714,7 +3714,7 @@ yyreduce:
   case 191: /* expr_ssl_version: FLOW_SSL_VERSION CMP_LTHANEQUAL VALUE_NUMBER  */
 #line 1427 "nd-flow-expr.ypp"
                                                    {
-        _NDFP_result = ((yyval.bool_result) = (_NDFP_flow->ssl.version <= (yyvsp[0].ul_number)));
+        _NDFP_result = ((yyval.bool_result) = (_NDFP_flow->GetTLSVersion() <= (yyvsp[0].ul_number)));
         _NDFP_debugf("SSL version <= %lu? %s\n", (yyvsp[0].ul_number), (_NDFP_result) ? "yes" : "no");
     }
 #line 3721 "nd-flow-expr.cpp"
@@ -3723,7 +3723,7 @@ yyreduce:
   case 192: /* expr_ssl_version: FLOW_SSL_VERSION '>' VALUE_NUMBER  */
 #line 1431 "nd-flow-expr.ypp"
                                         {
-        _NDFP_result = ((yyval.bool_result) = (_NDFP_flow->ssl.version > (yyvsp[0].ul_number)));
+        _NDFP_result = ((yyval.bool_result) = (_NDFP_flow->GetTLSVersion() > (yyvsp[0].ul_number)));
         _NDFP_debugf("SSL version > %lu? %s\n", (yyvsp[0].ul_number), (_NDFP_result) ? "yes" : "no");
     }
 #line 3730 "nd-flow-expr.cpp"
@@ -3732,7 +3732,7 @@ yyreduce:
   case 193: /* expr_ssl_version: FLOW_SSL_VERSION '<' VALUE_NUMBER  */
 #line 1435 "nd-flow-expr.ypp"
                                         {
-        _NDFP_result = ((yyval.bool_result) = (_NDFP_flow->ssl.version < (yyvsp[0].ul_number)));
+        _NDFP_result = ((yyval.bool_result) = (_NDFP_flow->GetTLSVersion() < (yyvsp[0].ul_number)));
         _NDFP_debugf("SSL version < %lu? %s\n", (yyvsp[0].ul_number), (_NDFP_result) ? "yes" : "no");
     }
 #line 3739 "nd-flow-expr.cpp"
@@ -3741,7 +3741,7 @@ yyreduce:
   case 194: /* expr_ssl_cipher: FLOW_SSL_CIPHER  */
 #line 1442 "nd-flow-expr.ypp"
                       {
-        _NDFP_result = ((yyval.bool_result) = (_NDFP_flow->ssl.cipher_suite != 0));
+        _NDFP_result = ((yyval.bool_result) = (_NDFP_flow->GetTLSCipherSuite() != 0));
         _NDFP_debugf("SSL cipher suite set? %s\n", (_NDFP_result) ? "yes" : "no");
     }
 #line 3748 "nd-flow-expr.cpp"
@@ -3750,7 +3750,7 @@ yyreduce:
   case 195: /* expr_ssl_cipher: '!' FLOW_SSL_CIPHER  */
 #line 1446 "nd-flow-expr.ypp"
                           {
-        _NDFP_result = ((yyval.bool_result) = (_NDFP_flow->ssl.cipher_suite == 0));
+        _NDFP_result = ((yyval.bool_result) = (_NDFP_flow->GetTLSCipherSuite() == 0));
         _NDFP_debugf("SSL cipher suite not set? %s\n", (_NDFP_result) ? "yes" : "no");
     }
 #line 3757 "nd-flow-expr.cpp"
@@ -3759,7 +3759,7 @@ yyreduce:
   case 196: /* expr_ssl_cipher: FLOW_SSL_CIPHER CMP_EQUAL VALUE_NUMBER  */
 #line 1450 "nd-flow-expr.ypp"
                                              {
-        _NDFP_result = ((yyval.bool_result) = (_NDFP_flow->ssl.cipher_suite == (yyvsp[0].ul_number)));
+        _NDFP_result = ((yyval.bool_result) = (_NDFP_flow->GetTLSCipherSuite() == (yyvsp[0].ul_number)));
         _NDFP_debugf("SSL cipher suite == %lu? %s\n", (yyvsp[0].ul_number), (_NDFP_result) ? "yes" : "no");
     }
 #line 3766 "nd-flow-expr.cpp"
@@ -3768,7 +3768,7 @@ yyreduce:
   case 197: /* expr_ssl_cipher: FLOW_SSL_CIPHER CMP_NOTEQUAL VALUE_NUMBER  */
 #line 1454 "nd-flow-expr.ypp"
                                                 {
-        _NDFP_result = ((yyval.bool_result) = (_NDFP_flow->ssl.cipher_suite != (yyvsp[0].ul_number)));
+        _NDFP_result = ((yyval.bool_result) = (_NDFP_flow->GetTLSCipherSuite() != (yyvsp[0].ul_number)));
         _NDFP_debugf("SSL cipher suite != %lu? %s\n", (yyvsp[0].ul_number), (_NDFP_result) ? "yes" : "no");
     }
 #line 3775 "nd-flow-expr.cpp"
@@ -3777,7 +3777,7 @@ yyreduce:
   case 198: /* expr_ssl_cipher: FLOW_SSL_CIPHER CMP_GTHANEQUAL VALUE_NUMBER  */
 #line 1458 "nd-flow-expr.ypp"
                                                   {
-        _NDFP_result = ((yyval.bool_result) = (_NDFP_flow->ssl.cipher_suite >= (yyvsp[0].ul_number)));
+        _NDFP_result = ((yyval.bool_result) = (_NDFP_flow->GetTLSCipherSuite() >= (yyvsp[0].ul_number)));
         _NDFP_debugf("SSL cipher suite >= %lu? %s\n", (yyvsp[0].ul_number), (_NDFP_result) ? "yes" : "no");
     }
 #line 3784 "nd-flow-expr.cpp"
@@ -3786,7 +3786,7 @@ yyreduce:
   case 199: /* expr_ssl_cipher: FLOW_SSL_CIPHER CMP_LTHANEQUAL VALUE_NUMBER  */
 #line 1462 "nd-flow-expr.ypp"
                                                   {
-        _NDFP_result = ((yyval.bool_result) = (_NDFP_flow->ssl.cipher_suite <= (yyvsp[0].ul_number)));
+        _NDFP_result = ((yyval.bool_result) = (_NDFP_flow->GetTLSCipherSuite() <= (yyvsp[0].ul_number)));
         _NDFP_debugf("SSL cipher suite <= %lu? %s\n", (yyvsp[0].ul_number), (_NDFP_result) ? "yes" : "no");
     }
 #line 3793 "nd-flow-expr.cpp"
@@ -3795,7 +3795,7 @@ yyreduce:
   case 200: /* expr_ssl_cipher: FLOW_SSL_CIPHER '>' VALUE_NUMBER  */
 #line 1466 "nd-flow-expr.ypp"
                                        {
-        _NDFP_result = ((yyval.bool_result) = (_NDFP_flow->ssl.cipher_suite > (yyvsp[0].ul_number)));
+        _NDFP_result = ((yyval.bool_result) = (_NDFP_flow->GetTLSCipherSuite() > (yyvsp[0].ul_number)));
         _NDFP_debugf("SSL cipher suite > %lu? %s\n", (yyvsp[0].ul_number), (_NDFP_result) ? "yes" : "no");
     }
 #line 3802 "nd-flow-expr.cpp"
@@ -3804,7 +3804,7 @@ yyreduce:
   case 201: /* expr_ssl_cipher: FLOW_SSL_CIPHER '<' VALUE_NUMBER  */
 #line 1470 "nd-flow-expr.ypp"
                                        {
-        _NDFP_result = ((yyval.bool_result) = (_NDFP_flow->ssl.cipher_suite < (yyvsp[0].ul_number)));
+        _NDFP_result = ((yyval.bool_result) = (_NDFP_flow->GetTLSCipherSuite() < (yyvsp[0].ul_number)));
         _NDFP_debugf("SSL cipher suite < %lu? %s\n", (yyvsp[0].ul_number), (_NDFP_result) ? "yes" : "no");
     }
 #line 3811 "nd-flow-expr.cpp"
@@ -4067,8 +4067,7 @@ yyreturnlab:
 
 
 ndFlowParser::ndFlowParser()
-    : flow(NULL), local_mac{}, other_mac{},
-    local_ip(NULL), other_ip(NULL), local_port(0), other_port(0),
+    : flow(NULL), local_port(0), other_port(0),
     origin(0), expr_result(false), scanner(NULL)
 {
     yyscan_t scanner;
@@ -4092,11 +4091,11 @@ bool ndFlowParser::Parse(nd_flow_ptr const& flow, const string &expr)
 
     switch (flow->lower_map) {
     case ndFlow::LOWER_LOCAL:
-        local_mac = flow->lower_mac.GetString().c_str();
-        other_mac = flow->upper_mac.GetString().c_str();
+        local_mac = flow->lower_mac.GetString();
+        other_mac = flow->upper_mac.GetString();
 
-        local_ip = &flow->lower_addr;
-        other_ip = &flow->upper_addr;
+        local_ip = flow->lower_addr.GetAddr();
+        other_ip = flow->upper_addr.GetAddr();
 
         local_port = flow->lower_addr.GetPort();
         other_port = flow->upper_addr.GetPort();
@@ -4113,11 +4112,11 @@ bool ndFlowParser::Parse(nd_flow_ptr const& flow, const string &expr)
         }
         break;
     case ndFlow::LOWER_OTHER:
-        local_mac = flow->upper_mac.GetString().c_str();
-        other_mac = flow->lower_mac.GetString().c_str();
+        local_mac = flow->upper_mac.GetString();
+        other_mac = flow->lower_mac.GetString();
 
-        local_ip = &flow->upper_addr;
-        other_ip = &flow->lower_addr;
+        local_ip = flow->upper_addr.GetAddr();
+        other_ip = flow->lower_addr.GetAddr();
 
         local_port = flow->upper_addr.GetPort();
         other_port = flow->lower_addr.GetPort();
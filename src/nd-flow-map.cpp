@@ -22,124 +22,530 @@
 #include "config.h"
 #endif
 
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <new>
+#include <thread>
+
 #include "nd-except.hpp"
 #include "nd-flow-map.hpp"
 
-ndFlowMap::ndFlowMap(size_t buckets) : buckets(buckets) {
-    for (size_t i = 0; i < buckets; i++) {
-        nd_flow_map *b = new nd_flow_map;
+// Maximum number of threads that may concurrently access the
+// flow map (capture, detection, plugins and the instance).
+#define _ND_FLOW_MAP_READERS 256
+
+// Entries are reclaimable once the global epoch has advanced
+// twice past the epoch they were retired in.
+#define _ND_FLOW_MAP_GRACE 2
+
+struct alignas(64) ndFlowMapEpochReader {
+    atomic<uint64_t> epoch;  // 0: not in a critical section
+    atomic<bool> used;
+};
+
+static atomic<uint64_t> nd_flow_map_epoch(1);
+static ndFlowMapEpochReader nd_flow_map_readers[_ND_FLOW_MAP_READERS];
+
+class ndFlowMapEpochThread
+{
+public:
+    ndFlowMapEpochThread() : reader(nullptr), depth(0) {
+        for (auto &r : nd_flow_map_readers) {
+            bool expected = false;
+            if (! r.used.compare_exchange_strong(expected, true))
+                continue;
+            reader = &r;
+            break;
+        }
+
+        if (reader == nullptr) {
+            throw ndSystemException(__PRETTY_FUNCTION__,
+              "epoch reader", EAGAIN);
+        }
+    }
+
+    virtual ~ndFlowMapEpochThread() {
+        reader->epoch.store(0);
+        reader->used.store(false);
+    }
+
+    ndFlowMapEpochReader *reader;
+    unsigned depth;
+};
+
+static thread_local ndFlowMapEpochThread nd_flow_map_epoch_thread;
+
+void ndFlowMapEpoch::Enter(void) {
+    ndFlowMapEpochThread &t = nd_flow_map_epoch_thread;
+    if (t.depth++ > 0) return;
+
+    // Re-check after publishing: the global epoch may have
+    // advanced before our announcement became visible.
+    uint64_t epoch = nd_flow_map_epoch.load();
+    for (;;) {
+        t.reader->epoch.store(epoch);
+        atomic_thread_fence(memory_order_seq_cst);
+        uint64_t current = nd_flow_map_epoch.load();
+        if (current == epoch) break;
+        epoch = current;
+    }
+}
+
+void ndFlowMapEpoch::Exit(void) {
+    ndFlowMapEpochThread &t = nd_flow_map_epoch_thread;
+    if (--t.depth > 0) return;
+
+    t.reader->epoch.store(0, memory_order_release);
+}
+
+uint64_t ndFlowMapEpoch::Current(void) {
+    return nd_flow_map_epoch.load();
+}
+
+bool ndFlowMapEpoch::TryAdvance(void) {
+    uint64_t epoch = nd_flow_map_epoch.load();
+
+    for (auto &r : nd_flow_map_readers) {
+        uint64_t e = r.epoch.load();
+        if (e != 0 && e != epoch) return false;
+    }
+
+    return nd_flow_map_epoch.compare_exchange_strong(epoch,
+      epoch + 1);
+}
+
+ndFlowMapTable *ndFlowMapTable::Create(size_t capacity) {
+    ndFlowMapTable *t = new ndFlowMapTable;
+    if (t == nullptr) {
+        throw ndSystemException(__PRETTY_FUNCTION__,
+          "new ndFlowMapTable", ENOMEM);
+    }
+
+    void *slots = nullptr;
+    if (posix_memalign(&slots, 64,
+          sizeof(ndFlowMapSlot) * capacity) != 0)
+    {
+        delete t;
+        throw ndSystemException(__PRETTY_FUNCTION__,
+          "posix_memalign", ENOMEM);
+    }
+
+    t->capacity = capacity;
+    t->threshold = capacity - (capacity / 4);
+    t->used = 0;
+    t->slots = static_cast<ndFlowMapSlot *>(slots);
+
+    for (size_t i = 0; i < capacity; i++) {
+        ndFlowMapSlot *slot = new (&t->slots[i]) ndFlowMapSlot;
+        slot->tag.store(0, memory_order_relaxed);
+        slot->entry.store(nullptr, memory_order_relaxed);
+    }
+
+    return t;
+}
+
+void ndFlowMapTable::Destroy(void *table) {
+    ndFlowMapTable *t = static_cast<ndFlowMapTable *>(table);
+
+    free(t->slots);
+    delete t;
+}
+
+ndFlowMapBucket::ndFlowMapBucket(ndFlowMap *map, size_t capacity)
+  : map(map), table(ndFlowMapTable::Create(capacity)), count(0),
+    generation(0), writers(0), frozen(false) { }
+
+ndFlowMapBucket::~ndFlowMapBucket() {
+    ndFlowMapTable *t = table.load();
+
+    for (size_t i = 0; i < t->capacity; i++) {
+        nd_flow_pair *e = t->slots[i].entry.load();
+        if (e != nullptr && e != _ND_FLOW_MAP_TOMBSTONE) delete e;
+    }
+
+    ndFlowMapTable::Destroy(t);
+}
+
+ndFlowMapBucket::iterator ndFlowMapBucket::erase(iterator i) {
+    ndFlowMapTable *t = table.load(memory_order_acquire);
+    nd_flow_pair *e = t->slots[i.index].entry.exchange(
+      _ND_FLOW_MAP_TOMBSTONE);
+
+    if (e != nullptr && e != _ND_FLOW_MAP_TOMBSTONE) {
+        count--;
+        generation++;
+        map->Retire(e, ndFlowMap::DestroyEntry);
+    }
+
+    return ++i;
+}
+
+ndFlowMap::ndFlowMap(size_t buckets, size_t shards)
+  : buckets(buckets), shards(shards), shard_used(shards + 1, false) {
+    // Shard 0 is always in use (shared)
+    shard_used[0] = true;
+
+    for (size_t i = 0; i < buckets * (shards + 1); i++) {
+        nd_flow_map *b = new nd_flow_map(this, ND_FLOW_MAP_SLOTS);
         if (b == NULL)
             throw ndSystemException(__PRETTY_FUNCTION__,
               "new nd_flow_map", ENOMEM);
-#ifdef HAVE_CXX11
-        b->reserve(ND_HASH_BUCKETS_FLOWS);
-#endif
         bucket.push_back(b);
-        bucket_lock.emplace_back(new mutex);
     }
 
-    nd_dprintf("Created %lu flow map buckets.\n", buckets);
+    nd_dprintf("Created %lu flow map buckets, %lu shard(s).\n",
+      buckets, shards + 1);
 }
 
 ndFlowMap::~ndFlowMap() {
-    for (size_t i = 0; i < buckets; i++) {
-        lock_guard<mutex> lock(*bucket_lock[i]);
-
-        delete bucket[i];
-    }
+    for (size_t i = 0; i < bucket.size(); i++) delete bucket[i];
 
     bucket.clear();
-    bucket_lock.clear();
+
+    Reclaim(true);
+}
+
+nd_flow_ptr ndFlowMap::Lookup(const ndFlowKey &key,
+  bool acquire_lock, unsigned shard) {
+    ndFlowMapEpochGuard epoch;
+
+    nd_flow_pair *e = Find(key, shard);
+    if (e != nullptr) return e->second;
+
+    return nullptr;
 }
 
-nd_flow_ptr
-ndFlowMap::Lookup(const string &digest, bool acquire_lock) {
-    nd_flow_ptr f;
-    size_t b = HashToBucket(digest);
+nd_flow_pair *ndFlowMap::Find(const ndFlowKey &key,
+  unsigned shard) const {
+    const ndFlowMapBucket *b = bucket[HashToBucket(key, shard)];
+    const ndFlowMapTable *t = b->table.load(memory_order_acquire);
 
-    bucket_lock[b]->lock();
+    const uint32_t tag = ndFlowMapTable::Tag(key);
+    const size_t mask = t->capacity - 1;
+    size_t index = t->Index(key);
 
-    auto fi = bucket[b]->find(digest);
-    if (fi != bucket[b]->end()) f = fi->second;
+    for (size_t n = 0; n < t->capacity; n++) {
+        const ndFlowMapSlot &slot = t->slots[index];
+        index = (index + 1) & mask;
 
-    if (! acquire_lock) bucket_lock[b]->unlock();
+        nd_flow_pair *e = slot.entry.load(memory_order_acquire);
+        if (e == nullptr) break;
+        if (e == _ND_FLOW_MAP_TOMBSTONE) continue;
 
-    return f;
+        uint32_t et = slot.tag.load(memory_order_relaxed);
+        if (et != 0 && et != tag) continue;
+
+        if (e->first == key) return e;
+    }
+
+    return nullptr;
 }
 
-bool ndFlowMap::Insert(const string &digest,
-  nd_flow_ptr &flow, bool unlocked) {
-    bool result = false;
-    size_t b = HashToBucket(digest);
+bool ndFlowMap::Insert(const ndFlowKey &key,
+  nd_flow_ptr &flow, bool unlocked, unsigned shard) {
+    ndFlowMapEpochGuard epoch;
+    ndFlowMapBucket *b = bucket[HashToBucket(key, shard)];
 
-    if (! unlocked) bucket_lock[b]->lock();
+    unique_ptr<nd_flow_pair> entry(new nd_flow_pair(key, flow));
+    if (! entry) {
+        throw ndSystemException(__PRETTY_FUNCTION__,
+          "new nd_flow_pair", ENOMEM);
+    }
+
+    const uint32_t tag = ndFlowMapTable::Tag(key);
 
-    nd_flow_pair fp(digest, flow);
-    nd_flow_insert fi = bucket[b]->insert(fp);
+    for (;;) {
+        b->writers.fetch_add(1);
 
-    result = fi.second;
+        if (b->frozen.load()) {
+            b->writers.fetch_sub(1);
+            while (b->frozen.load()) this_thread::yield();
+            continue;
+        }
 
-    if (! unlocked) bucket_lock[b]->unlock();
+        ndFlowMapTable *t = b->table.load(memory_order_acquire);
 
-    return result;
+        if (t->used.load() >= t->threshold) {
+            b->writers.fetch_sub(1);
+            Grow(b, t);
+            continue;
+        }
+
+        const size_t mask = t->capacity - 1;
+        size_t index = t->Index(key);
+
+        for (size_t n = 0; n < t->capacity; n++) {
+            ndFlowMapSlot &slot = t->slots[index];
+            index = (index + 1) & mask;
+
+            nd_flow_pair *e = slot.entry.load(memory_order_acquire);
+
+            if (e == nullptr) {
+                if (slot.entry.compare_exchange_strong(e, entry.get(),
+                      memory_order_acq_rel, memory_order_acquire))
+                {
+                    entry.release();
+                    slot.tag.store(tag, memory_order_relaxed);
+                    t->used++;
+                    b->count++;
+                    b->writers.fetch_sub(1);
+                    return true;
+                }
+                // Lost the slot; e is now the winning entry.
+            }
+
+            if (e == _ND_FLOW_MAP_TOMBSTONE) continue;
+
+            uint32_t et = slot.tag.load(memory_order_relaxed);
+            if (et != 0 && et != tag) continue;
+
+            if (e->first == key) {
+                b->writers.fetch_sub(1);
+                return false;
+            }
+        }
+
+        // Table is full (of live entries and tombstones).
+        b->writers.fetch_sub(1);
+        Grow(b, t);
+    }
 }
 
-bool ndFlowMap::Delete(const string &digest) {
-    bool deleted = false;
-    size_t b = HashToBucket(digest);
-    lock_guard<mutex> lock(*bucket_lock[b]);
+bool ndFlowMap::Delete(const ndFlowKey &key, unsigned shard,
+  const ndFlow *flow) {
+    ndFlowMapEpochGuard epoch;
+    ndFlowMapBucket *b = bucket[HashToBucket(key, shard)];
+    lock_guard<mutex> lock(b->lock);
+
+    ndFlowMapTable *t = b->table.load(memory_order_acquire);
+
+    const uint32_t tag = ndFlowMapTable::Tag(key);
+    const size_t mask = t->capacity - 1;
+    size_t index = t->Index(key);
+
+    for (size_t n = 0; n < t->capacity; n++) {
+        ndFlowMapSlot &slot = t->slots[index];
+        index = (index + 1) & mask;
 
-    auto fi = bucket[b]->find(digest);
-    if (fi != bucket[b]->end()) {
-        deleted = true;
-        bucket[b]->erase(fi);
+        nd_flow_pair *e = slot.entry.load(memory_order_acquire);
+        if (e == nullptr) break;
+        if (e == _ND_FLOW_MAP_TOMBSTONE) continue;
+
+        uint32_t et = slot.tag.load(memory_order_relaxed);
+        if (et != 0 && et != tag) continue;
+
+        if (e->first == key) {
+            if (flow != nullptr && e->second.get() != flow)
+                return false;
+
+            slot.entry.store(_ND_FLOW_MAP_TOMBSTONE,
+              memory_order_release);
+            b->count--;
+            b->generation++;
+            Retire(e, DestroyEntry);
+            return true;
+        }
     }
 
-    return deleted;
+    return false;
 }
 
 nd_flow_map &ndFlowMap::Acquire(size_t b) {
-    if (b >= buckets)
+    if (b >= bucket.size())
         throw ndSystemException(__PRETTY_FUNCTION__,
           "bucket", EINVAL);
 
-    bucket_lock[b]->lock();
+    bucket[b]->lock.lock();
+    ndFlowMapEpoch::Enter();
 
     return *bucket[b];
 }
 
 const nd_flow_map &ndFlowMap::AcquireConst(size_t b) const {
-    if (b >= buckets)
+    if (b >= bucket.size())
         throw ndSystemException(__PRETTY_FUNCTION__,
           "bucket", EINVAL);
 
-    bucket_lock[b]->lock();
+    bucket[b]->lock.lock();
+    ndFlowMapEpoch::Enter();
 
     return *bucket[b];
 }
 
 void ndFlowMap::Release(size_t b) const {
-    if (b >= buckets)
+    if (b >= bucket.size())
         throw ndSystemException(__PRETTY_FUNCTION__,
           "bucket", EINVAL);
 
-    bucket_lock[b]->unlock();
+    ndFlowMapEpoch::Exit();
+    bucket[b]->lock.unlock();
+
+    Reclaim();
+}
+
+unsigned ndFlowMap::AllocateShard(void) {
+    for (unsigned s = 1; s <= shards; s++) {
+        if (shard_used[s]) continue;
+        shard_used[s] = true;
+        return s;
+    }
+
+    return 0;
+}
+
+void ndFlowMap::FreeShard(unsigned shard) {
+    if (shard == 0 || shard > shards) return;
+    shard_used[shard] = false;
+}
+
+void ndFlowMap::Grow(ndFlowMapBucket *b, ndFlowMapTable *t) {
+    lock_guard<mutex> lock(b->lock);
+
+    // Another thread already replaced the table.
+    if (b->table.load() != t) return;
+
+    // Stop new inserts, and wait for those in flight.
+    b->frozen.store(true);
+    while (b->writers.load() != 0) this_thread::yield();
+
+    // Double the capacity if more than half of the threshold
+    // is live, otherwise only drop the tombstones.
+    size_t live = b->count.load();
+    size_t capacity = t->capacity;
+    if (live * 2 > t->threshold) capacity *= 2;
+
+    ndFlowMapTable *nt = nullptr;
+    try {
+        nt = ndFlowMapTable::Create(capacity);
+    }
+    catch (...) {
+        b->frozen.store(false);
+        throw;
+    }
+
+    const size_t mask = nt->capacity - 1;
+    size_t used = 0;
+
+    for (size_t i = 0; i < t->capacity; i++) {
+        nd_flow_pair *e = t->slots[i].entry.load(memory_order_acquire);
+        if (e == nullptr || e == _ND_FLOW_MAP_TOMBSTONE) continue;
+
+        size_t index = nt->Index(e->first);
+        while (nt->slots[index].entry.load(
+                 memory_order_relaxed) != nullptr)
+            index = (index + 1) & mask;
+
+        nt->slots[index].tag.store(ndFlowMapTable::Tag(e->first),
+          memory_order_relaxed);
+        nt->slots[index].entry.store(e, memory_order_relaxed);
+        used++;
+    }
+
+    nt->used = used;
+    b->count = used;
+
+    b->table.store(nt, memory_order_release);
+    b->frozen.store(false);
+
+    // Lock-free readers may still be probing the old table.
+    Retire(t, ndFlowMapTable::Destroy);
+}
+
+void ndFlowMap::Retire(void *ptr, void (*destroy)(void *)) {
+    lock_guard<mutex> lock(retired_lock);
+    retired_list.push_back({ ndFlowMapEpoch::Current(), ptr, destroy });
+}
+
+void ndFlowMap::Reclaim(bool force) const {
+    vector<retired> ready;
+
+    {
+        lock_guard<mutex> lock(retired_lock);
+        if (retired_list.empty()) return;
+
+        if (! force) ndFlowMapEpoch::TryAdvance();
+        uint64_t epoch = ndFlowMapEpoch::Current();
+
+        auto it = partition(retired_list.begin(),
+          retired_list.end(), [force, epoch](const retired &r) {
+              return (! force &&
+                r.epoch + _ND_FLOW_MAP_GRACE > epoch);
+          });
+
+        ready.assign(it, retired_list.end());
+        retired_list.erase(it, retired_list.end());
+    }
+
+    // Destroying entries can drop the last flow reference, so
+    // do so outside of the lock.
+    for (auto &r : ready) r.destroy(r.ptr);
 }
 
-void ndFlowMap::Release(const string &digest) const {
-    Release(HashToBucket(digest));
+void ndFlowMap::DestroyEntry(void *entry) {
+    delete static_cast<nd_flow_pair *>(entry);
+}
+
+ndFlowMapCache::ndFlowMapCache(size_t slots) : mask(0) {
+    // Round down to a power of 2
+    while (slots & (slots - 1)) slots &= slots - 1;
+
+    if (slots > 0) {
+        cache.resize(slots, { nullptr, nullptr, 0 });
+        mask = slots - 1;
+    }
+}
+
+bool ndFlowMapCache::Lookup(const ndFlowMap *map, ndFlowKey &key,
+  nd_flow_ptr &flow) {
+    if (cache.empty()) return false;
+
+    const entry &ce = cache[Index(key)];
+    if (ce.pair == nullptr) return false;
+
+    // The generation is checked inside the epoch: if unchanged,
+    // the entry has not been removed and, even if it is removed
+    // now, can not be freed until we exit.
+    ndFlowMapEpochGuard epoch;
+
+    if (ce.generation != ce.bucket->GetGeneration()) return false;
+    if (! ce.pair->first.Match(key)) return false;
+
+    key.hash = ce.pair->first.hash;
+    flow = ce.pair->second;
+
+    return true;
+}
+
+nd_flow_ptr ndFlowMapCache::Fill(const ndFlowMap *map,
+  const ndFlowKey &key, unsigned shard) {
+    ndFlowMapEpochGuard epoch;
+
+    const ndFlowMapBucket *b =
+      map->bucket[map->HashToBucket(key, shard)];
+    uint64_t generation = b->GetGeneration();
+    nd_flow_pair *e = map->Find(key, shard);
+    if (e == nullptr) return nullptr;
+
+    if (! cache.empty()) {
+        entry &ce = cache[Index(key)];
+        ce.pair = e;
+        ce.bucket = b;
+        ce.generation = generation;
+    }
+
+    return e->second;
 }
 
 #ifndef _ND_LEAN_AND_MEAN
 void ndFlowMap::DumpBucketStats(void) {
-    for (size_t i = 0; i < buckets; i++) {
-        if (bucket_lock[i]->try_lock()) {
-            nd_dprintf("ndFlowMap: %4u: %u flow(s).\n", i,
-              bucket[i]->size());
+    ndFlowMapEpochGuard epoch;
 
-            bucket_lock[i]->unlock();
-        }
-        else nd_dprintf("ndFlowMap: %4u: locked.\n", i);
+    for (size_t i = 0; i < bucket.size(); i++) {
+        const ndFlowMapTable *t = bucket[i]->table.load();
+
+        nd_dprintf("ndFlowMap: %4u: %u flow(s), %u/%u slot(s).\n",
+          i, bucket[i]->size(), t->used.load(), t->capacity);
     }
 }
 #endif
@@ -0,0 +1,331 @@
+// Netify Agent
+// Copyright (C) 2015-2023 eGloo Incorporated
+// <http://www.egloo.ca>
+//
+// This program is free software: you can redistribute it
+// and/or modify it under the terms of the GNU General
+// Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your
+// option) any later version.
+//
+// This program is distributed in the hope that it will be
+// useful, but WITHOUT ANY WARRANTY; without even the
+// implied warranty of MERCHANTABILITY or FITNESS FOR A
+// PARTICULAR PURPOSE.  See the GNU General Public License
+// for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this program.  If not, see
+// <http://www.gnu.org/licenses/>.
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+#include "nd-flow-snapshot.hpp"
+#include "nd-util.hpp"
+
+enum {
+    _ND_FSF_GUESSED = 0x01,
+    _ND_FSF_DHC_HIT = 0x02,
+    _ND_FSF_FHC_HIT = 0x04,
+    _ND_FSF_IP_NAT = 0x08,
+    _ND_FSF_SOFT_DISSECTOR = 0x10,
+    _ND_FSF_CACHED = 0x20,
+};
+
+static inline void nd_flow_snapshot_string(char *dst,
+  size_t length, const string &src) {
+    memset(dst, 0, length);
+    memcpy(dst, src.c_str(), min(src.size(), length - 1));
+}
+
+ndFlowSnapshot::ndFlowSnapshot(const string &filename)
+  : filename(filename), mapping(nullptr), length(0),
+    base(nullptr), entries(0) { }
+
+ndFlowSnapshot::~ndFlowSnapshot() {
+    if (mapping != nullptr) munmap(mapping, length);
+}
+
+bool ndFlowSnapshot::Save(const string &filename, ndFlowMap *map,
+  size_t &count) {
+    string temp = filename + ".tmp";
+
+    count = 0;
+
+    FILE *hf = fopen(temp.c_str(), "wb");
+    if (hf == NULL) {
+        nd_printf("WARNING: Error saving flow snapshot: %s: %s\n",
+          temp.c_str(), strerror(errno));
+        return false;
+    }
+
+    ndFlowSnapshotHeader header;
+    memset(&header, 0, sizeof(ndFlowSnapshotHeader));
+
+    header.magic = _ND_FLOW_SNAPSHOT_MAGIC;
+    header.version = _ND_FLOW_SNAPSHOT_VERSION;
+    header.entry_size = sizeof(ndFlowSnapshotEntry);
+    header.timestamp = (uint64_t)time(NULL);
+
+    // The entry count is filled in once known.
+    bool result = (fwrite(&header, sizeof(header), 1, hf) == 1);
+
+    ndFlowSnapshotEntry entry;
+    size_t buckets = map->GetBuckets();
+
+    for (size_t b = 0; b < buckets && result; b++) {
+        auto &fm = map->Acquire(b);
+
+        for (auto &it : fm) {
+            const nd_flow_ptr &flow = it.second;
+
+            // Only classified flows are worth restoring; anything
+            // else is simply detected again.
+            if (flow->flags.detection_complete.load() == false ||
+              flow->flags.expired.load() ||
+              flow->flags.expiring.load() ||
+              flow->tunnel_type != ndFlow::TUNNEL_NONE)
+                continue;
+
+            Store(*flow, entry);
+
+            if (fwrite(&entry, sizeof(entry), 1, hf) != 1) {
+                result = false;
+                break;
+            }
+
+            count++;
+        }
+
+        map->Release(b);
+    }
+
+    if (result) {
+        header.entries = count;
+        result = (fseek(hf, 0, SEEK_SET) == 0 &&
+          fwrite(&header, sizeof(header), 1, hf) == 1);
+    }
+
+    if (fclose(hf) != 0) result = false;
+
+    if (result && rename(temp.c_str(), filename.c_str()) != 0)
+        result = false;
+
+    if (! result) {
+        nd_printf("WARNING: Error saving flow snapshot: %s: %s\n",
+          filename.c_str(), strerror(errno));
+        unlink(temp.c_str());
+        count = 0;
+    }
+
+    return result;
+}
+
+bool ndFlowSnapshot::Open(void) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        if (errno != ENOENT) {
+            nd_printf(
+              "WARNING: Error opening flow snapshot: %s: %s\n",
+              filename.c_str(), strerror(errno));
+        }
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 ||
+      (size_t)st.st_size < sizeof(ndFlowSnapshotHeader))
+    {
+        nd_printf("WARNING: Invalid flow snapshot: %s\n",
+          filename.c_str());
+        close(fd);
+        return false;
+    }
+
+    length = (size_t)st.st_size;
+    mapping = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (mapping == MAP_FAILED) {
+        nd_printf("WARNING: Error mapping flow snapshot: %s: %s\n",
+          filename.c_str(), strerror(errno));
+        mapping = nullptr;
+        return false;
+    }
+
+    const ndFlowSnapshotHeader *header =
+      static_cast<const ndFlowSnapshotHeader *>(mapping);
+
+    if (header->magic != _ND_FLOW_SNAPSHOT_MAGIC ||
+      header->version != _ND_FLOW_SNAPSHOT_VERSION ||
+      header->entry_size != sizeof(ndFlowSnapshotEntry) ||
+      header->entries > (length - sizeof(ndFlowSnapshotHeader)) /
+          sizeof(ndFlowSnapshotEntry))
+    {
+        nd_printf("WARNING: Invalid flow snapshot: %s\n",
+          filename.c_str());
+        return false;
+    }
+
+    madvise(mapping, length, MADV_SEQUENTIAL);
+
+    base = reinterpret_cast<const ndFlowSnapshotEntry *>(
+      static_cast<const uint8_t *>(mapping) +
+      sizeof(ndFlowSnapshotHeader));
+    entries = (size_t)header->entries;
+
+    return true;
+}
+
+void ndFlowSnapshot::Store(const ndFlow &flow,
+  ndFlowSnapshotEntry &entry) {
+    memset(&entry, 0, sizeof(ndFlowSnapshotEntry));
+
+    nd_flow_snapshot_string(entry.ifname, IFNAMSIZ,
+      flow.iface->ifname);
+
+    memcpy(entry.lower_mac, &flow.lower_mac, sizeof(ndFlowAddr));
+    memcpy(entry.upper_mac, &flow.upper_mac, sizeof(ndFlowAddr));
+    memcpy(entry.lower_addr, &flow.lower_addr, sizeof(ndFlowAddr));
+    memcpy(entry.upper_addr, &flow.upper_addr, sizeof(ndFlowAddr));
+
+    entry.ts_first_seen = flow.ts_first_seen;
+    entry.ts_last_seen = flow.ts_last_seen.load();
+    entry.lower_bytes = flow.stats.lower_bytes.load();
+    entry.upper_bytes = flow.stats.upper_bytes.load();
+    entry.total_bytes = flow.stats.total_bytes.load();
+    entry.lower_packets = flow.stats.lower_packets.load();
+    entry.upper_packets = flow.stats.upper_packets.load();
+    entry.total_packets = flow.stats.total_packets.load();
+
+    entry.detected_application = flow.detected_application;
+    entry.category[0] = flow.category.application;
+    entry.category[1] = flow.category.protocol;
+    entry.category[2] = flow.category.domain;
+    entry.category[3] = flow.category.network;
+    entry.detected_protocol = (uint16_t)flow.detected_protocol;
+
+    entry.vlan_id = flow.vlan_id;
+    entry.direction = (int8_t)flow.direction;
+    entry.ip_version = flow.ip_version;
+    entry.ip_protocol = flow.ip_protocol;
+    entry.origin = flow.origin;
+    entry.lower_map = flow.lower_map;
+    entry.other_type = flow.other_type;
+    entry.privacy_mask = flow.privacy_mask;
+    entry.lower_type = (uint8_t)flow.lower_type;
+    entry.upper_type = (uint8_t)flow.upper_type;
+    entry.tcp_fin_ack = flow.flags.tcp_fin_ack.load();
+
+    if (flow.flags.detection_guessed.load())
+        entry.flags |= _ND_FSF_GUESSED;
+    if (flow.flags.dhc_hit.load()) entry.flags |= _ND_FSF_DHC_HIT;
+    if (flow.flags.fhc_hit.load()) entry.flags |= _ND_FSF_FHC_HIT;
+    if (flow.flags.ip_nat.load()) entry.flags |= _ND_FSF_IP_NAT;
+    if (flow.flags.soft_dissector.load())
+        entry.flags |= _ND_FSF_SOFT_DISSECTOR;
+    if (flow.flags.detection_cached.load())
+        entry.flags |= _ND_FSF_CACHED;
+
+    if (flow.digest_lower.size() == SHA1_DIGEST_LENGTH) {
+        memcpy(entry.digest_lower, &flow.digest_lower[0],
+          SHA1_DIGEST_LENGTH);
+    }
+    if (flow.digest_mdata.size() == SHA1_DIGEST_LENGTH) {
+        memcpy(entry.digest_mdata, &flow.digest_mdata[0],
+          SHA1_DIGEST_LENGTH);
+    }
+
+    nd_flow_snapshot_string(entry.host_server_name,
+      ND_FLOW_HOSTNAME, flow.host_server_name);
+    nd_flow_snapshot_string(entry.dns_host_name,
+      ND_FLOW_HOSTNAME, flow.dns_host_name);
+}
+
+nd_flow_ptr ndFlowSnapshot::Restore(const ndFlowSnapshotEntry &entry,
+  nd_iface_ptr &iface, ndFlowArena *arena, ndApplications &apps) {
+    ndFlow flow(iface);
+
+    flow.ip_version = entry.ip_version;
+    flow.ip_protocol = entry.ip_protocol;
+    flow.vlan_id = entry.vlan_id;
+
+    memcpy(&flow.lower_mac, entry.lower_mac, sizeof(ndFlowAddr));
+    memcpy(&flow.upper_mac, entry.upper_mac, sizeof(ndFlowAddr));
+    memcpy(&flow.lower_addr, entry.lower_addr, sizeof(ndFlowAddr));
+    memcpy(&flow.upper_addr, entry.upper_addr, sizeof(ndFlowAddr));
+
+    flow.ts_first_seen = entry.ts_first_seen;
+    flow.ts_last_seen = entry.ts_last_seen;
+
+    flow.UpdateKey(ndInterface::GetIndex(iface->ifname));
+
+    nd_flow_ptr nf = arena->Create(flow);
+
+    nf->origin = entry.origin;
+    nf->direction = entry.direction;
+    nf->lower_map = entry.lower_map;
+    nf->other_type = entry.other_type;
+    nf->privacy_mask = entry.privacy_mask;
+    nf->lower_type = (ndAddr::Type)entry.lower_type;
+    nf->upper_type = (ndAddr::Type)entry.upper_type;
+
+    nf->detected_protocol = (nd_proto_id_t)entry.detected_protocol;
+    nf->detected_protocol_name = nd_proto_get_name(
+      nf->detected_protocol);
+    nf->detected_application = entry.detected_application;
+    if (nf->detected_application != ND_APP_UNKNOWN) {
+        apps.Lookup(nf->detected_application,
+          nf->detected_application_name);
+    }
+
+    nf->category.application = entry.category[0];
+    nf->category.protocol = entry.category[1];
+    nf->category.domain = entry.category[2];
+    nf->category.network = entry.category[3];
+
+    nf->stats.lower_bytes = entry.lower_bytes;
+    nf->stats.upper_bytes = entry.upper_bytes;
+    nf->stats.total_bytes = entry.total_bytes;
+    nf->stats.lower_packets = entry.lower_packets;
+    nf->stats.upper_packets = entry.upper_packets;
+    nf->stats.total_packets = entry.total_packets;
+
+    nf->digest_lower.assign(entry.digest_lower,
+      entry.digest_lower + SHA1_DIGEST_LENGTH);
+    nf->digest_mdata.assign(entry.digest_mdata,
+      entry.digest_mdata + SHA1_DIGEST_LENGTH);
+
+    nf->host_server_name.assign(entry.host_server_name,
+      strnlen(entry.host_server_name, ND_FLOW_HOSTNAME));
+    nf->dns_host_name.assign(entry.dns_host_name,
+      strnlen(entry.dns_host_name, ND_FLOW_HOSTNAME));
+
+    nf->flags.detection_cached = (entry.flags & _ND_FSF_CACHED);
+    nf->flags.detection_guessed = (entry.flags & _ND_FSF_GUESSED);
+    nf->flags.dhc_hit = (entry.flags & _ND_FSF_DHC_HIT);
+    nf->flags.fhc_hit = (entry.flags & _ND_FSF_FHC_HIT);
+    nf->flags.ip_nat = (entry.flags & _ND_FSF_IP_NAT);
+    nf->flags.soft_dissector = (entry.flags & _ND_FSF_SOFT_DISSECTOR);
+    nf->flags.tcp_fin_ack = entry.tcp_fin_ack;
+
+    // Never sent to DPI again.
+    nf->flags.detection_init = true;
+    nf->flags.risks_checked = true;
+    nf->flags.detection_complete = true;
+
+    return nf;
+}
@@ -0,0 +1,105 @@
+// Netify Agent
+// Copyright (C) 2015-2023 eGloo Incorporated
+// <http://www.egloo.ca>
+//
+// This program is free software: you can redistribute it
+// and/or modify it under the terms of the GNU General
+// Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your
+// option) any later version.
+//
+// This program is distributed in the hope that it will be
+// useful, but WITHOUT ANY WARRANTY; without even the
+// implied warranty of MERCHANTABILITY or FITNESS FOR A
+// PARTICULAR PURPOSE.  See the GNU General Public License
+// for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this program.  If not, see
+// <http://www.gnu.org/licenses/>.
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <utility>
+
+#include "nd-flow-timer.hpp"
+
+// Largest delay representable by the wheel; anything further
+// out is clamped, and rescheduled when it fires.
+#define _ND_FLOW_TIMER_SPAN \
+    ((uint64_t)1 << (_ND_FLOW_TIMER_BITS * _ND_FLOW_TIMER_LEVELS))
+
+static inline unsigned nd_flow_timer_slot(uint64_t t, unsigned level) {
+    return (unsigned)(t >> (_ND_FLOW_TIMER_BITS * level)) &
+      _ND_FLOW_TIMER_MASK;
+}
+
+ndFlowTimerWheel::ndFlowTimerWheel(uint64_t now)
+  : current(now), size(0) { }
+
+void ndFlowTimerWheel::Schedule(const ndFlowKey &key,
+  unsigned shard, uint64_t due) {
+    ndFlowTimer timer;
+
+    timer.key = key;
+    timer.due = due;
+    timer.shard = shard;
+
+    Insert(move(timer));
+    size++;
+}
+
+void ndFlowTimerWheel::Advance(uint64_t now,
+  vector<ndFlowTimer> &timers) {
+    // Nothing scheduled; skip ahead rather than tick through.
+    if (size == 0 && current < now) current = now;
+
+    while (current < now) {
+        current++;
+
+        // Refill lower levels as each one wraps around.
+        for (unsigned level = 1; level < _ND_FLOW_TIMER_LEVELS &&
+             nd_flow_timer_slot(current, level - 1) == 0;
+             level++)
+            Cascade(level);
+
+        vector<ndFlowTimer> &slot = slots[0][current &
+          _ND_FLOW_TIMER_MASK];
+
+        if (slot.empty()) continue;
+
+        size -= slot.size();
+
+        for (auto &timer : slot) timers.push_back(move(timer));
+
+        slot.clear();
+    }
+}
+
+void ndFlowTimerWheel::Insert(ndFlowTimer &&timer) {
+    // Overdue timers fire on the next tick.  The timer's own due
+    // time is left as scheduled; callers match on it.
+    uint64_t when = timer.due;
+    if (when <= current) when = current + 1;
+    if (when - current >= _ND_FLOW_TIMER_SPAN)
+        when = current + _ND_FLOW_TIMER_SPAN - 1;
+
+    uint64_t delta = when - current;
+    unsigned level = 0;
+
+    while (level < _ND_FLOW_TIMER_LEVELS - 1 &&
+      delta >= ((uint64_t)1 << (_ND_FLOW_TIMER_BITS * (level + 1))))
+        level++;
+
+    slots[level][nd_flow_timer_slot(when, level)].push_back(
+      move(timer));
+}
+
+void ndFlowTimerWheel::Cascade(unsigned level) {
+    vector<ndFlowTimer> pending;
+    pending.swap(slots[level][nd_flow_timer_slot(current, level)]);
+
+    for (auto &timer : pending) Insert(move(timer));
+}
@@ -54,23 +54,28 @@ void ndFlowStats::UpdateRate(bool lower, uint64_t timestamp,
 }
 
 ndFlow::ndFlow(nd_iface_ptr &iface)
-  : iface(iface), dpi_thread_id(-1), ip_version(0),
-    ip_protocol(0), vlan_id(0), tcp_last_seq(0),
-    ts_first_seen(0), ts_last_seen(0), lower_map(LOWER_UNKNOWN),
-    other_type(OTHER_UNKNOWN), tunnel_type(TUNNEL_NONE),
+  : iface(iface), dpi_thread_id(-1), dpi_lock(false),
+    dpi_queued(0), ip_version(0),
+    ip_protocol(0), vlan_id(0), tunnel_type(TUNNEL_NONE),
+    origin(0), direction(0), tcp_last_seq(0), ts_first_seen(0),
+    ts_last_seen(0), flags{}, lower_map(LOWER_UNKNOWN),
+    other_type(OTHER_UNKNOWN), privacy_mask(0),
+    lower_type(ndAddr::atNONE), upper_type(ndAddr::atNONE),
     detected_protocol(ND_PROTO_UNKNOWN),
     detected_application(ND_APP_UNKNOWN),
     detected_protocol_name("Unknown"),
     category{ ND_CAT_UNKNOWN, ND_CAT_UNKNOWN, ND_CAT_UNKNOWN },
-    ndpi_flow(NULL), http{ { 0 } }, privacy_mask(0),
-    origin(0), direction(0),
+    ndpi_flow(NULL), metadata(nullptr), gtp(nullptr),
+    timer_due(0), detection_cache_key(0), mem_charged(0),
+    tls_alpn_set(false), tls_alpn_server_set(false),
+    ndpi_risk_score(0), ndpi_risk_score_client(0),
+    ndpi_risk_score_server(0)
 #if defined(_ND_USE_CONNTRACK) && defined(_ND_WITH_CONNTRACK_MDATA)
-    ct_id(0), ct_mark(0),
+    ,
+    ct_id(0), ct_mark(0)
 #endif
-    lower_type(ndAddr::atNONE), upper_type(ndAddr::atNONE),
-    flags{}, gtp{ 0 }, ndpi_risk_score(0),
-    ndpi_risk_score_client(0), ndpi_risk_score_server(0) {
-    gtp.version = 0xFF;
+{
+    key.Clear();
 
     digest_lower.reserve(SHA1_DIGEST_LENGTH);
     digest_lower.resize(SHA1_DIGEST_LENGTH);
@@ -79,29 +84,37 @@ ndFlow::ndFlow(nd_iface_ptr &iface)
 }
 
 ndFlow::ndFlow(const ndFlow &flow)
-  : iface(flow.iface), dpi_thread_id(-1),
+  : iface(flow.iface), dpi_thread_id(-1), dpi_lock(false),
+    dpi_queued(0),
     ip_version(flow.ip_version), ip_protocol(flow.ip_protocol),
-    vlan_id(flow.vlan_id), tcp_last_seq(flow.tcp_last_seq),
+    vlan_id(flow.vlan_id), tunnel_type(flow.tunnel_type),
+    origin(0), direction(0), tcp_last_seq(flow.tcp_last_seq),
     ts_first_seen(flow.ts_first_seen),
-    ts_last_seen(flow.ts_last_seen.load()),
-    lower_map(LOWER_UNKNOWN), other_type(OTHER_UNKNOWN),
+    ts_last_seen(flow.ts_last_seen.load()), flags{},
+    key(flow.key), lower_map(LOWER_UNKNOWN),
+    other_type(OTHER_UNKNOWN), privacy_mask(0),
+    lower_type(ndAddr::atNONE), upper_type(ndAddr::atNONE),
     lower_mac(flow.lower_mac), upper_mac(flow.upper_mac),
     lower_addr(flow.lower_addr), upper_addr(flow.upper_addr),
-    tunnel_type(flow.tunnel_type),
     detected_protocol(ND_PROTO_UNKNOWN),
     detected_application(ND_APP_UNKNOWN),
     detected_protocol_name("Unknown"),
     category{ ND_CAT_UNKNOWN, ND_CAT_UNKNOWN, ND_CAT_UNKNOWN },
-    ndpi_flow(NULL), http{ { 0 } }, privacy_mask(0),
-    origin(0), direction(0),
+    ndpi_flow(NULL), metadata(nullptr),
+    gtp((flow.tunnel_type == TUNNEL_GTP && flow.gtp != nullptr) ?
+        new ndFlowGTP(*flow.gtp) :
+        nullptr),
+    timer_due(0), detection_cache_key(0), mem_charged(0),
+    tls_alpn_set(false), tls_alpn_server_set(false),
+    ndpi_risk_score(0), ndpi_risk_score_client(0),
+    ndpi_risk_score_server(0)
 #if defined(_ND_USE_CONNTRACK) && defined(_ND_WITH_CONNTRACK_MDATA)
-    ct_id(0), ct_mark(0),
+    ,
+    ct_id(0), ct_mark(0)
 #endif
-    lower_type(ndAddr::atNONE), upper_type(ndAddr::atNONE),
-    flags{}, gtp(flow.gtp), ndpi_risk_score(0),
-    ndpi_risk_score_client(0), ndpi_risk_score_server(0) {
-    digest_lower.assign(flow.digest_lower.begin(),
-      flow.digest_lower.end());
+{
+    digest_lower.reserve(SHA1_DIGEST_LENGTH);
+    digest_lower.resize(SHA1_DIGEST_LENGTH);
     digest_mdata.reserve(SHA1_DIGEST_LENGTH);
     digest_mdata.resize(SHA1_DIGEST_LENGTH);
 }
@@ -109,15 +122,40 @@ ndFlow::ndFlow(const ndFlow &flow)
 ndFlow::~ndFlow() {
     Release();
 
+    if (gtp != nullptr) {
+        delete gtp;
+        gtp = nullptr;
+    }
+
+    ndFlowMetadata *md = metadata.load();
+    if (md == nullptr) return;
+
     if (HasTLSIssuerDN()) {
-        free(ssl.issuer_dn);
-        ssl.issuer_dn = NULL;
+        free(md->ssl.issuer_dn);
+        md->ssl.issuer_dn = NULL;
     }
 
     if (HasTLSSubjectDN()) {
-        free(ssl.subject_dn);
-        ssl.subject_dn = NULL;
+        free(md->ssl.subject_dn);
+        md->ssl.subject_dn = NULL;
     }
+
+    delete md;
+}
+
+ndFlowMetadata &ndFlow::CreateMetadata(void) {
+    ndFlowMetadata *md = new ndFlowMetadata;
+    ndFlowMetadata *current = nullptr;
+
+    // Capture and detection threads may race to allocate.
+    if (! metadata.compare_exchange_strong(current, md,
+          memory_order_acq_rel, memory_order_acquire))
+    {
+        delete md;
+        return *current;
+    }
+
+    return *md;
 }
 
 void ndFlow::Hash(const string &device, bool hash_mdata,
@@ -134,36 +172,25 @@ void ndFlow::Hash(const string &device, bool hash_mdata,
 
     switch (ip_version) {
     case 4:
-        sha1_write(&ctx,
-          (const char *)&lower_addr.addr.in.sin_addr,
+        sha1_write(&ctx, (const char *)lower_addr.addr,
           sizeof(struct in_addr));
-        sha1_write(&ctx,
-          (const char *)&upper_addr.addr.in.sin_addr,
+        sha1_write(&ctx, (const char *)upper_addr.addr,
           sizeof(struct in_addr));
 
-        if (lower_addr.addr.in.sin_addr.s_addr == 0 &&
-          upper_addr.addr.in.sin_addr.s_addr == 0xffffffff)
+        if (lower_addr.GetIPv4() == 0 &&
+          upper_addr.GetIPv4() == 0xffffffff)
         {
             // XXX: Hash in lower MAC for ethernet broadcasts
             // (DHCPv4).
-#if defined(__linux__)
-            sha1_write(&ctx,
-              (const char *)lower_mac.addr.ll.sll_addr,
-              ETH_ALEN);
-#elif defined(__FreeBSD__)
-            sha1_write(&ctx,
-              (const char *)LLADDR(&lower_mac.addr.dl),
+            sha1_write(&ctx, (const char *)lower_mac.addr,
               ETH_ALEN);
-#endif
         }
 
         break;
     case 6:
-        sha1_write(&ctx,
-          (const char *)&lower_addr.addr.in6.sin6_addr,
+        sha1_write(&ctx, (const char *)lower_addr.addr,
           sizeof(struct in6_addr));
-        sha1_write(&ctx,
-          (const char *)&upper_addr.addr.in6.sin6_addr,
+        sha1_write(&ctx, (const char *)upper_addr.addr,
           sizeof(struct in6_addr));
         break;
     default: break;
@@ -183,7 +210,8 @@ void ndFlow::Hash(const string &device, bool hash_mdata,
               host_server_name.size());
         }
         if (HasBTInfoHash()) {
-            sha1_write(&ctx, bt.info_hash, ND_FLOW_BTIHASH_LEN);
+            sha1_write(&ctx, GetMetadata()->bt.info_hash,
+              ND_FLOW_BTIHASH_LEN);
         }
     }
 
@@ -194,10 +222,50 @@ void ndFlow::Hash(const string &device, bool hash_mdata,
     else sha1_result(&ctx, &digest_mdata[0]);
 }
 
+void ndFlow::UpdateKey(uint32_t iface_index, bool hash) {
+    key.Clear();
+
+    key.iface = iface_index;
+    key.vlan_id = vlan_id;
+    key.ip_version = ip_version;
+    key.ip_protocol = ip_protocol;
+
+    switch (ip_version) {
+    case 4:
+        memcpy(key.lower_addr, lower_addr.addr,
+          sizeof(struct in_addr));
+        memcpy(key.upper_addr, upper_addr.addr,
+          sizeof(struct in_addr));
+
+        if (lower_addr.GetIPv4() == 0 &&
+          upper_addr.GetIPv4() == 0xffffffff)
+        {
+            // XXX: Key on lower MAC for ethernet broadcasts
+            // (DHCPv4).
+            memcpy(key.lower_mac, lower_mac.addr, ETH_ALEN);
+        }
+
+        break;
+    case 6:
+        memcpy(key.lower_addr, lower_addr.addr,
+          sizeof(struct in6_addr));
+        memcpy(key.upper_addr, upper_addr.addr,
+          sizeof(struct in6_addr));
+        break;
+    default: break;
+    }
+
+    key.lower_port = lower_addr.port;
+    key.upper_port = upper_addr.port;
+
+    if (hash) key.Update();
+}
+
 void ndFlow::Reset(bool full_reset) {
     stats.Reset(full_reset);
 
     if (full_reset) {
+        flags.detection_cached = false;
         flags.detection_complete = false;
         flags.detection_guessed = false;
         flags.detection_init = false;
@@ -205,6 +273,7 @@ void ndFlow::Reset(bool full_reset) {
         flags.dhc_hit = false;
         flags.expired = false;
         flags.expiring = false;
+        flags.evicting = false;
         flags.risks_checked = false;
         flags.soft_dissector = false;
 
@@ -214,11 +283,23 @@ void ndFlow::Reset(bool full_reset) {
 
 void ndFlow::Release(void) {
     if (ndpi_flow != NULL) {
-        ndpi_free_flow(ndpi_flow);
+        ndNDPIFlowPool::Free(ndpi_flow);
         ndpi_flow = NULL;
     }
 }
 
+size_t ndFlow::GetMemoryUsage(void) const {
+    size_t bytes = sizeof(ndFlow);
+
+    if (ndpi_flow != NULL) bytes += sizeof(struct ndpi_flow_struct);
+    if (gtp != nullptr) bytes += sizeof(ndFlowGTP);
+
+    const ndFlowMetadata *md = GetMetadata();
+    if (md != nullptr) bytes += sizeof(ndFlowMetadata);
+
+    return bytes;
+}
+
 nd_proto_id_t ndFlow::GetMasterProtocol(void) const {
     switch (detected_protocol) {
     case ND_PROTO_HTTPS:
@@ -250,34 +331,50 @@ nd_proto_id_t ndFlow::GetMasterProtocol(void) const {
     return detected_protocol;
 }
 
+uint16_t ndFlow::GetTLSVersion(void) const {
+    const ndFlowMetadata *md = GetMetadata();
+    return (md != nullptr) ? md->ssl.version : 0;
+}
+
+uint16_t ndFlow::GetTLSCipherSuite(void) const {
+    const ndFlowMetadata *md = GetMetadata();
+    return (md != nullptr) ? md->ssl.cipher_suite : 0;
+}
+
 bool ndFlow::HasDhcpFingerprint(void) const {
-    return (detected_protocol == ND_PROTO_DHCP &&
-      dhcp.fingerprint[0] != '\0');
+    const ndFlowMetadata *md = GetMetadata();
+    return (md != nullptr && detected_protocol == ND_PROTO_DHCP &&
+      md->dhcp.fingerprint[0] != '\0');
 }
 
 bool ndFlow::HasDhcpClassIdent(void) const {
-    return (detected_protocol == ND_PROTO_DHCP &&
-      dhcp.class_ident[0] != '\0');
+    const ndFlowMetadata *md = GetMetadata();
+    return (md != nullptr && detected_protocol == ND_PROTO_DHCP &&
+      md->dhcp.class_ident[0] != '\0');
 }
 
 bool ndFlow::HasHttpUserAgent(void) const {
-    return (GetMasterProtocol() == ND_PROTO_HTTP &&
-      http.user_agent[0] != '\0');
+    const ndFlowMetadata *md = GetMetadata();
+    return (md != nullptr && GetMasterProtocol() == ND_PROTO_HTTP &&
+      md->http.user_agent[0] != '\0');
 }
 
 bool ndFlow::HasHttpURL(void) const {
-    return (GetMasterProtocol() == ND_PROTO_HTTP &&
-      http.url[0] != '\0');
+    const ndFlowMetadata *md = GetMetadata();
+    return (md != nullptr && GetMasterProtocol() == ND_PROTO_HTTP &&
+      md->http.url[0] != '\0');
 }
 
 bool ndFlow::HasSSHClientAgent(void) const {
-    return (detected_protocol == ND_PROTO_SSH &&
-      ssh.client_agent[0] != '\0');
+    const ndFlowMetadata *md = GetMetadata();
+    return (md != nullptr && detected_protocol == ND_PROTO_SSH &&
+      md->ssh.client_agent[0] != '\0');
 }
 
 bool ndFlow::HasSSHServerAgent(void) const {
-    return (detected_protocol == ND_PROTO_SSH &&
-      ssh.server_agent[0] != '\0');
+    const ndFlowMetadata *md = GetMetadata();
+    return (md != nullptr && detected_protocol == ND_PROTO_SSH &&
+      md->ssh.server_agent[0] != '\0');
 }
 
 bool ndFlow::HasTLSClientSNI(void) const {
@@ -287,41 +384,52 @@ bool ndFlow::HasTLSClientSNI(void) const {
 }
 
 bool ndFlow::HasTLSServerCN(void) const {
-    return ((GetMasterProtocol() == ND_PROTO_TLS ||
-              detected_protocol == ND_PROTO_QUIC) &&
-      ssl.server_cn[0] != '\0');
+    const ndFlowMetadata *md = GetMetadata();
+    return (md != nullptr &&
+      (GetMasterProtocol() == ND_PROTO_TLS ||
+        detected_protocol == ND_PROTO_QUIC) &&
+      md->ssl.server_cn[0] != '\0');
 }
 
 bool ndFlow::HasTLSIssuerDN(void) const {
-    return ((GetMasterProtocol() == ND_PROTO_TLS ||
-              detected_protocol == ND_PROTO_QUIC) &&
-      ssl.issuer_dn != NULL);
+    const ndFlowMetadata *md = GetMetadata();
+    return (md != nullptr &&
+      (GetMasterProtocol() == ND_PROTO_TLS ||
+        detected_protocol == ND_PROTO_QUIC) &&
+      md->ssl.issuer_dn != NULL);
 }
 
 bool ndFlow::HasTLSSubjectDN(void) const {
-    return ((GetMasterProtocol() == ND_PROTO_TLS ||
-              detected_protocol == ND_PROTO_QUIC) &&
-      ssl.subject_dn != NULL);
+    const ndFlowMetadata *md = GetMetadata();
+    return (md != nullptr &&
+      (GetMasterProtocol() == ND_PROTO_TLS ||
+        detected_protocol == ND_PROTO_QUIC) &&
+      md->ssl.subject_dn != NULL);
 }
 
 bool ndFlow::HasTLSClientJA3(void) const {
-    return (GetMasterProtocol() == ND_PROTO_TLS &&
-      ssl.client_ja3[0] != '\0');
+    const ndFlowMetadata *md = GetMetadata();
+    return (md != nullptr && GetMasterProtocol() == ND_PROTO_TLS &&
+      md->ssl.client_ja3[0] != '\0');
 }
 
 bool ndFlow::HasTLSServerJA3(void) const {
-    return (GetMasterProtocol() == ND_PROTO_TLS &&
-      ssl.server_ja3[0] != '\0');
+    const ndFlowMetadata *md = GetMetadata();
+    return (md != nullptr && GetMasterProtocol() == ND_PROTO_TLS &&
+      md->ssl.server_ja3[0] != '\0');
 }
 
 bool ndFlow::HasBTInfoHash(void) const {
-    return (detected_protocol == ND_PROTO_BITTORRENT &&
-      bt.info_hash_valid);
+    const ndFlowMetadata *md = GetMetadata();
+    return (md != nullptr &&
+      detected_protocol == ND_PROTO_BITTORRENT &&
+      md->bt.info_hash_valid);
 }
 
 bool ndFlow::HasSSDPUserAgent(void) const {
-    return (GetMasterProtocol() == ND_PROTO_SSDP &&
-      http.user_agent[0] != '\0');
+    const ndFlowMetadata *md = GetMetadata();
+    return (md != nullptr && GetMasterProtocol() == ND_PROTO_SSDP &&
+      md->http.user_agent[0] != '\0');
 }
 
 #if 0
@@ -334,11 +442,13 @@ bool ndFlow::HasMiningVariant(void) const
 }
 #endif
 bool ndFlow::HasMDNSDomainName(void) const {
-    return (detected_protocol == ND_PROTO_MDNS &&
-      mdns.domain_name[0] != '\0');
+    const ndFlowMetadata *md = GetMetadata();
+    return (md != nullptr && detected_protocol == ND_PROTO_MDNS &&
+      md->mdns.domain_name[0] != '\0');
 }
 
 void ndFlow::Print(uint8_t pflags) const {
+    const ndFlowMetadata *md = GetMetadata();
     bool multiline = false;
     ndDebugLogStream dls(ndDebugLogStream::DLT_FLOW);
 
@@ -470,7 +580,7 @@ void ndFlow::Print(uint8_t pflags) const {
                 dls << endl
                     << setw(iface->ifname.size()) << " "
                     << ":";
-                dls << " MDNS/DN: " << mdns.domain_name;
+                dls << " MDNS/DN: " << md->mdns.domain_name;
             }
 
             if (HasDhcpFingerprint() || HasDhcpClassIdent()) {
@@ -478,23 +588,23 @@ void ndFlow::Print(uint8_t pflags) const {
                     << setw(iface->ifname.size()) << " "
                     << ":";
                 if (HasDhcpFingerprint())
-                    dls << " DHCP/FP: " << dhcp.fingerprint;
+                    dls << " DHCP/FP: " << md->dhcp.fingerprint;
                 if (HasDhcpClassIdent())
-                    dls << " DHCP/CI: " << dhcp.class_ident;
+                    dls << " DHCP/CI: " << md->dhcp.class_ident;
             }
 
             if (HasHttpUserAgent() || HasSSDPUserAgent()) {
                 dls << endl
                     << setw(iface->ifname.size()) << " "
                     << ":";
-                dls << " HTTP/UA: " << http.user_agent;
+                dls << " HTTP/UA: " << md->http.user_agent;
             }
 
             if (HasHttpURL()) {
                 dls << endl
                     << setw(iface->ifname.size()) << " "
                     << ":";
-                dls << " URL: " << http.url;
+                dls << " URL: " << md->http.url;
             }
 
             if (HasSSHClientAgent() || HasSSHServerAgent()) {
@@ -502,25 +612,25 @@ void ndFlow::Print(uint8_t pflags) const {
                     << setw(iface->ifname.size()) << " "
                     << ":";
                 if (HasSSHClientAgent())
-                    dls << " SSH/CA: " << ssh.client_agent;
+                    dls << " SSH/CA: " << md->ssh.client_agent;
                 if (HasSSHServerAgent())
-                    dls << " SSH/SA: " << ssh.server_agent;
+                    dls << " SSH/SA: " << md->ssh.server_agent;
             }
 
             if ((GetMasterProtocol() == ND_PROTO_TLS ||
                   detected_protocol == ND_PROTO_QUIC) &&
-              (ssl.version || ssl.cipher_suite))
+              (GetTLSVersion() || GetTLSCipherSuite()))
             {
                 dls << endl
                     << setw(iface->ifname.size()) << " "
                     << ": ";
                 dls << "V: 0x" << setfill('0') << setw(4) << hex
-                    << ssl.version << setfill(' ') << dec;
+                    << GetTLSVersion() << setfill(' ') << dec;
 
-                if (ssl.cipher_suite) {
+                if (GetTLSCipherSuite()) {
                     dls << " "
                         << "CS: 0x" << setfill('0')
-                        << setw(4) << hex << ssl.cipher_suite
+                        << setw(4) << hex << GetTLSCipherSuite()
                         << setfill(' ') << dec;
                 }
             }
@@ -532,7 +642,7 @@ void ndFlow::Print(uint8_t pflags) const {
                 if (HasTLSClientSNI())
                     dls << " TLS/SNI: " << host_server_name;
                 if (HasTLSServerCN())
-                    dls << " TLS/CN: " << ssl.server_cn;
+                    dls << " TLS/CN: " << md->ssl.server_cn;
             }
 
             if (HasTLSIssuerDN() || HasTLSSubjectDN()) {
@@ -540,9 +650,9 @@ void ndFlow::Print(uint8_t pflags) const {
                     << setw(iface->ifname.size()) << " "
                     << ":";
                 if (HasTLSIssuerDN())
-                    dls << " TLS/IDN: " << ssl.issuer_dn;
+                    dls << " TLS/IDN: " << md->ssl.issuer_dn;
                 if (HasTLSSubjectDN())
-                    dls << " TLS/SDN: " << ssl.subject_dn;
+                    dls << " TLS/SDN: " << md->ssl.subject_dn;
             }
         }
 
@@ -620,9 +730,9 @@ void ndFlow::UpdateLowerMaps(void) {
 
     switch (tunnel_type) {
     case TUNNEL_GTP:
-        if (gtp.lower_map == LOWER_UNKNOWN) {
-            GetLowerMap(gtp.lower_type, gtp.upper_type,
-              gtp.lower_map, gtp.other_type);
+        if (gtp != nullptr && gtp->lower_map == LOWER_UNKNOWN) {
+            GetLowerMap(gtp->lower_type, gtp->upper_type,
+              gtp->lower_map, gtp->other_type);
         }
         break;
     }
@@ -30,6 +30,7 @@
 #include <algorithm>
 #include <cerrno>
 #include <iostream>
+#include <set>
 
 #if defined(_ND_USE_LIBTCMALLOC) && \
   defined(HAVE_GPERFTOOLS_MALLOC_EXTENSION_H)
@@ -40,6 +41,7 @@
 
 #include "nd-config.hpp"
 #include "nd-detection.hpp"
+#include "nd-flow-snapshot.hpp"
 #include "nd-instance.hpp"
 #include "nd-util.hpp"
 #ifdef _ND_USE_LIBPCAP
@@ -48,6 +50,9 @@
 #ifdef _ND_USE_TPACKETV3
 #include "nd-capture-tpv3.hpp"
 #endif
+#ifdef _ND_USE_AF_XDP
+#include "nd-capture-xdp.hpp"
+#endif
 #ifdef _ND_USE_NFQUEUE
 #include "nd-capture-nfq.hpp"
 #endif
@@ -66,25 +71,40 @@ ndInstanceStatus::ndInstanceStatus()
   defined(HAVE_GPERFTOOLS_MALLOC_EXTENSION_H))
     tcm_alloc_kb(0), tcm_alloc_kb_prev(0),
 #endif
-    dhc_status(false), dhc_size(0) {
+    dhc_status(false), dhc_size(0), dpi_queue_depth(0),
+    dpi_queue_bytes(0), dpi_queue_high_water(0),
+    dpi_queue_latency_us(0), dpi_queue_latency_max_us(0),
+    dpi_wakeups(0), dpi_steals(0), dpi_cache_hits(0),
+    dpi_cache_misses(0), dpi_cache_entries(0) {
     flows = 0;
+    flows_bytes = 0;
     cpus = sysconf(_SC_NPROCESSORS_ONLN);
 }
 
 ndInstance::ndInstance(const string &tag)
   : ndThread(tag, -1, true), exit_code(EXIT_FAILURE),
     dns_hint_cache(nullptr), flow_hash_cache(nullptr),
-    flow_buckets(nullptr),
+    detection_cache(nullptr), flow_buckets(nullptr), flow_admission(nullptr),
 #ifdef _ND_USE_NETLINK
     netlink(nullptr),
 #endif
 #ifdef _ND_USE_CONNTRACK
     thread_conntrack(nullptr),
 #endif
+    dpi_scheduler(nullptr), ndpi_loader(nullptr),
+    ndpi_reload_pending(false), flow_timers(time(NULL)),
+    flow_tick(0), flow_bucket_next(0), dpi_inline_next(0),
     tag(tag.empty() ? PACKAGE_TARNAME : tag),
     self(PACKAGE_TARNAME), self_pid(-1),
     conf_filename(ND_CONF_FILE_NAME) {
     terminate_force = false;
+
+    flow_evict_pending = 0;
+    flows_evicting = 0;
+    flows_evicting_bytes = 0;
+
+    flow_evicted.reserve(ND_FLOW_EVICT_PENDING);
+    flow_evicted_batch.reserve(ND_FLOW_EVICT_PENDING);
 }
 
 ndInstance::~ndInstance() {
@@ -95,6 +115,15 @@ ndInstance::~ndInstance() {
 
     api_manager.Terminate();
 
+    if (ndpi_loader != nullptr) {
+        delete ndpi_loader;
+        ndpi_loader = nullptr;
+    }
+
+    // Stop moving flows between detection threads before any of
+    // them are destroyed.
+    if (dpi_scheduler != nullptr) dpi_scheduler->Disable();
+
     for (unsigned p = 0; p < 2; p++) {
 #ifdef _ND_USE_CONNTRACK
         if (ndGC_USE_CONNTRACK && thread_conntrack) {
@@ -115,6 +144,13 @@ ndInstance::~ndInstance() {
             thread_detection.clear();
     }
 
+    if (dpi_scheduler != nullptr) {
+        delete dpi_scheduler;
+        dpi_scheduler = nullptr;
+    }
+
+    DestroyDetectionInline();
+
     if (dns_hint_cache != nullptr) {
         delete dns_hint_cache;
         dns_hint_cache = nullptr;
@@ -125,6 +161,16 @@ ndInstance::~ndInstance() {
         flow_hash_cache = nullptr;
     }
 
+    if (detection_cache != nullptr) {
+        delete detection_cache;
+        detection_cache = nullptr;
+    }
+
+    if (flow_admission != nullptr) {
+        delete flow_admission;
+        flow_admission = nullptr;
+    }
+
     if (flow_buckets != nullptr) {
         delete flow_buckets;
         flow_buckets = nullptr;
@@ -1364,7 +1410,7 @@ bool ndInstance::DisplayAgentStatus(void) {
           (unsigned long)jstatus["flows_expired"].get<unsigned>());
 
         fprintf(stderr, "%s minimum flow size: %lu\n", ND_I_INFO,
-          sizeof(ndFlow) + sizeof(struct ndpi_flow_struct));
+          ndFlow::GetMinimumSize());
 
         fprintf(stderr, "%s CPU cores: %u\n", ND_I_INFO,
           jstatus["cpu_cores"].get<unsigned>());
@@ -1609,6 +1655,7 @@ int ndInstance::Run(void) {
     CheckAgentUUID();
 
     ndpi_global_init();
+    nd_ndpi_config(ndpi_config);
 
     ndInterface::UpdateAddrs(interfaces);
 
@@ -1628,12 +1675,29 @@ int ndInstance::Run(void) {
         }
     }
 
-    flow_buckets = new ndFlowMap(ndGC.fm_buckets);
+    if (ndGC.max_detection_cache > 0) {
+        detection_cache = new ndDetectionCache(
+          ndGC.max_detection_cache, ndGC.ttl_detection_cache);
+        if (detection_cache == nullptr) {
+            throw ndSystemException(__PRETTY_FUNCTION__,
+              "new ndDetectionCache", ENOMEM);
+        }
+    }
+
+    flow_buckets = new ndFlowMap(ndGC.fm_buckets, ndGC.fm_shards);
     if (flow_buckets == nullptr) {
         throw ndSystemException(__PRETTY_FUNCTION__,
           "new ndFlowMap", ENOMEM);
     }
 
+    if (ndGC.flow_admit_rate > 0) {
+        flow_admission = new ndFlowAdmission(ndGC.flow_admit_rate);
+        if (flow_admission == nullptr) {
+            throw ndSystemException(__PRETTY_FUNCTION__,
+              "new ndFlowAdmission", ENOMEM);
+        }
+    }
+
 #ifdef _ND_USE_NETLINK
     if (ndGC_USE_NETLINK) {
         netlink = new ndNetlink();
@@ -1664,6 +1728,8 @@ int ndInstance::Run(void) {
           (int16_t)status.cpus :
           ndGC.ca_detection_cores;
 
+        dpi_budget.Load();
+
         for (int16_t i = 0; i < cpus; i++) {
             thread_detection[i] = new ndDetectionThread(cpu,
               string("dpi") + to_string(cpu),
@@ -1673,12 +1739,22 @@ int ndInstance::Run(void) {
 #ifdef _ND_USE_CONNTRACK
               (! ndGC_USE_CONNTRACK) ? nullptr : thread_conntrack,
 #endif
-              dns_hint_cache, flow_hash_cache, (uint8_t)cpu);
-
-            thread_detection[i]->Create();
+              dns_hint_cache, flow_hash_cache, detection_cache,
+              (uint8_t)cpu);
 
             if (++cpu == cpus) cpu = 0;
         }
+
+        dpi_scheduler = new ndDetectionScheduler(thread_detection);
+        if (dpi_scheduler == nullptr) {
+            throw ndSystemException(__PRETTY_FUNCTION__,
+              "new ndDetectionScheduler", ENOMEM);
+        }
+
+        for (auto &it : thread_detection) {
+            it.second->SetScheduler(dpi_scheduler);
+            it.second->Create();
+        }
     }
 #ifdef _ND_USE_CONNTRACK
     catch (ndConntrackThreadException &e) {
@@ -1825,6 +1901,7 @@ void *ndInstance::ndInstance::Entry(void) {
                 exit_code = EXIT_FAILURE;
                 goto ndInstance_EntryReturn;
             }
+            ReloadDetectionModules();
             ndGC.Close();
             break;
         case ndIPC_TERMINATE:
@@ -1853,6 +1930,9 @@ void *ndInstance::ndInstance::Entry(void) {
               tag.c_str(), ipc, "Ignored");
         }
 
+        ProcessFlowTick();
+        ProcessDetectionModules();
+
         if (plugins.Reap()) {
             exit_code = EXIT_FAILURE;
             break;
@@ -1917,6 +1997,91 @@ bool ndInstance::Reload(bool broadcast) {
     return result;
 }
 
+void ndInstance::ReloadDetectionModules(void) {
+    ndGlobalConfig::Protocols protocols(ndGC.protocols);
+
+    if (! ndGC.LoadProtocols(conf_filename)) return;
+    if (ndGC.protocols == protocols) return;
+
+    nd_dprintf("%s: protocols changed, reloading nDPI...\n",
+      tag.c_str());
+
+    // Detection threads created from here on get the new
+    // configuration from the start.
+    nd_ndpi_config(ndpi_config);
+
+    if (ndpi_loader != nullptr) {
+        ndpi_reload_pending = true;
+        return;
+    }
+
+    LoadDetectionModules();
+}
+
+void ndInstance::LoadDetectionModules(void) {
+    ndpi_reload.clear();
+
+    for (auto &it : thread_detection)
+        ndpi_reload.push_back(it.second);
+    for (auto &it : thread_detection_inline)
+        ndpi_reload.push_back(it.second);
+
+    ndpi_loader = new ndNDPIModuleLoader(tag + "-ndpi",
+      ndpi_config, ndpi_reload.size());
+    if (ndpi_loader == nullptr) {
+        throw ndSystemException(__PRETTY_FUNCTION__,
+          "new ndNDPIModuleLoader", ENOMEM);
+    }
+
+    try {
+        ndpi_loader->Create();
+    }
+    catch (ndThreadException &e) {
+        delete ndpi_loader;
+        ndpi_loader = nullptr;
+        throw;
+    }
+}
+
+void ndInstance::ProcessDetectionModules(void) {
+    if (ndpi_loader == nullptr || ! ndpi_loader->HasTerminated())
+        return;
+
+    if (! ndpi_reload_pending) {
+        // Inline engines may have come and gone since; those
+        // created since were built with the new configuration.
+        // Threads switch over to their new modules between
+        // packets.
+        set<ndDetectionThread *> threads;
+        for (auto &it : thread_detection)
+            threads.insert(it.second);
+        for (auto &it : thread_detection_inline)
+            threads.insert(it.second);
+
+        for (auto &dpi : ndpi_reload) {
+            if (threads.find(dpi) == threads.end()) continue;
+
+            ndNDPIModule *module = ndpi_loader->Pop();
+            if (module == nullptr) break;
+
+            dpi->Reload(module);
+        }
+
+        // Results may differ under the new configuration.
+        if (detection_cache != nullptr) detection_cache->Clear();
+    }
+
+    delete ndpi_loader;
+    ndpi_loader = nullptr;
+    ndpi_reload.clear();
+
+    // Modules just built are stale; start over.
+    if (ndpi_reload_pending) {
+        ndpi_reload_pending = false;
+        LoadDetectionModules();
+    }
+}
+
 void ndInstance::CreateCaptureInterfaces(ndInterfaces &ifaces) {
     for (auto &r : ndGC.interfaces) {
         for (auto &i : r.second) {
@@ -1942,6 +2107,12 @@ void ndInstance::CreateCaptureInterfaces(ndInterfaces &ifaces) {
                     result.first->second->SetConfig(
                       static_cast<nd_config_nfq *>(i.second.second));
                     break;
+#endif
+#if defined(_ND_USE_AF_XDP)
+                case ndCT_XDP:
+                    result.first->second->SetConfig(
+                      static_cast<nd_config_xdp *>(i.second.second));
+                    break;
 #endif
                 default: break;
                 }
@@ -1992,14 +2163,33 @@ bool ndInstance::CreateCaptureThreads(ndInterfaces &ifaces,
               it.second->config_tpv3.fanout_instances < 2)
                 instances = 1;
 
+            bool rtc = it.second->config_tpv3.run_to_completion;
+            if (rtc && (instances < 2 ||
+                it.second->config_tpv3.fanout_mode != ndFOM_HASH))
+            {
+                nd_printf(
+                  "%s: WARNING: run-to-completion requires hash "
+                  "fanout: %s\n",
+                  tag.c_str(), it.second->ifname.c_str());
+                rtc = false;
+            }
+
             for (unsigned i = 0; i < instances; i++) {
+                int16_t thread_cpu = (instances > 1) ? cpu++ : -1;
+                uint8_t thread_addr =
+                  (it.second->role == ndIR_LAN) ? 0 : ++private_addr;
+
                 ndCaptureTPv3 *thread = new ndCaptureTPv3(
-                  (instances > 1) ? cpu++ : -1, it.second,
-                  thread_detection, dns_hint_cache,
-                  (it.second->role == ndIR_LAN) ? 0 : ++private_addr);
+                  thread_cpu, it.second, thread_detection,
+                  dns_hint_cache, thread_addr);
 
                 thread_group.push_back(thread);
 
+                if (rtc) {
+                    CreateDetectionInline(thread, thread_cpu,
+                      thread_addr);
+                }
+
                 if (cpu == (int16_t)status.cpus) cpu = 0;
             }
 
@@ -2029,6 +2219,29 @@ bool ndInstance::CreateCaptureThreads(ndInterfaces &ifaces,
             break;
         }
 #endif
+#if defined(_ND_USE_AF_XDP)
+        case ndCT_XDP:
+        {
+            unsigned instances = it.second->config_xdp.instances;
+            if (it.second->config_xdp.instances == 0)
+                instances = 1;
+
+            for (unsigned i = 0; i < instances; i++) {
+                ndCaptureXDP *thread = new ndCaptureXDP(
+                  (instances > 1) ? cpu++ : -1, it.second,
+                  thread_detection,
+                  i,  // instance_id
+                  dns_hint_cache,
+                  (it.second->role == ndIR_LAN) ? 0 : ++private_addr);
+
+                thread_group.push_back(thread);
+
+                if (cpu == (int16_t)status.cpus) cpu = 0;
+            }
+
+            break;
+        }
+#endif
         default:
             nd_printf(
               "%s: WARNING: Unsupported capture type: %s: "
@@ -2039,6 +2252,28 @@ bool ndInstance::CreateCaptureThreads(ndInterfaces &ifaces,
 
         if (! thread_group.size()) continue;
 
+        // Flows are confined to a single capture thread when it
+        // is the only thread for an interface, or when the kernel
+        // balances packets using a symmetric flow hash.
+        bool flow_affinity = (thread_group.size() == 1);
+#if defined(_ND_USE_TPACKETV3)
+        if (ndCT_TYPE(it.second->capture_type) == ndCT_TPV3 &&
+          it.second->config_tpv3.fanout_mode == ndFOM_HASH)
+            flow_affinity = true;
+#endif
+        if (ndGC.fm_shards > 0 && flow_affinity) {
+            for (auto &thread : thread_group) {
+                unsigned shard = flow_buckets->AllocateShard();
+                if (shard == 0) {
+                    nd_dprintf("%s: no free flow map shards: %s\n",
+                      tag.c_str(), it.second->ifname.c_str());
+                    break;
+                }
+
+                thread->SetFlowMapShard(shard);
+            }
+        }
+
         threads[it.second->ifname] = thread_group;
 
         thread_group.clear();
@@ -2046,6 +2281,11 @@ bool ndInstance::CreateCaptureThreads(ndInterfaces &ifaces,
         if (cpu == (int16_t)status.cpus) cpu = 0;
     }
 
+    // Restore flows before capture starts, so that they are
+    // found, classified, by their first packets.  A snapshot is
+    // only good for one start-up; later calls find none.
+    LoadFlowSnapshot(threads);
+
     for (auto &it : threads) {
         for (auto &it_instance : it.second)
             it_instance->Create();
@@ -2054,6 +2294,58 @@ bool ndInstance::CreateCaptureThreads(ndInterfaces &ifaces,
     return true;
 }
 
+ndDetectionThread *ndInstance::CreateDetectionInline(
+  ndCaptureThread *thread, int16_t cpu, uint8_t private_addr) {
+    int16_t id = dpi_inline_next;
+    while (id < (int16_t)thread_detection.size() ||
+      thread_detection_inline.find(id) !=
+        thread_detection_inline.end())
+    {
+        id = (id == INT16_MAX) ? (int16_t)thread_detection.size() :
+                                 (int16_t)(id + 1);
+    }
+
+    dpi_inline_next = (id == INT16_MAX) ? 0 : (int16_t)(id + 1);
+
+    // Never started; driven synchronously by the capture thread.
+    ndDetectionThread *dpi = new ndDetectionThread(cpu,
+      thread->GetTag() + "-dpi",
+#ifdef _ND_USE_NETLINK
+      netlink,
+#endif
+#ifdef _ND_USE_CONNTRACK
+      (! ndGC_USE_CONNTRACK) ? nullptr : thread_conntrack,
+#endif
+      dns_hint_cache, flow_hash_cache, detection_cache,
+      private_addr);
+
+    if (dpi == nullptr) {
+        throw ndSystemException(__PRETTY_FUNCTION__,
+          "new ndDetectionThread", ENOMEM);
+    }
+
+    thread_detection_inline[id] = dpi;
+    thread->SetDetectionInline(id, dpi);
+
+    nd_dprintf("%s: run-to-completion detection: %s: %hd\n",
+      tag.c_str(), thread->GetTag().c_str(), id);
+
+    return dpi;
+}
+
+void ndInstance::DestroyDetectionInline(void) {
+    for (auto &it : thread_detection_inline) delete it.second;
+    thread_detection_inline.clear();
+}
+
+void ndInstance::DestroyDetectionInline(int16_t id) {
+    auto it = thread_detection_inline.find(id);
+    if (it == thread_detection_inline.end()) return;
+
+    delete it->second;
+    thread_detection_inline.erase(it);
+}
+
 void ndInstance::DestroyCaptureThreads(
   nd_capture_threads &threads, bool expire_flows) {
     for (auto &it : threads) {
@@ -2061,19 +2353,30 @@ void ndInstance::DestroyCaptureThreads(
             it_instance->Terminate();
     }
     for (auto &it : threads) {
-        for (auto &it_instance : it.second)
+        for (auto &it_instance : it.second) {
+            flow_buckets->FreeShard(it_instance->GetFlowMapShard());
             delete it_instance;
+        }
     }
 
     threads.clear();
 
-    if (! expire_flows) return;
+    if (! expire_flows) {
+        DestroyDetectionInline();
+        return;
+    }
+
+    // Capture has stopped; save classified flows before they
+    // are expired, for the next start-up.
+    SaveFlowSnapshot();
 
     size_t count = 0, total = 0;
     size_t buckets = flow_buckets->GetBuckets();
+    uint64_t now = (uint64_t)time(NULL);
 
     for (size_t b = 0; b < buckets; b++) {
         auto &fm = flow_buckets->Acquire(b);
+        unsigned shard = flow_buckets->GetBucketShard(b);
 
         for (auto &it : fm) {
             if (it.second->flags.expired.load() == false &&
@@ -2081,6 +2384,10 @@ void ndInstance::DestroyCaptureThreads(
             {
                 total++;
                 if (ExpireFlow(it.second)) count++;
+
+                // Purged (once detection lets go) when this
+                // fires; see ExpireFlows().
+                ScheduleFlow(it.second, shard, now + 1);
             }
         }
 
@@ -2089,6 +2396,8 @@ void ndInstance::DestroyCaptureThreads(
 
     nd_dprintf("%s: forcibly expired %lu of %lu flow(s).\n",
       tag.c_str(), count, total);
+
+    DestroyDetectionInline();
 }
 
 size_t ndInstance::ReapCaptureThreads(nd_capture_threads &threads) {
@@ -2204,8 +2513,13 @@ bool ndInstance::ReloadCaptureThreads(nd_capture_threads &threads) {
 
             if (it != threads.end()) {
                 for (auto &i : it->second) {
+                    int16_t id = i->GetDetectionInlineId();
+
                     i->Terminate();
+                    flow_buckets->FreeShard(i->GetFlowMapShard());
                     delete i;
+
+                    DestroyDetectionInline(id);
                 }
 
                 threads.erase(it);
@@ -2320,32 +2634,461 @@ void ndInstance::UpdateStatus(void) {
         status.dhc_size = dns_hint_cache->GetSize();
     }
     else status.dhc_status = false;
+
+    if (flow_admission != nullptr)
+        flow_admission->GetOffenders(status.flow_offenders);
+
+    // Detection queues: current totals, and the deepest any one
+    // queue has been since the last update.  Latency and wake-ups
+    // are also since the last update.
+    uint64_t latency_ns = 0, latency_samples = 0;
+
+    status.dpi_queue_depth = 0;
+    status.dpi_queue_bytes = 0;
+    status.dpi_queue_high_water = 0;
+    status.dpi_queue_latency_max_us = 0;
+    status.dpi_wakeups = 0;
+    for (auto &it : thread_detection) {
+        ndDetectionQueue &queue = it.second->GetQueue();
+        uint64_t total_ns, samples, max_ns;
+
+        status.dpi_queue_depth += queue.GetDepth();
+        status.dpi_queue_bytes += queue.GetBytes();
+        status.dpi_queue_high_water = max(
+          status.dpi_queue_high_water, queue.GetHighWater());
+
+        queue.GetLatency(total_ns, samples, max_ns);
+        latency_ns += total_ns;
+        latency_samples += samples;
+        status.dpi_queue_latency_max_us = max(
+          status.dpi_queue_latency_max_us, max_ns / 1000);
+
+        status.dpi_wakeups += it.second->GetWakeups();
+    }
+
+    if (detection_cache != nullptr) {
+        status.dpi_cache_hits = detection_cache->GetHits();
+        status.dpi_cache_misses = detection_cache->GetMisses();
+        status.dpi_cache_entries = detection_cache->GetSize();
+    }
+
+    status.dpi_queue_latency_us = (latency_samples > 0) ?
+      latency_ns / latency_samples / 1000 :
+      0;
+
+    status.dpi_steals = (dpi_scheduler != nullptr) ?
+      dpi_scheduler->GetSteals() :
+      0;
+
+    dpi_budget.Update(status.dpi_budgets);
 }
 
 void ndInstance::DisplayDebugScoreboard(void) {
 }
 
+// Idle expiry time (seconds) of a flow, from when it was last
+// seen.  Closed (FIN/ACK) TCP flows use the shorter idle TTL.
+static inline uint64_t nd_flow_expiry(const nd_flow_ptr &flow) {
+    time_t ttl = ((flow->ip_protocol != IPPROTO_TCP) ?
+        ndGC.ttl_idle_flow :
+        ((flow->flags.tcp_fin_ack.load()) ? ndGC.ttl_idle_flow :
+                                             ndGC.ttl_idle_tcp_flow));
+
+    return (flow->ts_last_seen.load() / 1000) + ttl + 1;
+}
+
 bool ndInstance::ExpireFlow(nd_flow_ptr &flow) {
     if (flow->flags.detection_complete.load() == true)
         flow->flags.expired = true;
     else if (flow->flags.expiring.load() == false) {
         flow->flags.expiring = true;
 
-        auto it = thread_detection.find(flow->dpi_thread_id);
-        if (it != thread_detection.end()) {
-            it->second->QueuePacket(flow);
+        auto it = thread_detection_inline.find(flow->dpi_thread_id);
+        if (it != thread_detection_inline.end()) {
+            plugins.BroadcastProcessorEvent(
+              ndPluginProcessor::EVENT_FLOW_EXPIRING, flow);
+
+            it->second->ProcessInline(flow);
+
+            return true;
+        }
+
+        // The flow's run-to-completion engine was destroyed with
+        // its capture thread; finish detection on a queued thread
+        // instead.  nDPI flow state may move between threads.
+        if (flow->dpi_thread_id >= 0 &&
+          thread_detection.find(flow->dpi_thread_id) ==
+            thread_detection.end())
+            flow->dpi_thread_id = -1;
+
+        // No detection threads to finish on; expire as-is.
+        if (thread_detection.empty()) {
+            flow->flags.expired = true;
+            return false;
+        }
+
+        ndDetectionThread *thread = nullptr;
+        if (dpi_scheduler->QueuePacket(flow, thread)) {
+            thread->Notify();
 
             plugins.BroadcastProcessorEvent(
               ndPluginProcessor::EVENT_FLOW_EXPIRING, flow);
 
             return true;
         }
-        else flow->flags.expired = true;
+
+        // The detection queue is full.  Rather than expire the
+        // flow unclassified, try again when the caller's timer
+        // next fires (a second from now).
+        flow->flags.expiring = false;
     }
 
     return false;
 }
 
+bool ndInstance::PurgeFlow(nd_flow_ptr &flow, unsigned shard) {
+    // Referenced by the flow map, and by the caller.
+    if (flow.use_count() > 2) return false;
+
+    if (! flow_buckets->Delete(flow->key, shard, flow.get()))
+        return false;
+
+    status.flows_bytes -= flow->mem_charged;
+    status.flows--;
+    flow_totals.purged++;
+
+    plugins.BroadcastProcessorEvent(
+      ndPluginProcessor::EVENT_FLOW_EXPIRE, flow);
+
+    return true;
+}
+
+// Eviction rank of a flow; the lowest ranked of the sampled
+// flows is evicted (see ndGC.flow_evict).
+static inline pair<unsigned, uint64_t> nd_flow_evict_rank(
+  const nd_flow_ptr &flow) {
+    switch (ndGC.flow_evict) {
+    case ndFE_OLDEST_IDLE:
+        return make_pair(
+          (flow->stats.lower_packets.load() ||
+            flow->stats.upper_packets.load()) ?
+            1u :
+            0u,
+          flow->ts_first_seen);
+    case ndFE_DETECTION_COMPLETE:
+        return make_pair(
+          (flow->flags.detection_complete.load()) ? 0u : 1u,
+          flow->ts_last_seen.load());
+    default: return make_pair(0u, flow->ts_last_seen.load());
+    }
+}
+
+bool ndInstance::EvictFlow(const ndFlowKey &key, unsigned shard) {
+    if (ndGC.flow_evict == ndFE_DISABLED) return false;
+
+    // Reserve a pending slot first; released once announced by
+    // ProcessEvictedFlows().
+    if (flow_evict_pending.fetch_add(1) >= ND_FLOW_EVICT_PENDING) {
+        flow_evict_pending--;
+        return false;
+    }
+
+    size_t b = flow_buckets->GetBucket(key, shard);
+    auto &fm = flow_buckets->Acquire(b);
+    auto victim = fm.end();
+    pair<unsigned, uint64_t> victim_rank;
+    bool wrapped = false;
+
+    // Sample a few flows, starting from a slot picked by the new
+    // flow's hash, rather than walk the whole bucket.
+    auto i = fm.from((size_t)key.hash);
+    for (unsigned samples = 0; samples < ND_FLOW_EVICT_SAMPLES;
+         samples++, i++)
+    {
+        if (i == fm.end()) {
+            if (wrapped) break;
+            wrapped = true;
+            if ((i = fm.begin()) == fm.end()) break;
+        }
+
+        // Flows queued for (or undergoing) detection, already
+        // handed to the instance, or already expiring (or
+        // evicted), are left alone.
+        if (i->second.use_count() > 1 ||
+          i->second->flags.evicting.load() ||
+          i->second->flags.expiring.load() ||
+          i->second->flags.expired.load())
+            continue;
+
+        auto rank = nd_flow_evict_rank(i->second);
+
+        if (victim == fm.end() || rank < victim_rank) {
+            victim = i;
+            victim_rank = rank;
+        }
+    }
+
+    ndFlowEvicted evicted;
+    bool erased = false;
+
+    if (victim != fm.end()) {
+        evicted.flow = victim->second;
+        evicted.shard = shard;
+        evicted.bytes = 0;
+
+        if (evicted.flow->flags.detection_complete.load()) {
+            evicted.flow->flags.expired = true;
+
+            status.flows_bytes -= evicted.flow->mem_charged;
+            fm.erase(victim);
+            erased = true;
+        }
+        else {
+            // Left in place until detection is finalized, but no
+            // longer counted against the table.
+            evicted.flow->flags.evicting = true;
+            evicted.bytes = evicted.flow->mem_charged;
+        }
+    }
+
+    flow_buckets->Release(b);
+
+    if (! evicted.flow) {
+        flow_evict_pending--;
+        return false;
+    }
+
+    if (erased) status.flows--;
+    else {
+        flows_evicting++;
+        flows_evicting_bytes += evicted.bytes;
+    }
+
+    // Announced (or, if still being detected, expired) by the
+    // instance thread; see ProcessEvictedFlows().
+    lock_guard<mutex> ul(flow_evicted_lock);
+    flow_evicted.push_back(evicted);
+
+    return true;
+}
+
+void ndInstance::ProcessEvictedFlows(void) {
+    {
+        lock_guard<mutex> ul(flow_evicted_lock);
+        flow_evicted.swap(flow_evicted_batch);
+    }
+
+    uint64_t now = (uint64_t)time(NULL);
+
+    for (auto &it : flow_evicted_batch) {
+        nd_flow_ptr &flow = it.flow;
+
+        flow_evict_pending--;
+
+        // Erased from the flow map by EvictFlow().
+        if (flow->flags.evicting.load() == false) {
+            flow_totals.purged++;
+
+            plugins.BroadcastProcessorEvent(
+              ndPluginProcessor::EVENT_FLOW_EXPIRE, flow);
+
+            continue;
+        }
+
+        // Counted against the table again, for as long as it
+        // takes to finish detection and purge it (see
+        // ExpireFlows()).
+        flows_evicting--;
+        flows_evicting_bytes -= it.bytes;
+
+        if (flow->flags.expiring.load() == false &&
+          ExpireFlow(flow))
+            flow_totals.expiring++;
+
+        ScheduleFlow(flow, it.shard, now + 1);
+    }
+
+    flow_evicted_batch.clear();
+}
+
+void ndInstance::ScheduleFlow(nd_flow_ptr &flow, unsigned shard,
+  uint64_t due) {
+    if (due == 0) due = nd_flow_expiry(flow);
+
+    // An earlier (or identical) timer is already pending; it
+    // will be rescheduled when it fires, if need be.
+    if (flow->timer_due != 0 && flow->timer_due <= due) return;
+
+    flow->timer_due = due;
+    flow_timers.Schedule(flow->key, shard, due);
+}
+
+void ndInstance::ScheduleFlows(const vector<ndFlowKey> &keys,
+  unsigned shard) {
+    for (auto &key : keys) {
+        nd_flow_ptr flow = flow_buckets->Lookup(key, false, shard);
+        if (flow) ScheduleFlow(flow, shard);
+    }
+}
+
+void ndInstance::ExpireFlows(time_t now) {
+    vector<ndFlowTimer> timers;
+
+    flow_timers.Advance((uint64_t)now, timers);
+
+    for (auto &timer : timers) {
+        nd_flow_ptr flow = flow_buckets->Lookup(timer.key, false,
+          timer.shard);
+
+        // Purged, or superseded by an earlier timer.
+        if (! flow || flow->timer_due != timer.due) continue;
+
+        flow->timer_due = 0;
+
+        if (flow->flags.expired.load() == false &&
+          flow->flags.expiring.load() == false)
+        {
+            // Seen since the timer was set; reschedule, unless
+            // evicted.
+            if (! flow->flags.evicting.load() &&
+              nd_flow_expiry(flow) > (uint64_t)now)
+            {
+                ScheduleFlow(flow, timer.shard);
+                continue;
+            }
+
+            if (ExpireFlow(flow)) flow_totals.expiring++;
+        }
+
+        // Expired flows are purged here, once nothing else holds
+        // them.  Expiring flows are finalized by detection, which
+        // then marks them expired.  Either way, check back in a
+        // second.
+        if (flow->flags.expired.load() == false ||
+          ! PurgeFlow(flow, timer.shard))
+            ScheduleFlow(flow, timer.shard, (uint64_t)now + 1);
+    }
+}
+
+void ndInstance::ProcessFlowTick(void) {
+    time_t now = time(NULL);
+    if (now == flow_tick) return;
+
+    flow_tick = now;
+
+    ProcessEvictedFlows();
+    ExpireFlows(now);
+
+    // Walk the flow map a slice at a time, so as to visit every
+    // bucket once per update interval without locking them all
+    // back to back.  ProcessFlows() finishes any left over.
+    size_t buckets = flow_buckets->GetBuckets();
+    size_t slice = (buckets + ndGC.update_interval - 1) /
+      max(1u, ndGC.update_interval);
+
+    ProcessFlowBuckets(min(buckets, flow_bucket_next + slice));
+}
+
+static string nd_flow_snapshot_filename(void) {
+    switch (ndGC.flow_snapshot_save) {
+    case ndFSS_PERSISTENT:
+        return ndGC.path_state_persistent + ND_FLOW_SNAPSHOT_FILE_NAME;
+    case ndFSS_VOLATILE:
+        return ndGC.path_state_volatile + ND_FLOW_SNAPSHOT_FILE_NAME;
+    default: return string();
+    }
+}
+
+void ndInstance::SaveFlowSnapshot(void) {
+    string filename = nd_flow_snapshot_filename();
+    if (filename.empty()) return;
+
+    size_t count = 0;
+    if (ndFlowSnapshot::Save(filename, flow_buckets, count)) {
+        nd_dprintf("%s: saved %lu flow(s) to snapshot.\n",
+          tag.c_str(), count);
+    }
+}
+
+void ndInstance::LoadFlowSnapshot(nd_capture_threads &threads) {
+    string filename = nd_flow_snapshot_filename();
+    if (filename.empty()) return;
+
+    ndFlowSnapshot snapshot(filename);
+    if (! snapshot.Open()) {
+        unlink(filename.c_str());
+        return;
+    }
+
+    // Restored flows go in to the shared flow map shard, so
+    // interfaces captured in to private shards are skipped.
+    set<string> ifaces;
+    for (auto &it : threads) {
+        bool shared = true;
+        for (auto &it_instance : it.second) {
+            if (it_instance->GetFlowMapShard() != 0)
+                shared = false;
+        }
+        if (shared) ifaces.insert(it.first);
+    }
+
+    ndFlowArena *arena = new ndFlowArena(tag);
+    if (arena == nullptr) {
+        throw ndSystemException(__PRETTY_FUNCTION__,
+          "new ndFlowArena", ENOMEM);
+    }
+
+    time_t now = time(NULL);
+    size_t count = 0;
+
+    for (size_t i = 0; i < snapshot.GetEntries(); i++) {
+        const ndFlowSnapshotEntry &entry = snapshot.GetEntry(i);
+        string ifname(entry.ifname, strnlen(entry.ifname, IFNAMSIZ));
+
+        auto iface = interfaces.find(ifname);
+        if (iface == interfaces.end() ||
+          ifaces.find(ifname) == ifaces.end())
+            continue;
+
+        nd_flow_ptr flow = ndFlowSnapshot::Restore(entry,
+          iface->second, arena, apps);
+
+        // Went idle while we were down.
+        if (nd_flow_expiry(flow) <= (uint64_t)now) continue;
+
+        // Duplicate entry.
+        flow->mem_charged = flow->GetMemoryUsage();
+        if (! flow_buckets->Insert(flow->key, flow)) continue;
+
+        status.flows++;
+        status.flows_bytes += flow->mem_charged;
+
+        ScheduleFlow(flow, 0);
+
+        if (flow->stats.lower_packets.load() ||
+          flow->stats.upper_packets.load())
+        {
+            flow->flags.active = true;
+            flow_active.push_back(make_pair(flow->key, 0u));
+        }
+
+        plugins.BroadcastProcessorEvent(
+          ndPluginProcessor::EVENT_FLOW_NEW);
+        plugins.BroadcastProcessorEvent(
+          ndPluginProcessor::EVENT_DPI_COMPLETE, flow);
+
+        count++;
+    }
+
+    arena->Release();
+
+    // A snapshot is only good for one start-up.
+    unlink(filename.c_str());
+
+    nd_dprintf("%s: restored %lu of %lu flow(s) from snapshot.\n",
+      tag.c_str(), count, snapshot.GetEntries());
+}
+
 void ndInstance::ProcessUpdate(nd_capture_threads &threads) {
     UpdateStatus();
 #if ! defined(_ND_USE_LIBTCMALLOC) && defined(HAVE_MALLOC_TRIM)
@@ -2371,6 +3114,8 @@ void ndInstance::ProcessUpdate(nd_capture_threads &threads) {
 
     nd_interface_stats pkt_stats_ifaces;
 
+    vector<ndFlowKey> flow_keys, active_keys;
+
     for (auto &it : threads) {
         ndPacketStats pkt_stats;
         uint8_t state = it.second[0]->capture_state.load();
@@ -2379,8 +3124,19 @@ void ndInstance::ProcessUpdate(nd_capture_threads &threads) {
             it_instance->Lock();
 
             it_instance->GetCaptureStats(pkt_stats);
+            it_instance->GetFlowTimers(flow_keys);
+            it_instance->GetActiveFlows(active_keys);
 
             it_instance->Unlock();
+
+            unsigned shard = it_instance->GetFlowMapShard();
+
+            ScheduleFlows(flow_keys, shard);
+            flow_keys.clear();
+
+            for (auto &key : active_keys)
+                flow_active.push_back(make_pair(key, shard));
+            active_keys.clear();
         }
 
         pkt_stats_global += pkt_stats;
@@ -2407,117 +3163,133 @@ void ndInstance::ProcessUpdate(nd_capture_threads &threads) {
 }
 
 void ndInstance::ProcessFlows(void) {
-    time_t now = time(NULL);
-    size_t buckets = flow_buckets->GetBuckets();
-#ifdef _ND_PROCESS_FLOW_DEBUG
-    size_t tcp = 0, tcp_fin = 0, tcp_fin_ack_1 = 0,
-           tcp_fin_ack_gt2 = 0;
-#endif
-    size_t flows_pre_init = 0, flows_total = 0;
-
-    status.flows_purged = 0;
-    status.flows_expiring = 0;
-    status.flows_expired = 0;
-    status.flows_active = 0;
-    status.flows_in_use = 0;
-
     // flow_buckets->DumpBucketStats();
 
-    for (size_t b = 0; b < buckets; b++) {
-        auto &fm = flow_buckets->Acquire(b);
-        auto i = fm.begin();
-
-        flows_total += fm.size();
-
-        while (i != fm.end()) {
-#ifdef _ND_PROCESS_FLOW_DEBUG
-            if (i->second->ip_protocol == IPPROTO_TCP)
-                tcp++;
-            if (i->second->ip_protocol == IPPROTO_TCP &&
-              i->second->flags.tcp_fin.load())
-                tcp_fin++;
-            if (i->second->ip_protocol == IPPROTO_TCP &&
-              i->second->flags.tcp_fin.load() &&
-              i->second->flags.tcp_fin_ack.load() == 1)
-                tcp_fin_ack_1++;
-            if (i->second->ip_protocol == IPPROTO_TCP &&
-              i->second->flags.tcp_fin.load() &&
-              i->second->flags.tcp_fin_ack.load() >= 2)
-                tcp_fin_ack_gt2++;
-#endif
-            if (i->second.use_count() > 1)
-                status.flows_in_use++;
-
-            if (i->second->flags.expired.load() == false) {
-                time_t ttl = ((i->second->ip_protocol != IPPROTO_TCP) ?
-                    ndGC.ttl_idle_flow :
-                    ((i->second->flags.tcp_fin_ack.load()) ?
-                        ndGC.ttl_idle_flow :
-                        ndGC.ttl_idle_tcp_flow));
-
-                if (((time_t)(i->second->ts_last_seen.load() / 1000) +
-                      ttl) < now)
-                    if (ExpireFlow(i->second))
-                        status.flows_expiring++;
-            }
+    // Expiry, purging and the bucket walk are driven each tick;
+    // catch up, then finish this interval's walk.
+    ProcessFlowTick();
+    ProcessFlowBuckets(flow_buckets->GetBuckets());
 
-            if (i->second->flags.expired.load() == true) {
-                status.flows_expired++;
+    ResetFlows();
 
-                if (i->second.use_count() == 1) {
-                    plugins.BroadcastProcessorEvent(
-                      ndPluginProcessor::EVENT_FLOW_EXPIRE,
-                      i->second);
-
-                    i = fm.erase(i);
-                    status.flows_purged++;
-
-                    continue;
-                }
-            }
-            else {
-                if (i->second->flags.detection_init.load()) {
-                    if (i->second->stats.lower_packets.load() ||
-                      i->second->stats.upper_packets.load())
-                    {
-                        status.flows_active++;
-                        i->second->Reset();
-                    }
-                }
-                else {
-                    flows_pre_init++;
-                    // i->second->Print(ndFlow::PRINTF_ALL);
-                }
-            }
+    ndFlowMapTotals totals(flow_totals);
 
-            i++;
-        }
+    flow_totals.Clear();
+    flow_bucket_next = 0;
 
-        flow_buckets->Release(b);
-    }
+    status.flows_purged = totals.purged;
+    status.flows_expiring = totals.expiring;
+    status.flows_expired = totals.expired;
+    status.flows_active = totals.active;
+    status.flows_in_use = totals.in_use;
 
+    // The flow count is exact at the boundary; pre_init is
+    // sampled (see ndFlowMapTotals).
+    size_t flows = status.flows.load();
     size_t flows_new = 0;
 
-    if (status.flows_prev < flows_total)
-        flows_new = flows_total - status.flows_prev;
+    if (status.flows_prev < flows)
+        flows_new = flows - status.flows_prev;
+
+    status.flows_prev = flows;
 
-    status.flows_prev = status.flows.load();
-    status.flows -= status.flows_purged;
+    size_t flows_idle = flows;
+    flows_idle -= min(flows_idle, status.flows_active + totals.pre_init);
 
     nd_dprintf(
       "%s: new: %lu, pre-dpi: %lu, in-use: %lu, purged "
       "%lu, active: %lu, idle: %lu, expiring: %lu, "
-      "expired: %lu, total: %lu\n",
+      "expired: %lu, total: %lu, timers: %lu\n",
       tag.c_str(),
 
-      flows_new, flows_pre_init, status.flows_in_use,
+      flows_new, totals.pre_init, status.flows_in_use,
       status.flows_purged, status.flows_active,
-      flows_total - status.flows_active - flows_pre_init,
-      status.flows_expiring, status.flows_expired, flows_total);
+      flows_idle,
+      status.flows_expiring, status.flows_expired, flows,
+      flow_timers.GetSize());
 #ifdef _ND_PROCESS_FLOW_DEBUG
     nd_dprintf(
       "TCP: %lu, TCP+FIN: %lu, TCP+FIN+ACK1: %lu, "
       "TCP+FIN+ACK>=2: %lu\n",
-      tcp, tcp_fin, tcp_fin_ack_1, tcp_fin_ack_gt2);
+      totals.tcp, totals.tcp_fin, totals.tcp_fin_ack_1,
+      totals.tcp_fin_ack_gt2);
 #endif
 }
+
+void ndInstance::ResetFlows(void) {
+    vector<pair<ndFlowKey, unsigned>> pending;
+
+    for (auto &it : flow_active) {
+        nd_flow_ptr flow = flow_buckets->Lookup(it.first, false,
+          it.second);
+
+        if (! flow || flow->flags.expired.load()) continue;
+
+        // Flows awaiting detection keep counting until then.
+        if (flow->flags.detection_init.load() == false) {
+            pending.push_back(it);
+            continue;
+        }
+
+        flow->flags.active = false;
+        flow->Reset();
+
+        flow_totals.active++;
+    }
+
+    flow_active.swap(pending);
+}
+
+void ndInstance::ProcessFlowBuckets(size_t end) {
+    for (; flow_bucket_next < end; flow_bucket_next++)
+        ProcessFlowBucket(flow_bucket_next);
+}
+
+void ndInstance::ProcessFlowBucket(size_t b) {
+    ndFlowMapTotals &totals = flow_totals;
+    auto &fm = flow_buckets->Acquire(b);
+    auto i = fm.begin();
+    unsigned shard = flow_buckets->GetBucketShard(b);
+
+    while (i != fm.end()) {
+#ifdef _ND_PROCESS_FLOW_DEBUG
+        if (i->second->ip_protocol == IPPROTO_TCP) totals.tcp++;
+        if (i->second->ip_protocol == IPPROTO_TCP &&
+          i->second->flags.tcp_fin.load())
+            totals.tcp_fin++;
+        if (i->second->ip_protocol == IPPROTO_TCP &&
+          i->second->flags.tcp_fin.load() &&
+          i->second->flags.tcp_fin_ack.load() == 1)
+            totals.tcp_fin_ack_1++;
+        if (i->second->ip_protocol == IPPROTO_TCP &&
+          i->second->flags.tcp_fin.load() &&
+          i->second->flags.tcp_fin_ack.load() >= 2)
+            totals.tcp_fin_ack_gt2++;
+#endif
+        if (i->second.use_count() > 1) totals.in_use++;
+
+        // Expiry and purging are driven by flow_timers; this
+        // only catches flows which have no timer yet.
+        if (i->second->timer_due == 0) ScheduleFlow(i->second, shard);
+
+        if (i->second->flags.expired.load() == true)
+            totals.expired++;
+        else if (i->second->flags.detection_init.load() == false) {
+            totals.pre_init++;
+            // i->second->Print(ndFlow::PRINTF_ALL);
+        }
+
+        // Reconcile the flow's memory charge, as nDPI state and
+        // metadata come and go over its lifetime.
+        size_t bytes = i->second->GetMemoryUsage();
+        if (bytes != i->second->mem_charged) {
+            status.flows_bytes += bytes;
+            status.flows_bytes -= i->second->mem_charged;
+            i->second->mem_charged = bytes;
+        }
+
+        i++;
+    }
+
+    flow_buckets->Release(b);
+}
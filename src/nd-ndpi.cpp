@@ -22,15 +22,17 @@
 #include "config.h"
 #endif
 
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
 #include "nd-config.hpp"
+#include "nd-except.hpp"
 #include "nd-ndpi.hpp"
 #include "nd-protos.hpp"
 #include "nd-thread.hpp"
 #include "nd-util.hpp"
 
-static ndpi_init_prefs nd_ndpi_prefs = ndpi_no_prefs;
-static NDPI_PROTOCOL_BITMASK ndpi_protos;
-
 void ndpi_global_init(void) {
     nd_dprintf("Initializing nDPI v%s, API v%u...\n",
       ndpi_revision(), NDPI_API_VERSION);
@@ -41,35 +43,37 @@ void ndpi_global_init(void) {
 
     set_ndpi_malloc(nd_mem_alloc);
     set_ndpi_free(nd_mem_free);
+}
 
-    nd_ndpi_prefs = ndpi_no_prefs;
-
-    nd_ndpi_prefs |= ndpi_dont_init_risk_ptree;
-    nd_ndpi_prefs |= ndpi_dont_load_amazon_aws_list;
-    nd_ndpi_prefs |= ndpi_dont_load_asn_lists;
-    nd_ndpi_prefs |= ndpi_dont_load_azure_list;
-    nd_ndpi_prefs |= ndpi_dont_load_cachefly_list;
-    nd_ndpi_prefs |= ndpi_dont_load_cloudflare_list;
-    nd_ndpi_prefs |= ndpi_dont_load_crawlers_list;
-    nd_ndpi_prefs |= ndpi_dont_load_ethereum_list;
-    nd_ndpi_prefs |= ndpi_dont_load_google_cloud_list;
-    nd_ndpi_prefs |= ndpi_dont_load_google_list;
-    nd_ndpi_prefs |= ndpi_dont_load_icloud_private_relay_list;
-    nd_ndpi_prefs |= ndpi_dont_load_microsoft_list;
-    nd_ndpi_prefs |= ndpi_dont_load_mullvad_list;
-    nd_ndpi_prefs |= ndpi_dont_load_protonvpn_exit_nodes_list;
-    nd_ndpi_prefs |= ndpi_dont_load_protonvpn_list;
-    nd_ndpi_prefs |= ndpi_dont_load_tor_list;
-    nd_ndpi_prefs |= ndpi_dont_load_whatsapp_list;
-    nd_ndpi_prefs |= ndpi_dont_load_zoom_list;
-    nd_ndpi_prefs |= ndpi_enable_ja3_plus;
+void nd_ndpi_config(ndNDPIConfig &config) {
+    config.prefs = ndpi_no_prefs;
+
+    config.prefs |= ndpi_dont_init_risk_ptree;
+    config.prefs |= ndpi_dont_load_amazon_aws_list;
+    config.prefs |= ndpi_dont_load_asn_lists;
+    config.prefs |= ndpi_dont_load_azure_list;
+    config.prefs |= ndpi_dont_load_cachefly_list;
+    config.prefs |= ndpi_dont_load_cloudflare_list;
+    config.prefs |= ndpi_dont_load_crawlers_list;
+    config.prefs |= ndpi_dont_load_ethereum_list;
+    config.prefs |= ndpi_dont_load_google_cloud_list;
+    config.prefs |= ndpi_dont_load_google_list;
+    config.prefs |= ndpi_dont_load_icloud_private_relay_list;
+    config.prefs |= ndpi_dont_load_microsoft_list;
+    config.prefs |= ndpi_dont_load_mullvad_list;
+    config.prefs |= ndpi_dont_load_protonvpn_exit_nodes_list;
+    config.prefs |= ndpi_dont_load_protonvpn_list;
+    config.prefs |= ndpi_dont_load_tor_list;
+    config.prefs |= ndpi_dont_load_whatsapp_list;
+    config.prefs |= ndpi_dont_load_zoom_list;
+    config.prefs |= ndpi_enable_ja3_plus;
 
     // ndpi_disable_fully_encrypted_heuristic
     // ndpi_dont_init_libgcrypt
     // ndpi_enable_tcp_ack_payload_heuristic;
     // ndpi_track_flow_payload;
 
-    NDPI_BITMASK_RESET(ndpi_protos);
+    NDPI_BITMASK_RESET(config.protos);
 
     auto it = ndGC.protocols.find("ALL");
     if (it == ndGC.protocols.end()) {
@@ -80,7 +84,7 @@ void ndpi_global_init(void) {
 
     if (it != ndGC.protocols.end()) {
         if (strcasecmp(it->second.c_str(), "include") == 0) {
-            NDPI_BITMASK_SET_ALL(ndpi_protos);
+            NDPI_BITMASK_SET_ALL(config.protos);
             nd_dprintf("Enabled all protocols.\n");
         }
         else if (strcasecmp(it->second.c_str(), "exclude") == 0)
@@ -108,32 +112,33 @@ void ndpi_global_init(void) {
 
         switch (action) {
         case 0:
-            NDPI_ADD_PROTOCOL_TO_BITMASK(ndpi_protos, id);
+            NDPI_ADD_PROTOCOL_TO_BITMASK(config.protos, id);
             nd_dprintf("Enabled protocol: %s\n", it.first.c_str());
             break;
 
         case 1:
-            NDPI_DEL_PROTOCOL_FROM_BITMASK(ndpi_protos, id);
+            NDPI_DEL_PROTOCOL_FROM_BITMASK(config.protos, id);
             nd_dprintf("Disabled protocol: %s\n", it.first.c_str());
             break;
         }
     }
 
     if (ndGC.protocols.empty()) {
-        NDPI_BITMASK_SET_ALL(ndpi_protos);
+        NDPI_BITMASK_SET_ALL(config.protos);
         nd_dprintf("Enabled all protocols.\n");
     }
 
     for (auto &it : nd_ndpi_disabled_protos) {
-        NDPI_DEL_PROTOCOL_FROM_BITMASK(ndpi_protos, it);
+        NDPI_DEL_PROTOCOL_FROM_BITMASK(config.protos, it);
         if (ndGC.verbosity > 4)
             nd_dprintf("Banned protocol by ID: %hu\n", it);
     }
 }
 
-struct ndpi_detection_module_struct *nd_ndpi_init(void) {
+struct ndpi_detection_module_struct *nd_ndpi_init(
+  const ndNDPIConfig &config) {
     struct ndpi_detection_module_struct *ndpi = NULL;
-    ndpi = ndpi_init_detection_module(nd_ndpi_prefs);
+    ndpi = ndpi_init_detection_module(config.prefs);
 
     if (ndpi == NULL)
         throw ndThreadException(
@@ -155,7 +160,7 @@ struct ndpi_detection_module_struct *nd_ndpi_init(void) {
     ndpi_set_detection_preferences(ndpi,
       ndpi_pref_direction_detect_disable, 0);
 
-    ndpi_set_protocol_detection_bitmask2(ndpi, &ndpi_protos);
+    ndpi_set_protocol_detection_bitmask2(ndpi, &config.protos);
 
     ndpi_finalize_initialization(ndpi);
 
@@ -165,3 +170,187 @@ struct ndpi_detection_module_struct *nd_ndpi_init(void) {
 void nd_ndpi_free(struct ndpi_detection_module_struct *ndpi) {
     ndpi_exit_detection_module(ndpi);
 }
+
+ndNDPIModule::ndNDPIModule(const ndNDPIConfig &config)
+  : ndpi(nd_ndpi_init(config)), refs(1) { }
+
+ndNDPIModule::~ndNDPIModule() {
+    nd_ndpi_free(ndpi);
+}
+
+void ndNDPIModule::Release(void) {
+    if (refs.fetch_sub(1, memory_order_acq_rel) == 1) delete this;
+}
+
+ndNDPIModuleLoader::ndNDPIModuleLoader(const string &tag,
+  const ndNDPIConfig &config, size_t count)
+  : ndThread(tag), config(config), count(count) { }
+
+ndNDPIModuleLoader::~ndNDPIModuleLoader() {
+    Terminate();
+    Join();
+
+    for (auto &module : modules) module->Release();
+}
+
+void *ndNDPIModuleLoader::Entry(void) {
+    nd_dprintf("%s: building %lu nDPI detection modules...\n",
+      tag.c_str(), count);
+
+    while (modules.size() < count && ! ShouldTerminate()) {
+        ndNDPIModule *module = new ndNDPIModule(config);
+        if (module == nullptr) {
+            throw ndSystemException(__PRETTY_FUNCTION__,
+              "new ndNDPIModule", ENOMEM);
+        }
+
+        modules.push_back(module);
+    }
+
+    nd_dprintf("%s: built %lu of %lu nDPI detection modules.\n",
+      tag.c_str(), modules.size(), count);
+
+    return nullptr;
+}
+
+ndNDPIModule *ndNDPIModuleLoader::Pop(void) {
+    if (modules.empty()) return nullptr;
+
+    ndNDPIModule *module = modules.back();
+    modules.pop_back();
+
+    return module;
+}
+
+#define _ND_NDPI_FLOW_POOL_HDR_SIZE \
+    ((sizeof(ndNDPIFlowChunk) + 15) & ~((size_t)15))
+
+ndNDPIFlowPool::ndNDPIFlowPool(const string &tag, size_t max_cache)
+  : tag(tag), refs(1), returned(nullptr), free_list(nullptr),
+    max_cache(max_cache), cached(0), allocs(0), hits(0) { }
+
+ndNDPIFlowPool::~ndNDPIFlowPool() {
+    Reclaim();
+
+    while (free_list != nullptr) {
+        ndNDPIFlowChunk *chunk = free_list;
+        free_list = chunk->next;
+        free(chunk);
+    }
+
+    nd_dprintf("%s: nDPI flow pool destroyed, %lu allocations, "
+               "%lu cache hits.\n",
+      tag.c_str(), allocs, hits);
+}
+
+struct ndpi_flow_struct *ndNDPIFlowPool::Create(
+  ndNDPIModule *module) {
+    if (free_list == nullptr) Reclaim();
+
+    ndNDPIFlowChunk *chunk = free_list;
+
+    if (chunk != nullptr) {
+        free_list = chunk->next;
+        cached--;
+        hits++;
+    }
+    else {
+        chunk = static_cast<ndNDPIFlowChunk *>(malloc(
+          _ND_NDPI_FLOW_POOL_HDR_SIZE + sizeof(ndpi_flow_struct)));
+        if (chunk == nullptr) {
+            throw ndSystemException(__PRETTY_FUNCTION__,
+              "malloc", ENOMEM);
+        }
+
+        chunk->pool = this;
+    }
+
+    chunk->next = nullptr;
+    chunk->module = module;
+    module->Acquire();
+
+    allocs++;
+    refs.fetch_add(1, memory_order_relaxed);
+
+    struct ndpi_flow_struct *flow =
+      reinterpret_cast<struct ndpi_flow_struct *>(
+        reinterpret_cast<uint8_t *>(chunk) +
+        _ND_NDPI_FLOW_POOL_HDR_SIZE);
+
+    memset(flow, 0, sizeof(ndpi_flow_struct));
+
+    return flow;
+}
+
+void ndNDPIFlowPool::Put(struct ndpi_flow_struct *flow) {
+    ndNDPIFlowChunk *chunk = GetChunk(flow);
+
+    if (chunk->pool != this) {
+        Free(flow);
+        return;
+    }
+
+    ndpi_free_flow_data(flow);
+    chunk->module->Release();
+    Recycle(chunk);
+
+    // Never the last reference; the owner holds one.
+    refs.fetch_sub(1, memory_order_relaxed);
+}
+
+void ndNDPIFlowPool::Free(struct ndpi_flow_struct *flow) {
+    ndNDPIFlowChunk *chunk = GetChunk(flow);
+    ndNDPIFlowPool *pool = chunk->pool;
+
+    // Release nDPI's own allocations (host names, etc.) here,
+    // rather than leave them cached with the flow.
+    ndpi_free_flow_data(flow);
+    chunk->module->Release();
+
+    ndNDPIFlowChunk *head = pool->returned.load(memory_order_relaxed);
+    do {
+        chunk->next = head;
+    }
+    while (! pool->returned.compare_exchange_weak(head, chunk,
+      memory_order_release, memory_order_relaxed));
+
+    if (pool->refs.fetch_sub(1, memory_order_acq_rel) == 1)
+        delete pool;
+}
+
+void ndNDPIFlowPool::Release(void) {
+    if (refs.fetch_sub(1, memory_order_acq_rel) == 1) delete this;
+}
+
+ndNDPIFlowChunk *ndNDPIFlowPool::GetChunk(
+  struct ndpi_flow_struct *flow) {
+    return reinterpret_cast<ndNDPIFlowChunk *>(
+      reinterpret_cast<uint8_t *>(flow) - _ND_NDPI_FLOW_POOL_HDR_SIZE);
+}
+
+ndNDPIModule *ndNDPIFlowPool::GetModule(
+  struct ndpi_flow_struct *flow) {
+    return GetChunk(flow)->module;
+}
+
+void ndNDPIFlowPool::Reclaim(void) {
+    ndNDPIFlowChunk *chunk = returned.exchange(nullptr,
+      memory_order_acquire);
+
+    while (chunk != nullptr) {
+        ndNDPIFlowChunk *next = chunk->next;
+        Recycle(chunk);
+        chunk = next;
+    }
+}
+
+void ndNDPIFlowPool::Recycle(ndNDPIFlowChunk *chunk) {
+    if (cached >= max_cache) {
+        free(chunk);
+        return;
+    }
+
+    chunk->next = free_list;
+    free_list = chunk;
+    cached++;
+}
@@ -0,0 +1,174 @@
+// Netify Agent
+// Copyright (C) 2015-2023 eGloo Incorporated
+// <http://www.egloo.ca>
+//
+// This program is free software: you can redistribute it
+// and/or modify it under the terms of the GNU General
+// Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your
+// option) any later version.
+//
+// This program is distributed in the hope that it will be
+// useful, but WITHOUT ANY WARRANTY; without even the
+// implied warranty of MERCHANTABILITY or FITNESS FOR A
+// PARTICULAR PURPOSE.  See the GNU General Public License
+// for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this program.  If not, see
+// <http://www.gnu.org/licenses/>.
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <cerrno>
+#include <cstdlib>
+
+#include "nd-except.hpp"
+#include "nd-packet-pool.hpp"
+#include "nd-util.hpp"
+
+#define _ND_PKT_POOL_ALIGN(n) (((n) + 15) & ~((size_t)15))
+
+#define _ND_PKT_POOL_HDR_SIZE \
+    _ND_PKT_POOL_ALIGN(sizeof(ndPacketPoolChunk))
+
+#define _ND_PKT_POOL_OBJ_SIZE \
+    _ND_PKT_POOL_ALIGN(sizeof(ndPacketPooled))
+
+// Oversized requests are allocated directly and never cached.
+#define _ND_PKT_POOL_CLASS_NONE ND_PACKET_POOL_CLASSES
+
+static inline size_t nd_packet_pool_class_size(unsigned c) {
+    return ((size_t)ND_PACKET_POOL_MIN_SIZE << c);
+}
+
+static inline unsigned nd_packet_pool_class(size_t size) {
+    for (unsigned c = 0; c < ND_PACKET_POOL_CLASSES; c++) {
+        if (size <= nd_packet_pool_class_size(c)) return c;
+    }
+
+    return _ND_PKT_POOL_CLASS_NONE;
+}
+
+void ndPacketPooled::operator delete(void *ptr) {
+    ndPacketPool::Free(ptr);
+}
+
+ndPacketPool::ndPacketPool(const string &tag, size_t max_cache)
+  : tag(tag), refs(1), returned(nullptr), free_list{ nullptr },
+    max_cache(max_cache), cached(0), allocs(0), hits(0) { }
+
+ndPacketPool::~ndPacketPool() {
+    Reclaim();
+
+    for (unsigned c = 0; c < ND_PACKET_POOL_CLASSES; c++) {
+        while (free_list[c] != nullptr) {
+            ndPacketPoolChunk *chunk = free_list[c];
+            free_list[c] = chunk->next;
+            free(chunk);
+        }
+    }
+
+    nd_dprintf("%s: packet pool destroyed, %lu allocations, "
+               "%lu cache hits.\n",
+      tag.c_str(), allocs, hits);
+}
+
+ndPacket *ndPacketPool::Create(const ndPacket::status_flags &status,
+  uint16_t length, uint16_t caplen, const struct timeval &tv,
+  uint8_t *&data) {
+    uint8_t *base = static_cast<uint8_t *>(
+      Alloc(_ND_PKT_POOL_OBJ_SIZE + caplen));
+    data = base + _ND_PKT_POOL_OBJ_SIZE;
+
+    return new (base)
+      ndPacketPooled(status, length, caplen, data, tv);
+}
+
+void *ndPacketPool::Alloc(size_t size) {
+    size += _ND_PKT_POOL_HDR_SIZE;
+    unsigned size_class = nd_packet_pool_class(size);
+
+    ndPacketPoolChunk *chunk = nullptr;
+
+    if (size_class != _ND_PKT_POOL_CLASS_NONE) {
+        if (free_list[size_class] == nullptr) Reclaim();
+
+        if (free_list[size_class] != nullptr) {
+            chunk = free_list[size_class];
+            free_list[size_class] = chunk->next;
+            cached -= nd_packet_pool_class_size(size_class);
+            hits++;
+        }
+        else size = nd_packet_pool_class_size(size_class);
+    }
+
+    if (chunk == nullptr) {
+        chunk = static_cast<ndPacketPoolChunk *>(malloc(size));
+        if (chunk == nullptr) {
+            throw ndSystemException(__PRETTY_FUNCTION__,
+              "malloc", ENOMEM);
+        }
+
+        chunk->pool = this;
+        chunk->size_class = size_class;
+    }
+
+    chunk->next = nullptr;
+
+    allocs++;
+    refs.fetch_add(1, memory_order_relaxed);
+
+    return reinterpret_cast<uint8_t *>(chunk) + _ND_PKT_POOL_HDR_SIZE;
+}
+
+void ndPacketPool::Free(void *ptr) {
+    ndPacketPoolChunk *chunk = reinterpret_cast<ndPacketPoolChunk *>(
+      static_cast<uint8_t *>(ptr) - _ND_PKT_POOL_HDR_SIZE);
+
+    ndPacketPool *pool = chunk->pool;
+
+    if (chunk->size_class == _ND_PKT_POOL_CLASS_NONE) free(chunk);
+    else {
+        ndPacketPoolChunk *head = pool->returned.load(
+          memory_order_relaxed);
+        do {
+            chunk->next = head;
+        }
+        while (! pool->returned.compare_exchange_weak(head, chunk,
+          memory_order_release, memory_order_relaxed));
+    }
+
+    if (pool->refs.fetch_sub(1, memory_order_acq_rel) == 1)
+        delete pool;
+}
+
+void ndPacketPool::Release(void) {
+    if (refs.fetch_sub(1, memory_order_acq_rel) == 1) delete this;
+}
+
+void ndPacketPool::Reclaim(void) {
+    ndPacketPoolChunk *chunk = returned.exchange(nullptr,
+      memory_order_acquire);
+
+    while (chunk != nullptr) {
+        ndPacketPoolChunk *next = chunk->next;
+        Recycle(chunk);
+        chunk = next;
+    }
+}
+
+void ndPacketPool::Recycle(ndPacketPoolChunk *chunk) {
+    size_t size = nd_packet_pool_class_size(chunk->size_class);
+
+    if (cached + size > max_cache) {
+        free(chunk);
+        return;
+    }
+
+    chunk->next = free_list[chunk->size_class];
+    free_list[chunk->size_class] = chunk;
+    cached += size;
+}
@@ -548,6 +548,9 @@ const string &nd_get_version_and_features(void) {
 #ifdef _ND_USE_NFQUEUE
         ident << "; nfqueue";
 #endif
+#ifdef _ND_USE_AF_XDP
+        ident << "; xdp";
+#endif
 #ifdef _ND_USE_LIBTCMALLOC
         ident << "; tcmalloc";
 #endif